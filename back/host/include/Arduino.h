@@ -0,0 +1,13 @@
+#pragma once
+
+/**
+ * Minimal Arduino core for building the Z906 library on a Linux host.
+ */
+#include "HardwareSerial.h"
+#include <cstddef>
+#include <cstdint>
+
+unsigned long millis();
+unsigned long micros();
+void          delay(unsigned long);
+void          yield();
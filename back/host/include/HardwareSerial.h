@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#define DEC 10
+#define HEX 16
+
+// Only 8O1 is used by the Z906, other framings are not supported on host.
+#define SERIAL_8N1 0x1C
+#define SERIAL_8O1 0x3F
+
+typedef int SerialConfig;
+
+/**
+ * Host replacement for the Arduino Print class, enough for the Z906 library.
+ */
+class Print {
+public:
+    virtual ~Print() = default;
+
+    virtual size_t write(uint8_t) = 0;
+    virtual void   flush() {}
+
+    size_t print(const char *);
+    size_t print(unsigned long, int = DEC);
+    size_t print(long, int = DEC);
+    size_t print(unsigned int value, int base = DEC) {
+        return print(static_cast<unsigned long>(value), base);
+    }
+    size_t print(int value, int base = DEC) {
+        return print(static_cast<long>(value), base);
+    }
+    size_t print(unsigned char value, int base = DEC) {
+        return print(static_cast<unsigned long>(value), base);
+    }
+};
+
+/**
+ * Host replacement for the Arduino Stream class.
+ */
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read()      = 0;
+    virtual int peek()      = 0;
+};
+
+/**
+ * HardwareSerial implemented on top of a termios serial port.
+ *
+ * available() waits up to SERIAL_POLL_MS on epoll when nothing is buffered,
+ * so the busy-wait loops of the Z906 library sleep instead of spinning.
+ */
+class HardwareSerial : public Stream {
+public:
+    explicit HardwareSerial(int fd);
+    explicit HardwareSerial(const char *path);
+    ~HardwareSerial() override;
+
+    HardwareSerial(const HardwareSerial &)            = delete;
+    HardwareSerial &operator=(const HardwareSerial &) = delete;
+
+    void   begin(unsigned long, SerialConfig = SERIAL_8N1);
+    void   end();
+    int    available() override;
+    int    read() override;
+    int    peek() override;
+    size_t write(uint8_t) override;
+    void   flush() override;
+
+    explicit operator bool() const { return _fd >= 0; }
+    int      fd() const { return _fd; }
+
+private:
+    static constexpr int    SERIAL_POLL_MS          = 1;
+    static constexpr int    SERIAL_WRITE_TIMEOUT_MS = 1000;
+    static constexpr size_t RX_BUFFER_SIZE          = 256;
+
+    bool fill(int);
+    void fail();
+
+    int     _fd;
+    int     _epoll = -1;
+    bool    _owned;
+    uint8_t _rx[RX_BUFFER_SIZE];
+    size_t  _rx_head = 0;
+    size_t  _rx_len  = 0;
+};
+
+extern HardwareSerial Serial;
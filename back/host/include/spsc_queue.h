@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace z906remote {
+
+    /**
+     * Bounded lock-free queue for exactly one producer and one consumer thread.
+     * SIZE must be a power of two.
+     */
+    template <typename T, size_t SIZE> class SpscQueue {
+        static_assert(SIZE && (SIZE & (SIZE - 1)) == 0,
+                      "SpscQueue size must be a power of two");
+
+    public:
+        bool push(T &&item) {
+            const size_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail - _head.load(std::memory_order_acquire) == SIZE)
+                return false;
+            _items[tail & (SIZE - 1)] = std::move(item);
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T &item) {
+            const size_t head = _head.load(std::memory_order_relaxed);
+            if (head == _tail.load(std::memory_order_acquire))
+                return false;
+            item = std::move(_items[head & (SIZE - 1)]);
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Oldest item, or nullptr when empty (consumer only).
+         */
+        T *front() {
+            const size_t head = _head.load(std::memory_order_relaxed);
+            if (head == _tail.load(std::memory_order_acquire))
+                return nullptr;
+            return &_items[head & (SIZE - 1)];
+        }
+
+        size_t size() const {
+            return _tail.load(std::memory_order_acquire) -
+                   _head.load(std::memory_order_acquire);
+        }
+
+    private:
+        T                   _items[SIZE];
+        std::atomic<size_t> _head{0};
+        std::atomic<size_t> _tail{0};
+    };
+
+} // namespace z906remote
@@ -0,0 +1,28 @@
+#include "Arduino.h"
+#include <chrono>
+#include <thread>
+
+namespace {
+    const std::chrono::steady_clock::time_point START =
+        std::chrono::steady_clock::now();
+}
+
+unsigned long millis() {
+    return static_cast<unsigned long>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - START)
+            .count());
+}
+
+unsigned long micros() {
+    return static_cast<unsigned long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - START)
+            .count());
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() { std::this_thread::yield(); }
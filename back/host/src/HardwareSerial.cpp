@@ -0,0 +1,208 @@
+#include "HardwareSerial.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <unistd.h>
+
+HardwareSerial Serial(STDOUT_FILENO);
+
+size_t Print::print(const char *str) {
+    size_t n = 0;
+    while (*str) n += write(static_cast<uint8_t>(*str++));
+    return n;
+}
+
+size_t Print::print(unsigned long value, int base) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%lu", value);
+    return print(buf);
+}
+
+size_t Print::print(long value, int base) {
+    if (base == HEX)
+        return print(static_cast<unsigned long>(value), base);
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%ld", value);
+    return print(buf);
+}
+
+/**
+ * Wrap an already open file descriptor, it is not closed on destruction.
+ */
+HardwareSerial::HardwareSerial(int fd) : _fd(fd), _owned(false) {}
+
+/**
+ * Open a serial device (e.g. /dev/ttyUSB0). It is configured by begin().
+ */
+HardwareSerial::HardwareSerial(const char *path)
+    : _fd(open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)),
+      _owned(true) {
+    if (_fd < 0)
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+}
+
+HardwareSerial::~HardwareSerial() { end(); }
+
+namespace {
+    /**
+     * termios speed of a baud rate, B0 if it is not supported.
+     */
+    speed_t speed_of(unsigned long baud) {
+        switch (baud) {
+        case 9600:
+            return B9600;
+        case 19200:
+            return B19200;
+        case 38400:
+            return B38400;
+        case 57600:
+            return B57600;
+        case 115200:
+            return B115200;
+        case 230400:
+            return B230400;
+        default:
+            return B0;
+        }
+    }
+} // namespace
+
+/**
+ * Configure the port in raw mode at the given baud rate and framing. On an
+ * unsupported rate or a port that cannot be configured the error is printed
+ * and the port is closed, so it no longer tests true.
+ */
+void HardwareSerial::begin(unsigned long baud, SerialConfig config) {
+    if (_fd < 0)
+        return;
+
+    const speed_t speed = speed_of(baud);
+    if (speed == B0) {
+        fprintf(stderr, "serial port: unsupported baud rate %lu\n", baud);
+        fail();
+        return;
+    }
+
+    struct termios tty;
+    if (tcgetattr(_fd, &tty) != 0) {
+        fprintf(stderr, "serial port: %s\n", strerror(errno));
+        fail();
+        return;
+    }
+    cfmakeraw(&tty);
+    tty.c_cflag &= ~(CSIZE | CSTOPB | PARENB | PARODD | CRTSCTS);
+    tty.c_cflag |= CS8 | CLOCAL | CREAD;
+    if (config == SERIAL_8O1)
+        tty.c_cflag |= PARENB | PARODD;
+    tty.c_cc[VMIN]  = 0;
+    tty.c_cc[VTIME] = 0;
+    if (cfsetspeed(&tty, speed) != 0 || tcsetattr(_fd, TCSANOW, &tty) != 0) {
+        fprintf(stderr, "serial port: %s\n", strerror(errno));
+        fail();
+        return;
+    }
+    tcflush(_fd, TCIOFLUSH);
+
+    if (_epoll < 0) {
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev = {};
+        ev.events             = EPOLLIN;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _fd, &ev);
+    }
+}
+
+void HardwareSerial::end() {
+    if (_epoll >= 0)
+        close(_epoll);
+    if (_owned && _fd >= 0)
+        close(_fd);
+    _epoll = -1;
+    if (_owned)
+        _fd = -1;
+}
+
+/**
+ * Give up on the port, a wrapped descriptor is left open but unused.
+ */
+void HardwareSerial::fail() {
+    end();
+    _fd = -1;
+}
+
+/**
+ * Read whatever is pending on the port into the RX buffer, waiting up to
+ * timeout milliseconds for data to arrive.
+ */
+bool HardwareSerial::fill(int timeout) {
+    if (_rx_head > 0) {
+        memmove(_rx, _rx + _rx_head, _rx_len);
+        _rx_head = 0;
+    }
+    if (_rx_len == RX_BUFFER_SIZE)
+        return true;
+
+    ssize_t n = ::read(_fd, _rx + _rx_len, RX_BUFFER_SIZE - _rx_len);
+    if (n <= 0 && timeout > 0 && _epoll >= 0) {
+        struct epoll_event ev;
+        if (epoll_wait(_epoll, &ev, 1, timeout) > 0)
+            n = ::read(_fd, _rx + _rx_len, RX_BUFFER_SIZE - _rx_len);
+    }
+    if (n <= 0)
+        return false;
+
+    _rx_len += static_cast<size_t>(n);
+    return true;
+}
+
+int HardwareSerial::available() {
+    if (_fd >= 0)
+        fill(_rx_len == 0 ? SERIAL_POLL_MS : 0);
+    return static_cast<int>(_rx_len);
+}
+
+int HardwareSerial::read() {
+    if (_rx_len == 0 && (_fd < 0 || !fill(0)))
+        return -1;
+    _rx_len--;
+    return _rx[_rx_head++];
+}
+
+int HardwareSerial::peek() {
+    if (_rx_len == 0 && (_fd < 0 || !fill(0)))
+        return -1;
+    return _rx[_rx_head];
+}
+
+/**
+ * Write a byte, waiting up to SERIAL_WRITE_TIMEOUT_MS for room while the TX
+ * buffer of the port is full.
+ */
+size_t HardwareSerial::write(uint8_t byte) {
+    while (_fd >= 0) {
+        const ssize_t n = ::write(_fd, &byte, 1);
+        if (n == 1)
+            return 1;
+        if (n < 0 && errno == EAGAIN) {
+            struct pollfd pfd = {_fd, POLLOUT, 0};
+            const int     ready = poll(&pfd, 1, SERIAL_WRITE_TIMEOUT_MS);
+            if (ready == 0 || (ready < 0 && errno != EINTR) ||
+                (ready > 0 && !(pfd.revents & POLLOUT)))
+                break;
+        } else if (n < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Wait until all output has been transmitted.
+ */
+void HardwareSerial::flush() {
+    if (_fd >= 0 && _owned)
+        tcdrain(_fd);
+}
@@ -0,0 +1,196 @@
+/**
+ * Simulated Z906 amplifier on pseudo-terminals.
+ * Prints the path of one pty per simulated unit, to be passed to z906d.
+ */
+#include <Z906.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    volatile bool running = true;
+
+    void on_signal(int) { running = false; }
+
+    // Status frame layout, see Z906::update()
+    const uint8_t PAYLOAD_LENGTH = 0x13;
+    const size_t  FRAME_LENGTH   = PAYLOAD_LENGTH + 4;
+    const uint8_t FX_OFFSET[6]   = {0x0D, 0x0B, 0x0E, 0x09, 0x0A, 0x0C};
+    const uint8_t MAX_VOL        = 43;
+
+    uint8_t lrc(const uint8_t *data, size_t length) {
+        uint8_t sum = 0;
+        for (size_t i = 1; i < length - 1; i++) sum -= data[i];
+        return sum;
+    }
+
+    struct Amp {
+        int                  master;
+        int                  slave;
+        uint8_t              status[FRAME_LENGTH];
+        std::vector<uint8_t> rx;
+
+        void reply(uint8_t *frame, size_t length) {
+            frame[length - 1] = lrc(frame, length);
+            (void)!write(master, frame, length);
+        }
+
+        void ack(uint8_t cmd) {
+            uint8_t frame[ACK_TOTAL_LENGTH] = {0xAA, 0x0A, 0x01, cmd, 0};
+            reply(frame, sizeof(frame));
+        }
+
+        void level(uint8_t offset, int delta) {
+            const int value = status[offset] + delta;
+            if (value >= 0 && value <= MAX_VOL)
+                status[offset] = static_cast<uint8_t>(value);
+        }
+
+        void effect(uint8_t fx) { status[FX_OFFSET[status[0x07]]] = fx; }
+
+        void command(uint8_t cmd) {
+            switch (cmd) {
+            case GET_STATUS:
+                reply(status, FRAME_LENGTH);
+                return;
+            case GET_TEMP: {
+                uint8_t frame[TEMP_TOTAL_LENGTH] = {0xAA, 0x0A, 0x0C, 0x05, 0,
+                                                    0,    0,    42,   0,    0};
+                reply(frame, sizeof(frame));
+                return;
+            }
+            case GET_INPUT_GAIN: {
+                uint8_t frame[GAIN_TOTAL_LENGTH] = {0xAA, 0x0A, 0x08, 0x03,
+                                                    0x00, 0x12, 0x34, 0};
+                reply(frame, sizeof(frame));
+                return;
+            }
+            case SELECT_INPUT_1: status[0x07] = 0; break;
+            case SELECT_INPUT_2: status[0x07] = 1; break;
+            case SELECT_INPUT_3: status[0x07] = 2; break;
+            case SELECT_INPUT_4: status[0x07] = 3; break;
+            case SELECT_INPUT_5: status[0x07] = 4; break;
+            case SELECT_INPUT_AUX: status[0x07] = 5; break;
+            case LEVEL_MAIN_UP: level(MAIN_LEVEL, 1); break;
+            case LEVEL_MAIN_DOWN: level(MAIN_LEVEL, -1); break;
+            case LEVEL_REAR_UP: level(REAR_LEVEL, 1); break;
+            case LEVEL_REAR_DOWN: level(REAR_LEVEL, -1); break;
+            case LEVEL_CENTER_UP: level(CENTER_LEVEL, 1); break;
+            case LEVEL_CENTER_DOWN: level(CENTER_LEVEL, -1); break;
+            case LEVEL_SUB_UP: level(SUB_LEVEL, 1); break;
+            case LEVEL_SUB_DOWN: level(SUB_LEVEL, -1); break;
+            case PWM_OFF: status[0x14] = 1; break;
+            case PWM_ON: status[0x14] = 0; break;
+            case MUTE_ON: status[0x08] = 1; break;
+            case MUTE_OFF: status[0x08] = 0; break;
+            case SELECT_EFFECT_3D: effect(EFFECT_3D); break;
+            case SELECT_EFFECT_21: effect(EFFECT_21); break;
+            case SELECT_EFFECT_41: effect(EFFECT_41); break;
+            case SELECT_EFFECT_NO: effect(EFFECT_NO); break;
+            default: break;
+            }
+            status[FRAME_LENGTH - 1] = lrc(status, FRAME_LENGTH);
+            ack(cmd);
+        }
+
+        /**
+         * Consume the received bytes: a full status frame written back by
+         * Z906::cmd(cmdA, cmdB), or single byte commands.
+         */
+        void process() {
+            size_t pos = 0;
+            while (pos < rx.size()) {
+                if (rx[pos] != 0xAA) {
+                    command(rx[pos++]);
+                    continue;
+                }
+                if (rx.size() - pos < 3)
+                    break;
+                const size_t length = rx[pos + 2] + 4U;
+                if (rx.size() - pos < length)
+                    break;
+                if (length == FRAME_LENGTH &&
+                    rx[pos + length - 1] == lrc(&rx[pos], length)) {
+                    for (uint8_t i = MAIN_LEVEL; i <= SUB_LEVEL; i++)
+                        status[i] = rx[pos + i] > MAX_VOL ? MAX_VOL : rx[pos + i];
+                    status[FRAME_LENGTH - 1] = lrc(status, FRAME_LENGTH);
+                    ack(GET_STATUS);
+                }
+                pos += length;
+            }
+            rx.erase(rx.begin(), rx.begin() + static_cast<long>(pos));
+        }
+    };
+
+    bool open_amp(Amp &amp) {
+        amp.master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (amp.master < 0 || grantpt(amp.master) < 0 || unlockpt(amp.master) < 0)
+            return false;
+
+        // Keep the slave open so the master never sees a hangup between clients
+        amp.slave = open(ptsname(amp.master), O_RDWR | O_NOCTTY);
+        struct termios tty;
+        if (amp.slave < 0 || tcgetattr(amp.slave, &tty) < 0)
+            return false;
+        cfmakeraw(&tty);
+        tcsetattr(amp.slave, TCSANOW, &tty);
+
+        const uint8_t initial[FRAME_LENGTH] = {
+            0xAA, 0x0A, PAYLOAD_LENGTH,
+            20,   20,   20,   20, // main, rear, center, sub
+            0,    0,              // input, muted
+            3,    3,    0,    0,    3,    3, // fx 4, 5, 2, aux, 1, 3
+            0,    1,              // spdif, signal
+            1,    2,    3,        // version
+            0,    1,    0,        // stby, auto_stby, checksum
+        };
+        memcpy(amp.status, initial, FRAME_LENGTH);
+        amp.status[FRAME_LENGTH - 1] = lrc(amp.status, FRAME_LENGTH);
+        return true;
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    const int count = argc > 1 ? atoi(argv[1]) : 1;
+    if (count < 1) {
+        fprintf(stderr, "usage: %s [units]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    std::vector<Amp>    amps(static_cast<size_t>(count));
+    std::vector<pollfd> fds;
+    for (Amp &amp : amps) {
+        if (!open_amp(amp)) {
+            perror("pty");
+            return 1;
+        }
+        printf("%s\n", ptsname(amp.master));
+        fds.push_back({amp.master, POLLIN, 0});
+    }
+    fflush(stdout);
+
+    while (running) {
+        if (poll(fds.data(), fds.size(), 1000) <= 0)
+            continue;
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            uint8_t       buf[256];
+            const ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n <= 0)
+                continue;
+            amps[i].rx.insert(amps[i].rx.end(), buf, buf + n);
+            amps[i].process();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,978 @@
+#include "http_server.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace z906remote {
+
+    namespace {
+        const char *const WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+        /**
+         * SHA-1 digest, only used for the WebSocket handshake.
+         */
+        void sha1(const std::string &message, uint8_t digest[20]) {
+            uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                             0xC3D2E1F0};
+            std::string data = message;
+            const uint64_t bits = static_cast<uint64_t>(message.size()) * 8;
+
+            data += static_cast<char>(0x80);
+            while (data.size() % 64 != 56) data += '\0';
+            for (int i = 7; i >= 0; i--)
+                data += static_cast<char>((bits >> (i * 8)) & 0xFF);
+
+            for (size_t chunk = 0; chunk < data.size(); chunk += 64) {
+                uint32_t w[80];
+                for (int i = 0; i < 16; i++) {
+                    const auto *p = reinterpret_cast<const uint8_t *>(
+                        data.data() + chunk + i * 4);
+                    w[i] = static_cast<uint32_t>(p[0]) << 24 |
+                           static_cast<uint32_t>(p[1]) << 16 |
+                           static_cast<uint32_t>(p[2]) << 8 | p[3];
+                }
+                for (int i = 16; i < 80; i++) {
+                    const uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+                    w[i]             = (x << 1) | (x >> 31);
+                }
+
+                uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+                for (int i = 0; i < 80; i++) {
+                    uint32_t f, k;
+                    if (i < 20) {
+                        f = (b & c) | (~b & d);
+                        k = 0x5A827999;
+                    } else if (i < 40) {
+                        f = b ^ c ^ d;
+                        k = 0x6ED9EBA1;
+                    } else if (i < 60) {
+                        f = (b & c) | (b & d) | (c & d);
+                        k = 0x8F1BBCDC;
+                    } else {
+                        f = b ^ c ^ d;
+                        k = 0xCA62C1D6;
+                    }
+                    const uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+                    e                = d;
+                    d                = c;
+                    c                = (b << 30) | (b >> 2);
+                    b                = a;
+                    a                = t;
+                }
+                h[0] += a;
+                h[1] += b;
+                h[2] += c;
+                h[3] += d;
+                h[4] += e;
+            }
+
+            for (int i = 0; i < 20; i++)
+                digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - (i % 4) * 8));
+        }
+
+        std::string base64(const uint8_t *data, size_t len) {
+            static const char table[] =
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string out;
+
+            for (size_t i = 0; i < len; i += 3) {
+                uint32_t n = static_cast<uint32_t>(data[i]) << 16;
+                if (i + 1 < len)
+                    n |= static_cast<uint32_t>(data[i + 1]) << 8;
+                if (i + 2 < len)
+                    n |= data[i + 2];
+                out += table[(n >> 18) & 63];
+                out += table[(n >> 12) & 63];
+                out += i + 1 < len ? table[(n >> 6) & 63] : '=';
+                out += i + 2 < len ? table[n & 63] : '=';
+            }
+            return out;
+        }
+
+        const char *status_text(int code) {
+            switch (code) {
+            case 101:
+                return "Switching Protocols";
+            case 200:
+                return "OK";
+            case 302:
+                return "Found";
+            case 304:
+                return "Not Modified";
+            case 400:
+                return "Bad Request";
+            case 404:
+                return "Not Found";
+            case 405:
+                return "Method Not Allowed";
+            case 503:
+                return "Service Unavailable";
+            default:
+                return "";
+            }
+        }
+
+        const char *content_type(const std::string &path) {
+            const size_t dot = path.rfind('.');
+            const std::string ext = dot == std::string::npos ? "" : path.substr(dot);
+            if (ext == ".html")
+                return "text/html";
+            if (ext == ".js")
+                return "application/javascript";
+            if (ext == ".css")
+                return "text/css";
+            if (ext == ".ico")
+                return "image/x-icon";
+            return "application/octet-stream";
+        }
+
+        /**
+         * Get a query parameter, empty when absent.
+         */
+        bool query_param(const std::string &query, const char *name,
+                         std::string &value) {
+            const size_t len = strlen(name);
+            size_t       pos = 0;
+
+            while (pos < query.size()) {
+                size_t end = query.find('&', pos);
+                if (end == std::string::npos)
+                    end = query.size();
+                if (query.compare(pos, len, name) == 0 &&
+                    (pos + len == end || query[pos + len] == '=')) {
+                    value = pos + len < end
+                                ? query.substr(pos + len + 1, end - pos - len - 1)
+                                : "";
+                    return true;
+                }
+                pos = end + 1;
+            }
+            return false;
+        }
+    } // namespace
+
+    HttpServer::HttpServer(uint16_t port, const char *docroot)
+        : _port(port), _docroot(docroot ? docroot : ""),
+          _notify_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          _epoll(epoll_create1(EPOLL_CLOEXEC)),
+          _boot_id(std::random_device()()), _jitter(_boot_id) {}
+
+    HttpServer::~HttpServer() {
+        for (auto &client : _clients) close(client.second.fd);
+        if (_listen_fd >= 0)
+            close(_listen_fd);
+        close(_notify_fd);
+        close(_epoll);
+    }
+
+    void HttpServer::add_worker(Worker *worker) { _workers.push_back(worker); }
+
+    /**
+     * Publish the status changes through the bridge, its connection is
+     * driven by this event loop.
+     */
+    void HttpServer::set_mqtt(MqttClient *mqtt, MqttBridge *bridge) {
+        _mqtt   = mqtt;
+        _bridge = bridge;
+        _mqtt->begin(_epoll, MQTT_ID);
+    }
+
+    /**
+     * Queue a command received over MQTT, its reply is dropped like one for
+     * a client that went away.
+     */
+    void HttpServer::command(uint8_t device, const Endpoint &endpoint,
+                             long value) {
+        for (Worker *worker : _workers) {
+            if (worker->index != device)
+                continue;
+
+            Job job;
+            job.client   = MQTT_ID;
+            job.endpoint = &endpoint;
+            job.value    = value;
+            worker->push(std::move(job));
+        }
+    }
+
+    /**
+     * Open the listening socket.
+     */
+    bool HttpServer::begin() {
+        _listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_listen_fd < 0)
+            return false;
+
+        const int   on  = 1;
+        const int   off = 0;
+        sockaddr_in6 addr = {};
+        addr.sin6_family  = AF_INET6;
+        addr.sin6_addr    = in6addr_any;
+        addr.sin6_port    = htons(_port);
+        setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(_listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        if (bind(_listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+            listen(_listen_fd, SOMAXCONN) < 0) {
+            perror("listen");
+            return false;
+        }
+
+        struct epoll_event ev = {};
+        ev.events             = EPOLLIN;
+        ev.data.u64           = LISTEN_ID;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _listen_fd, &ev);
+        ev.data.u64 = NOTIFY_ID;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _notify_fd, &ev);
+        return true;
+    }
+
+    /**
+     * Event loop, returns once running becomes false.
+     */
+    void HttpServer::run(const volatile bool &running) {
+        struct epoll_event events[64];
+
+        while (running) {
+            // Wake up often enough to publish coalesced MQTT updates and end
+            // long-polls on time
+            const int n =
+                epoll_wait(_epoll, events, 64, _mqtt || _parked ? 50 : 1000);
+            for (int i = 0; i < n; i++) {
+                const uint64_t id = events[i].data.u64;
+                if (id == LISTEN_ID) {
+                    accept_clients();
+                } else if (id == NOTIFY_ID) {
+                    on_replies();
+                } else if (id == MQTT_ID) {
+                    _mqtt->on_event(events[i].events);
+                } else {
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        drop(id);
+                        continue;
+                    }
+                    if (events[i].events & EPOLLOUT)
+                        on_writable(id);
+                    if (events[i].events & EPOLLIN)
+                        on_readable(id);
+                }
+            }
+            heartbeat();
+            expire();
+            if (_mqtt) {
+                _mqtt->loop();
+                _bridge->loop();
+            }
+        }
+    }
+
+    void HttpServer::accept_clients() {
+        for (;;) {
+            const int fd = accept4(_listen_fd, nullptr, nullptr,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+
+            const int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+            const uint64_t     id = _next_id++;
+            struct epoll_event ev = {};
+            ev.events             = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64           = id;
+            epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev);
+            _clients[id].fd = fd;
+        }
+    }
+
+    void HttpServer::drop(uint64_t id) {
+        auto it = _clients.find(id);
+        if (it == _clients.end())
+            return;
+        if (it->second.parked_on)
+            _parked--;
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        close(it->second.fd);
+        _clients.erase(it);
+    }
+
+    void HttpServer::on_readable(uint64_t id) {
+        auto it = _clients.find(id);
+        if (it == _clients.end())
+            return;
+
+        char buf[4096];
+        for (;;) {
+            const ssize_t n = recv(it->second.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                it->second.in.append(buf, static_cast<size_t>(n));
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                drop(id);
+                return;
+            }
+            break;
+        }
+
+        if (it->second.websocket)
+            process_websocket(id);
+        else
+            process_http(id);
+    }
+
+    void HttpServer::on_writable(uint64_t id) { flush(id); }
+
+    /**
+     * Write out as much of the pending output as the socket accepts.
+     */
+    void HttpServer::flush(uint64_t id) {
+        auto it = _clients.find(id);
+        if (it == _clients.end())
+            return;
+        Client &client = it->second;
+
+        while (!client.out.empty()) {
+            const ssize_t n = ::send(client.fd, client.out.data(),
+                                     client.out.size(), MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    break;
+                drop(id);
+                return;
+            }
+            client.out.erase(0, static_cast<size_t>(n));
+        }
+
+        struct epoll_event ev = {};
+        ev.events   = EPOLLIN | EPOLLRDHUP;
+        if (!client.out.empty())
+            ev.events |= EPOLLOUT;
+        ev.data.u64 = id;
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, client.fd, &ev);
+
+        if (client.out.empty() && client.close_after)
+            drop(id);
+    }
+
+    /**
+     * Parse complete requests, one at a time: a request waiting on a unit
+     * holds back the following ones on the same connection.
+     */
+    void HttpServer::process_http(uint64_t id) {
+        for (;;) {
+            auto it = _clients.find(id);
+            if (it == _clients.end())
+                return;
+            Client &client = it->second;
+            if (client.events)
+                client.in.clear(); // nothing more is expected on a stream
+            if (client.pending || client.close_after || client.websocket ||
+                client.events)
+                return;
+
+            const size_t end = client.in.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                if (client.in.size() > 8192)
+                    drop(id);
+                return;
+            }
+
+            Request            request;
+            std::istringstream head(client.in.substr(0, end));
+            std::string        line, target;
+            client.in.erase(0, end + 4);
+
+            std::getline(head, line);
+            std::istringstream first(line);
+            first >> request.method >> target >> request.version;
+            while (std::getline(head, line)) {
+                const size_t colon = line.find(':');
+                if (colon == std::string::npos)
+                    continue;
+                std::string key = line.substr(0, colon);
+                std::string value = line.substr(colon + 1);
+                std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+                value.erase(0, value.find_first_not_of(" \t"));
+                value.erase(value.find_last_not_of(" \t\r") + 1);
+                request.headers[key] = value;
+            }
+
+            const size_t question = target.find('?');
+            request.path  = target.substr(0, question);
+            request.query = question == std::string::npos ? "" : target.substr(question + 1);
+
+            const auto connection = request.headers.find("connection");
+            const bool keep_alive =
+                connection == request.headers.end()
+                    ? request.version == "HTTP/1.1"
+                    : strcasecmp(connection->second.c_str(), "close") != 0 &&
+                          (request.version == "HTTP/1.1" ||
+                           strcasecmp(connection->second.c_str(), "keep-alive") == 0);
+            client.close_after = !keep_alive;
+
+            route(id, request);
+        }
+    }
+
+    void HttpServer::route(uint64_t id, const Request &request) {
+        sample_heap();
+        if (request.method == "OPTIONS") {
+            Client &client = _clients[id];
+            client.out += "HTTP/1.1 200 OK\r\n"
+                          "Access-Control-Allow-Origin: *\r\n"
+                          "Access-Control-Allow-Methods: GET, OPTIONS\r\n"
+                          "Access-Control-Allow-Headers: access-control-allow-origin, "
+                          "if-none-match\r\n"
+                          "Content-Length: 0\r\n\r\n";
+            flush(id);
+            return;
+        }
+        if (request.method != "GET") {
+            send(id, 405, "text/plain", "");
+            return;
+        }
+        if (request.path == "/ws") {
+            upgrade(id, request);
+            return;
+        }
+        if (request.path == "/events") {
+            subscribe(id, request);
+            return;
+        }
+        if (request.path == "/scheduler") {
+            send(id, 200, "application/json", scheduler_stats());
+            return;
+        }
+        if (request.path == "/heap") {
+            send(id, 200, "application/json", heap_stats(request));
+            return;
+        }
+
+        // Device-qualified routes: /dev/{n}/<endpoint path>
+        Worker     *worker = _workers.empty() ? nullptr : _workers[0];
+        std::string path   = request.path;
+        if (path.compare(0, 5, "/dev/") == 0) {
+            const size_t slash = path.find('/', 5);
+            const std::string index =
+                path.substr(5, slash == std::string::npos ? std::string::npos : slash - 5);
+            worker = nullptr;
+            for (Worker *w : _workers) {
+                if (index == std::to_string(w->index))
+                    worker = w;
+            }
+            path = slash == std::string::npos ? "" : path.substr(slash);
+            if (!worker) {
+                send(id, 404, "application/json",
+                     "{\"success\":false,\"message\":\"Unknown device or endpoint.\"}");
+                return;
+            }
+        }
+
+        for (const Endpoint &e : endpoints) {
+            if (path != e.path || !worker)
+                continue;
+
+            if (e.type == RunFunction && e.action == Status &&
+                answer_status_early(id, request, worker))
+                return;
+
+            Job         job;
+            std::string value;
+            job.client   = id;
+            job.endpoint = &e;
+            if (query_param(request.query, "value", value))
+                job.value = atol(value.c_str());
+
+            if (worker->push(std::move(job))) {
+                _clients[id].pending = true;
+            } else {
+                const std::string retry =
+                    "Retry-After: " + std::to_string(worker->retry_after()) + "\r\n";
+                send(id, 503, "application/json",
+                     "{\"success\":false,\"message\":\"Device busy.\"}",
+                     retry.c_str());
+            }
+            return;
+        }
+
+        if (request.path.compare(0, 5, "/dev/") == 0) {
+            send(id, 404, "application/json",
+                 "{\"success\":false,\"message\":\"Unknown device or endpoint.\"}");
+            return;
+        }
+        if (request.path == "/" || request.path == "/index.html") {
+            if (serve_file(id, "/index.html"))
+                return;
+        } else if (request.path == "/favicon.ico" ||
+                   request.path.compare(0, 8, "/assets/") == 0) {
+            if (serve_file(id, request.path))
+                return;
+        }
+
+        Client &client = _clients[id];
+        client.out += "HTTP/1.1 302 Found\r\nLocation: /\r\nContent-Length: 0\r\n\r\n";
+        flush(id);
+    }
+
+    /**
+     * Answer a /status request without the unit when possible: 304 if
+     * If-None-Match carries the current ETag, or park it when ?since=N is the
+     * current generation, until it changes or ?wait=ms is over.
+     */
+    bool HttpServer::answer_status_early(uint64_t id, const Request &request,
+                                         Worker *worker) {
+        const std::string tag   = etag(worker->generation());
+        const auto        match = request.headers.find("if-none-match");
+        if (match != request.headers.end() && match->second == tag) {
+            send(id, 304, "application/json", "",
+                 ("Access-Control-Expose-Headers: ETag\r\nETag: " + tag + "\r\n")
+                     .c_str());
+            return true;
+        }
+
+        std::string since, wait;
+        if (!query_param(request.query, "since", since) ||
+            strtoul(since.c_str(), nullptr, 10) != worker->generation())
+            return false;
+
+        const unsigned long ms = query_param(request.query, "wait", wait)
+                                     ? strtoul(wait.c_str(), nullptr, 10)
+                                     : LONGPOLL_MAX_WAIT;
+        if (!ms)
+            return false;
+
+        Client &client   = _clients[id];
+        client.pending   = true;
+        client.parked_on = worker;
+        client.since     = worker->generation();
+        client.parked_at = millis();
+        client.wait      = std::min<unsigned long>(ms, LONGPOLL_MAX_WAIT);
+        _parked++;
+        return true;
+    }
+
+    std::string HttpServer::etag(uint32_t generation) const {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "\"%x-%u\"", _boot_id, generation);
+        return buf;
+    }
+
+    /**
+     * Answer the requests parked on a unit with its new status.
+     */
+    void HttpServer::wake(Worker *worker, const Reply &reply) {
+        const size_t data = reply.body.find("\"data\"");
+        if (!_parked || data == std::string::npos)
+            return;
+
+        const std::string body = "{\"status\":\"connected\",\"success\":true,"
+                                 "\"generation\":" +
+                                 std::to_string(reply.generation) + "," +
+                                 reply.body.substr(data);
+        const std::string headers = "Access-Control-Expose-Headers: ETag\r\nETag: " +
+                                    etag(reply.generation) + "\r\n";
+        std::vector<uint64_t> ids;
+        for (auto &entry : _clients) {
+            if (entry.second.parked_on == worker &&
+                entry.second.since != reply.generation)
+                ids.push_back(entry.first);
+        }
+        for (uint64_t id : ids) {
+            Client &client   = _clients[id];
+            client.parked_on = nullptr;
+            client.pending   = false;
+            _parked--;
+            send(id, 200, "application/json", body, headers.c_str());
+            process_http(id);
+        }
+    }
+
+    /**
+     * Answer the parked requests whose wait is over with 304.
+     */
+    void HttpServer::expire() {
+        if (!_parked)
+            return;
+
+        std::vector<uint64_t> ids;
+        for (auto &entry : _clients) {
+            const Client &client = entry.second;
+            if (client.parked_on && millis() - client.parked_at >= client.wait)
+                ids.push_back(entry.first);
+        }
+        for (uint64_t id : ids) {
+            Client           &client = _clients[id];
+            const std::string headers =
+                "Access-Control-Expose-Headers: ETag\r\nETag: " +
+                etag(client.parked_on->generation()) + "\r\n";
+            client.parked_on = nullptr;
+            client.pending   = false;
+            _parked--;
+            send(id, 304, "application/json", "", headers.c_str());
+            process_http(id);
+        }
+    }
+
+    /**
+     * Report the queue depth and wait times of every unit's scheduler.
+     */
+    std::string HttpServer::scheduler_stats() const {
+        static const char *const names[PRIORITY_COUNT] = {"interactive", "read",
+                                                          "telemetry"};
+        std::string out = "{\"devices\":[";
+
+        for (const Worker *worker : _workers) {
+            char buf[160];
+            snprintf(buf, sizeof(buf),
+                     "{\"device\":%u,\"service_avg\":%u,\"retry_after\":%u",
+                     worker->index, worker->service_avg(), worker->retry_after());
+            out += buf;
+            for (int p = 0; p < PRIORITY_COUNT; p++) {
+                const Priority    priority = static_cast<Priority>(p);
+                const QueueStats &stats    = worker->stats(priority);
+                const uint32_t    served   = stats.served;
+                snprintf(buf, sizeof(buf),
+                         ",\"%s\":{\"depth\":%zu,\"depth_max\":%u,\"served\":%u,"
+                         "\"rejected\":%u,\"wait_avg\":%u,\"wait_max\":%u}",
+                         names[p], worker->depth(priority), stats.depth_max.load(),
+                         served, stats.rejected.load(),
+                         served ? stats.wait_sum / served : 0, stats.wait_max.load());
+                out += buf;
+            }
+            out += "},";
+        }
+        if (out.back() == ',')
+            out.pop_back();
+        return out + "]}";
+    }
+
+    /**
+     * Report the malloc heap of the daemon, the counterpart of the firmware's
+     * free heap: bytes in use, their high-water mark and the arena size.
+     * ?reset restarts the high-water mark.
+     */
+    std::string HttpServer::heap_stats(const Request &request) {
+        std::string unused;
+
+        if (query_param(request.query, "reset", unused))
+            _heap_max = 0;
+
+        const size_t           used = sample_heap();
+        const struct mallinfo2 info = mallinfo2();
+        char                   buf[128];
+        snprintf(buf, sizeof(buf),
+                 "{\"uptime\":%lu,\"used\":%zu,\"used_max\":%zu,\"arena\":%zu}",
+                 millis(), used, _heap_max, info.arena + info.hblkhd);
+        return buf;
+    }
+
+    /**
+     * Raise the heap high-water mark, sampled on every request while its
+     * buffers are allocated. Returns the bytes in use.
+     */
+    size_t HttpServer::sample_heap() {
+        const struct mallinfo2 info = mallinfo2();
+        const size_t           used = info.uordblks + info.hblkhd;
+
+        _heap_max = std::max(_heap_max, used);
+        return used;
+    }
+
+    /**
+     * Serve a file of the web app from the document root, preferring the
+     * gzipped copy like setTryGzipFirst() does on the firmware.
+     */
+    bool HttpServer::serve_file(uint64_t id, const std::string &path) {
+        if (_docroot.empty() || path.find("..") != std::string::npos)
+            return false;
+
+        for (const bool gzip : {true, false}) {
+            std::ifstream file(_docroot + path + (gzip ? ".gz" : ""),
+                               std::ios::binary);
+            if (!file)
+                continue;
+
+            std::ostringstream body;
+            body << file.rdbuf();
+            send(id, 200, content_type(path), body.str(),
+                 gzip ? "Content-Encoding: gzip\r\n"
+                        "Cache-Control: max-age=31536000\r\n"
+                      : nullptr);
+            return true;
+        }
+        return false;
+    }
+
+    void HttpServer::upgrade(uint64_t id, const Request &request) {
+        const auto key = request.headers.find("sec-websocket-key");
+        if (key == request.headers.end()) {
+            send(id, 400, "text/plain", "");
+            return;
+        }
+
+        uint8_t digest[20];
+        sha1(key->second + WS_GUID, digest);
+
+        Client &client     = _clients[id];
+        client.websocket   = true;
+        client.close_after = false;
+        client.out += "HTTP/1.1 101 Switching Protocols\r\n"
+                      "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Accept: " +
+                      base64(digest, sizeof(digest)) + "\r\n\r\n";
+        flush(id);
+        process_websocket(id);
+    }
+
+    /**
+     * Start a Server-Sent Events status stream. A client reconnecting with
+     * Last-Event-ID gets the events it missed if the ring still holds them,
+     * otherwise the current status of every unit.
+     */
+    void HttpServer::subscribe(uint64_t id, const Request &request) {
+        Client &client     = _clients[id];
+        client.events      = true;
+        client.close_after = false;
+        client.out += "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: text/event-stream\r\n"
+                      "Cache-Control: no-cache\r\n"
+                      "Access-Control-Allow-Origin: *\r\n"
+                      "\r\n";
+        // Jittered like the firmware, so the clients of a restarted daemon
+        // do not all reconnect at once. A retry field alone dispatches no event
+        client.out += "retry: " +
+                      std::to_string(EVENT_RETRY + _jitter() % EVENT_RETRY) +
+                      "\n\n";
+
+        const auto     header = request.headers.find("last-event-id");
+        const uint32_t last   = header == request.headers.end()
+                                    ? 0
+                                    : static_cast<uint32_t>(
+                                        strtoul(header->second.c_str(), nullptr, 10));
+        const uint32_t first  = _last_event_id >= EVENT_REPLAY_SIZE
+                                    ? _last_event_id - EVENT_REPLAY_SIZE + 1
+                                    : 1;
+
+        if (last && last <= _last_event_id && last + 1 >= first) {
+            for (uint32_t event = last + 1; event <= _last_event_id; event++)
+                send_event(id, event, _ring[event % EVENT_REPLAY_SIZE]);
+        } else {
+            for (const std::string &status : _latest) {
+                if (!status.empty())
+                    send_event(id, _last_event_id, status);
+            }
+        }
+        flush(id);
+    }
+
+    void HttpServer::send_event(uint64_t id, uint32_t event,
+                                const std::string &data) {
+        Client &client = _clients[id];
+        client.out += "id: " + std::to_string(event) +
+                      "\nevent: status\ndata: " + data + "\n\n";
+    }
+
+    /**
+     * Send a status change of a unit to the /events clients and keep it for
+     * replay.
+     */
+    void HttpServer::publish(uint8_t device, const std::string &status) {
+        if (_latest.size() <= device)
+            _latest.resize(device + 1U);
+        _latest[device]                           = status;
+        _ring[++_last_event_id % EVENT_REPLAY_SIZE] = status;
+
+        std::vector<uint64_t> ids;
+        for (auto &entry : _clients) {
+            if (entry.second.events) {
+                send_event(entry.first, _last_event_id, status);
+                ids.push_back(entry.first);
+            }
+        }
+        for (uint64_t id : ids) flush(id);
+    }
+
+    /**
+     * Keep idle /events connections open through proxies with a comment line.
+     */
+    void HttpServer::heartbeat() {
+        if (millis() - _last_heartbeat < EVENT_HEARTBEAT)
+            return;
+        _last_heartbeat = millis();
+
+        std::vector<uint64_t> ids;
+        for (auto &entry : _clients) {
+            if (entry.second.events) {
+                entry.second.out += ":\n\n";
+                ids.push_back(entry.first);
+            }
+        }
+        for (uint64_t id : ids) flush(id);
+    }
+
+    /**
+     * Handle the frames received from a WebSocket client. Text messages are
+     * echoed to all clients, like onWebSocketMessage() on the firmware.
+     */
+    void HttpServer::process_websocket(uint64_t id) {
+        for (;;) {
+            auto it = _clients.find(id);
+            if (it == _clients.end())
+                return;
+            Client            &client = it->second;
+            const std::string &in     = client.in;
+            if (in.size() < 2)
+                return;
+
+            const uint8_t b0     = static_cast<uint8_t>(in[0]);
+            const uint8_t b1     = static_cast<uint8_t>(in[1]);
+            const bool    masked = b1 & 0x80;
+            uint64_t      len    = b1 & 0x7F;
+            size_t        header = 2;
+
+            if (len == 126) {
+                if (in.size() < 4)
+                    return;
+                len    = static_cast<uint64_t>(static_cast<uint8_t>(in[2])) << 8 |
+                         static_cast<uint8_t>(in[3]);
+                header = 4;
+            } else if (len == 127) {
+                if (in.size() < 10)
+                    return;
+                len = 0;
+                for (int i = 2; i < 10; i++)
+                    len = len << 8 | static_cast<uint8_t>(in[i]);
+                header = 10;
+            }
+            if (len > 65536) {
+                drop(id);
+                return;
+            }
+            if (in.size() < header + (masked ? 4 : 0) + len)
+                return;
+
+            std::string payload = in.substr(header + (masked ? 4 : 0), len);
+            if (masked) {
+                for (size_t i = 0; i < payload.size(); i++)
+                    payload[i] ^= in[header + (i % 4)];
+            }
+            client.in.erase(0, header + (masked ? 4 : 0) + len);
+
+            switch (b0 & 0x0F) {
+            case 0x1: // text
+                if (b0 & 0x80)
+                    broadcast("Echo: " + payload);
+                break;
+            case 0x8: // close
+                send_frame(client, 0x8, payload);
+                client.close_after = true;
+                flush(id);
+                return;
+            case 0x9: // ping
+                send_frame(client, 0xA, payload);
+                flush(id);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    void HttpServer::send_frame(Client &client, uint8_t opcode,
+                                const std::string &payload) {
+        client.out += static_cast<char>(0x80 | opcode);
+        if (payload.size() < 126) {
+            client.out += static_cast<char>(payload.size());
+        } else if (payload.size() < 65536) {
+            client.out += static_cast<char>(126);
+            client.out += static_cast<char>(payload.size() >> 8);
+            client.out += static_cast<char>(payload.size() & 0xFF);
+        } else {
+            client.out += static_cast<char>(127);
+            for (int i = 7; i >= 0; i--)
+                client.out += static_cast<char>((payload.size() >> (i * 8)) & 0xFF);
+        }
+        client.out += payload;
+    }
+
+    void HttpServer::broadcast(const std::string &message) {
+        std::vector<uint64_t> ids;
+        for (auto &entry : _clients) {
+            if (entry.second.websocket && !entry.second.close_after) {
+                send_frame(entry.second, 0x1, message);
+                ids.push_back(entry.first);
+            }
+        }
+        for (uint64_t id : ids) flush(id);
+    }
+
+    void HttpServer::send(uint64_t id, int code, const char *type,
+                          const std::string &body, const char *headers) {
+        auto it = _clients.find(id);
+        if (it == _clients.end())
+            return;
+        Client &client = it->second;
+
+        char head[256];
+        snprintf(head, sizeof(head),
+                 "HTTP/1.1 %d %s\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Access-Control-Allow-Origin: *\r\n"
+                 "%s%s\r\n",
+                 code, status_text(code), type, body.size(),
+                 headers ? headers : "",
+                 client.close_after ? "Connection: close\r\n" : "");
+        client.out += head;
+        client.out += body;
+        flush(id);
+    }
+
+    /**
+     * Deliver the replies and status broadcasts posted by the workers.
+     */
+    void HttpServer::on_replies() {
+        uint64_t count;
+        (void)!::read(_notify_fd, &count, sizeof(count));
+
+        for (Worker *worker : _workers) {
+            Reply reply;
+            while (worker->pop(reply)) {
+                if (reply.client == 0) {
+                    broadcast(reply.body);
+                    publish(worker->index, reply.body);
+                    wake(worker, reply);
+                    if (_bridge)
+                        _bridge->status_changed(worker->index, reply.fields);
+                    continue;
+                }
+
+                auto it = _clients.find(reply.client);
+                if (it == _clients.end())
+                    continue; // the client went away while queued
+                it->second.pending = false;
+                const std::string headers =
+                    "Access-Control-Expose-Headers: ETag\r\nETag: " +
+                    etag(reply.generation) + "\r\n";
+                send(reply.client, reply.code, "application/json", reply.body,
+                     reply.generation ? headers.c_str() : nullptr);
+                process_http(reply.client);
+            }
+        }
+    }
+
+} // namespace z906remote
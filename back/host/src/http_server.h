@@ -0,0 +1,113 @@
+#pragma once
+
+#include "mqtt_bridge.h"
+#include "mqtt_client.h"
+#include "worker.h"
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define EVENT_REPLAY_SIZE 16
+#define EVENT_HEARTBEAT 15000
+#define EVENT_RETRY 3000 // ms, clients reconnect after 1 to 2 times this
+#define LONGPOLL_MAX_WAIT 30000
+
+namespace z906remote {
+
+    /**
+     * Single-threaded epoll HTTP/1.1 and WebSocket server exposing the same
+     * API as the firmware. Requests are handed to the unit's Worker and
+     * answered when its reply comes back.
+     */
+    class HttpServer {
+    public:
+        HttpServer(uint16_t port, const char *docroot);
+        ~HttpServer();
+
+        HttpServer(const HttpServer &)            = delete;
+        HttpServer &operator=(const HttpServer &) = delete;
+
+        int  notify_fd() const { return _notify_fd; }
+        bool begin();
+        void add_worker(Worker *);
+        void set_mqtt(MqttClient *, MqttBridge *);
+        void command(uint8_t, const Endpoint &, long);
+        void run(const volatile bool &);
+
+    private:
+        struct Client {
+            int         fd;
+            std::string in;
+            std::string out;
+            bool        websocket   = false;
+            bool        events      = false;
+            bool        pending     = false;
+            bool        close_after = false;
+            Worker     *parked_on   = nullptr; // long-polling /status
+            uint32_t    since       = 0;
+            unsigned long parked_at = 0;
+            unsigned long wait      = 0;
+        };
+
+        struct Request {
+            std::string method;
+            std::string path;
+            std::string query;
+            std::string version;
+            std::unordered_map<std::string, std::string> headers;
+        };
+
+        void accept_clients();
+        void on_readable(uint64_t);
+        void on_writable(uint64_t);
+        void on_replies();
+        void process_http(uint64_t);
+        void process_websocket(uint64_t);
+        void route(uint64_t, const Request &);
+        bool serve_file(uint64_t, const std::string &);
+        std::string scheduler_stats() const;
+        std::string heap_stats(const Request &);
+        size_t      sample_heap();
+        bool answer_status_early(uint64_t, const Request &, Worker *);
+        std::string etag(uint32_t) const;
+        void wake(Worker *, const Reply &);
+        void expire();
+        void upgrade(uint64_t, const Request &);
+        void subscribe(uint64_t, const Request &);
+        void publish(uint8_t, const std::string &);
+        void send_event(uint64_t, uint32_t, const std::string &);
+        void heartbeat();
+        void send(uint64_t, int, const char *, const std::string &,
+                  const char * = nullptr);
+        void send_frame(Client &, uint8_t, const std::string &);
+        void broadcast(const std::string &);
+        void flush(uint64_t);
+        void drop(uint64_t);
+
+        uint16_t                           _port;
+        std::string                        _docroot;
+        int                                _listen_fd = -1;
+        int                                _notify_fd;
+        int                                _epoll;
+        uint64_t                           _next_id = FIRST_CLIENT;
+        std::vector<Worker *>              _workers;
+        std::unordered_map<uint64_t, Client> _clients;
+        std::string                        _ring[EVENT_REPLAY_SIZE];
+        uint32_t                           _last_event_id = 0;
+        std::vector<std::string>           _latest; // status per device
+        unsigned long                      _last_heartbeat = 0;
+        MqttClient                        *_mqtt           = nullptr;
+        MqttBridge                        *_bridge         = nullptr;
+        uint32_t                           _boot_id;
+        std::minstd_rand                   _jitter; // of the reconnect delay
+        size_t                             _parked = 0;
+        size_t                             _heap_max = 0; // bytes in use
+
+        static constexpr uint64_t LISTEN_ID    = 1;
+        static constexpr uint64_t NOTIFY_ID    = 2;
+        static constexpr uint64_t MQTT_ID      = 3;
+        static constexpr uint64_t FIRST_CLIENT = 16;
+    };
+
+} // namespace z906remote
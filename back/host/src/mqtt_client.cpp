@@ -0,0 +1,348 @@
+#include "mqtt_client.h"
+#include "mqtt_bridge.h"
+#include <Arduino.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace z906remote {
+
+    namespace {
+        enum PacketType : uint8_t {
+            CONNECT     = 0x10,
+            CONNACK     = 0x20,
+            PUBLISH     = 0x30,
+            PUBACK      = 0x40,
+            SUBSCRIBE   = 0x82,
+            SUBACK      = 0x90,
+            PINGREQ     = 0xC0,
+            PINGRESP    = 0xD0,
+            DISCONNECT  = 0xE0,
+        };
+
+        void append_string(std::string &out, const std::string &value) {
+            out += static_cast<char>(value.size() >> 8);
+            out += static_cast<char>(value.size() & 0xFF);
+            out += value;
+        }
+    } // namespace
+
+    MqttClient::MqttClient(const std::string &host, uint16_t port,
+                           const std::string &user, const std::string &password)
+        : _host(host), _port(port), _user(user), _password(password) {}
+
+    MqttClient::~MqttClient() {
+        if (_state == Connected) {
+            // A clean disconnect does not trigger the will
+            if (!_will_topic.empty())
+                publish(_will_topic.c_str(), _will_payload.c_str(), true);
+            queue(DISCONNECT, "");
+            flush();
+        }
+        if (_fd >= 0)
+            close(_fd);
+    }
+
+    void MqttClient::set_will(const std::string &topic,
+                              const std::string &payload) {
+        _will_topic   = topic;
+        _will_payload = payload;
+    }
+
+    /**
+     * Register with the event loop, the connection is made from loop().
+     */
+    void MqttClient::begin(int epoll, uint64_t id) {
+        _epoll = epoll;
+        _id    = id;
+    }
+
+    /**
+     * Reconnect every MQTT_RECONNECT_INTERVAL ms while disconnected, and
+     * keep the connection alive.
+     */
+    void MqttClient::loop() {
+        const unsigned long now = millis();
+
+        if (_state == Disconnected) {
+            if (!_attempted || now - _last_attempt >= MQTT_RECONNECT_INTERVAL)
+                connect();
+            return;
+        }
+        if (_state != Connected) {
+            if (now - _last_attempt > MQTT_KEEPALIVE * 1000UL)
+                disconnect(); // no CONNACK
+            return;
+        }
+
+        if (now - _last_received > MQTT_KEEPALIVE * 1500UL) {
+            fprintf(stderr, "mqtt: broker timed out\n");
+            disconnect();
+        } else if (now - _last_sent >= MQTT_KEEPALIVE * 500UL) {
+            queue(PINGREQ, "");
+            flush();
+        }
+    }
+
+    void MqttClient::connect() {
+        _attempted    = true;
+        _last_attempt = millis();
+
+        addrinfo  hints = {};
+        addrinfo *res   = nullptr;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(_host.c_str(), std::to_string(_port).c_str(), &hints,
+                        &res) != 0 ||
+            !res)
+            return;
+
+        _fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     res->ai_protocol);
+        const int ret = _fd < 0 ? -1 : ::connect(_fd, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+        if (_fd < 0 || (ret < 0 && errno != EINPROGRESS)) {
+            disconnect();
+            return;
+        }
+
+        _state = Connecting;
+        struct epoll_event ev = {};
+        ev.events             = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        ev.data.u64           = _id;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _fd, &ev);
+    }
+
+    void MqttClient::disconnect() {
+        if (_fd >= 0) {
+            epoll_ctl(_epoll, EPOLL_CTL_DEL, _fd, nullptr);
+            close(_fd);
+        }
+        if (_state == Connected)
+            fprintf(stderr, "mqtt: disconnected from %s\n", _host.c_str());
+        _fd    = -1;
+        _state = Disconnected;
+        _in.clear();
+        _out.clear();
+    }
+
+    void MqttClient::on_event(uint32_t events) {
+        if (_fd < 0)
+            return;
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            disconnect();
+            return;
+        }
+
+        if (_state == Connecting && (events & EPOLLOUT)) {
+            int       error = 0;
+            socklen_t len   = sizeof(error);
+            getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error) {
+                disconnect();
+                return;
+            }
+            send_connect();
+        } else if (events & EPOLLOUT) {
+            flush();
+        }
+
+        if (events & EPOLLIN) {
+            char buf[4096];
+            for (;;) {
+                const ssize_t n = recv(_fd, buf, sizeof(buf), 0);
+                if (n > 0) {
+                    _in.append(buf, static_cast<size_t>(n));
+                    continue;
+                }
+                if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    disconnect();
+                    return;
+                }
+                break;
+            }
+            process();
+        }
+    }
+
+    void MqttClient::send_connect() {
+        std::string body;
+        uint8_t     flags = 0x02; // clean session
+
+        append_string(body, "MQTT");
+        body += static_cast<char>(4); // protocol level 3.1.1
+        if (!_will_topic.empty())
+            flags |= 0x04 | 0x20; // retained will, QoS 0
+        if (!_user.empty())
+            flags |= 0x80;
+        if (!_password.empty())
+            flags |= 0x40;
+        body += static_cast<char>(flags);
+        body += static_cast<char>(MQTT_KEEPALIVE >> 8);
+        body += static_cast<char>(MQTT_KEEPALIVE & 0xFF);
+
+        append_string(body, "z906d-" + std::to_string(getpid()));
+        if (!_will_topic.empty()) {
+            append_string(body, _will_topic);
+            append_string(body, _will_payload);
+        }
+        if (!_user.empty())
+            append_string(body, _user);
+        if (!_password.empty())
+            append_string(body, _password);
+
+        _state         = Handshake;
+        _last_received = millis();
+        queue(CONNECT, body);
+        flush();
+    }
+
+    /**
+     * Split the received bytes into complete packets.
+     */
+    void MqttClient::process() {
+        while (_fd >= 0 && _in.size() >= 2) {
+            size_t length     = 0;
+            size_t header     = 1;
+            int    multiplier = 1;
+            bool   complete   = false;
+
+            while (header < _in.size() && header <= 4) {
+                const uint8_t byte = static_cast<uint8_t>(_in[header++]);
+                length += (byte & 0x7F) * static_cast<size_t>(multiplier);
+                multiplier *= 128;
+                if (!(byte & 0x80)) {
+                    complete = true;
+                    break;
+                }
+            }
+            if (!complete) {
+                if (header > 4)
+                    disconnect(); // malformed length
+                return;
+            }
+            if (_in.size() < header + length)
+                return;
+
+            const uint8_t     type = static_cast<uint8_t>(_in[0]);
+            const std::string body = _in.substr(header, length);
+            _in.erase(0, header + length);
+            _last_received = millis();
+            handle_packet(type, body);
+        }
+    }
+
+    void MqttClient::handle_packet(uint8_t type, const std::string &body) {
+        switch (type & 0xF0) {
+        case CONNACK:
+            if (body.size() < 2 || body[1] != 0) {
+                fprintf(stderr, "mqtt: connection refused (%d)\n",
+                        body.size() < 2 ? -1 : body[1]);
+                disconnect();
+                return;
+            }
+            fprintf(stderr, "mqtt: connected to %s:%u\n", _host.c_str(), _port);
+            _state = Connected;
+            if (_on_connect)
+                _on_connect();
+            break;
+        case PUBLISH: {
+            if (body.size() < 2)
+                return;
+            const size_t topic_len = static_cast<uint8_t>(body[0]) << 8 |
+                                     static_cast<uint8_t>(body[1]);
+            const int    qos       = (type >> 1) & 0x03;
+            size_t       offset    = 2 + topic_len;
+            if (body.size() < offset + (qos ? 2 : 0))
+                return;
+
+            const std::string topic = body.substr(2, topic_len);
+            if (qos) {
+                // Acknowledge, commands are only queued once per delivery
+                queue(PUBACK, body.substr(offset, 2));
+                flush();
+                offset += 2;
+            }
+            if (_on_message)
+                _on_message(topic.c_str(), body.data() + offset,
+                            body.size() - offset);
+            break;
+        }
+        default: // SUBACK, PINGRESP
+            break;
+        }
+    }
+
+    /**
+     * Publish a message at QoS 0. Returns false while disconnected.
+     */
+    bool MqttClient::publish(const char *topic, const char *payload,
+                             bool retained) {
+        if (_state != Connected || _out.size() > MQTT_OUT_LIMIT)
+            return false;
+
+        std::string body;
+        append_string(body, topic);
+        body += payload;
+        queue(PUBLISH | (retained ? 0x01 : 0x00), body);
+        flush();
+        return _state == Connected;
+    }
+
+    bool MqttClient::subscribe(const char *filter) {
+        if (_state != Connected)
+            return false;
+
+        std::string body;
+        if (++_packet_id == 0)
+            _packet_id = 1;
+        body += static_cast<char>(_packet_id >> 8);
+        body += static_cast<char>(_packet_id & 0xFF);
+        append_string(body, filter);
+        body += static_cast<char>(0); // QoS 0
+        queue(SUBSCRIBE, body);
+        flush();
+        return _state == Connected;
+    }
+
+    void MqttClient::queue(uint8_t type, const std::string &body) {
+        size_t length = body.size();
+
+        _out += static_cast<char>(type);
+        do {
+            uint8_t byte = length % 128;
+            length /= 128;
+            if (length)
+                byte |= 0x80;
+            _out += static_cast<char>(byte);
+        } while (length);
+        _out += body;
+        _last_sent = millis();
+    }
+
+    void MqttClient::flush() {
+        while (_fd >= 0 && !_out.empty()) {
+            const ssize_t n = ::send(_fd, _out.data(), _out.size(), MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    break;
+                disconnect();
+                return;
+            }
+            _out.erase(0, static_cast<size_t>(n));
+        }
+        if (_fd < 0)
+            return;
+
+        struct epoll_event ev = {};
+        ev.events             = EPOLLIN | EPOLLRDHUP;
+        if (!_out.empty())
+            ev.events |= EPOLLOUT;
+        ev.data.u64 = _id;
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, _fd, &ev);
+    }
+
+} // namespace z906remote
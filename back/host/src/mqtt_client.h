@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#define MQTT_KEEPALIVE 30 // s
+#define MQTT_OUT_LIMIT 65536
+
+namespace z906remote {
+
+    /**
+     * Minimal non-blocking MQTT 3.1.1 client, QoS 0 only, driven by the
+     * HTTP server's epoll loop. The will marks the bridge offline when the
+     * connection is lost.
+     */
+    class MqttClient {
+    public:
+        typedef std::function<void()> ConnectHandler;
+        typedef std::function<void(const char *, const char *, size_t)>
+            MessageHandler;
+
+        MqttClient(const std::string &host, uint16_t port,
+                   const std::string &user, const std::string &password);
+        ~MqttClient();
+
+        MqttClient(const MqttClient &)            = delete;
+        MqttClient &operator=(const MqttClient &) = delete;
+
+        void set_will(const std::string &topic, const std::string &payload);
+        void on_connect(ConnectHandler handler) { _on_connect = handler; }
+        void on_message(MessageHandler handler) { _on_message = handler; }
+        void begin(int epoll, uint64_t id);
+        void on_event(uint32_t);
+        void loop();
+        bool connected() const { return _state == Connected; }
+        bool publish(const char *, const char *, bool);
+        bool subscribe(const char *);
+
+    private:
+        enum State { Disconnected, Connecting, Handshake, Connected };
+
+        void connect();
+        void disconnect();
+        void send_connect();
+        void process();
+        void handle_packet(uint8_t, const std::string &);
+        void queue(uint8_t, const std::string &);
+        void flush();
+
+        std::string    _host;
+        uint16_t       _port;
+        std::string    _user;
+        std::string    _password;
+        std::string    _will_topic;
+        std::string    _will_payload;
+        ConnectHandler _on_connect;
+        MessageHandler _on_message;
+        int            _epoll         = -1;
+        uint64_t       _id            = 0;
+        int            _fd            = -1;
+        State          _state         = Disconnected;
+        std::string    _in;
+        std::string    _out;
+        uint16_t       _packet_id     = 0;
+        unsigned long  _last_attempt  = 0;
+        unsigned long  _last_sent     = 0;
+        unsigned long  _last_received = 0;
+        bool           _attempted     = false;
+    };
+
+} // namespace z906remote
@@ -0,0 +1,420 @@
+#include "worker.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace z906remote {
+
+    namespace {
+        void append_field(std::string &out, const char *key, long value) {
+            out += '"';
+            out += key;
+            out += "\":";
+            out += std::to_string(value);
+            out += ',';
+        }
+
+        void append_field(std::string &out, const char *key, bool value) {
+            out += '"';
+            out += key;
+            out += "\":";
+            out += value ? "true" : "false";
+            out += ',';
+        }
+
+        void close_object(std::string &out) {
+            if (out.back() == ',')
+                out.pop_back();
+            out += '}';
+        }
+    } // namespace
+
+    Worker::Worker(uint8_t index, const char *path, int notify_fd,
+                   const char *trace)
+        : index(index), _serial(path), _trace(_serial), _amp(_trace),
+          _wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          _notify_fd(notify_fd) {
+        // The library is attached to the recorder, configure the port for it
+        _serial.begin(BAUD_RATE, SERIAL_CONFIG);
+
+        if (trace) {
+            FILE *file = fopen(trace, "w");
+            if (file) {
+                _trace_out.reset(new FilePrint(file));
+                _trace.begin(*_trace_out);
+            } else {
+                fprintf(stderr, "%s: %s\n", trace, strerror(errno));
+                _trace_failed = true;
+            }
+        }
+    }
+
+    Worker::~Worker() {
+        stop();
+        _trace.end();
+        close(_wake_fd);
+    }
+
+    bool Worker::is_open() const {
+        return static_cast<bool>(_serial) && !_trace_failed;
+    }
+
+    /**
+     * Queue a request for this unit in its priority class (HTTP thread only).
+     * Returns false if the class is full.
+     */
+    bool Worker::push(Job &&job) {
+        const Priority priority = priority_of(*job.endpoint);
+        QueueStats    &stats    = _stats[priority];
+
+        job.queued_at = millis();
+        if (!_jobs[priority].push(std::move(job))) {
+            stats.rejected++;
+            return false;
+        }
+
+        const uint32_t depth = static_cast<uint32_t>(_jobs[priority].size());
+        if (depth > stats.depth_max)
+            stats.depth_max = depth;
+
+        const uint64_t one = 1;
+        (void)!::write(_wake_fd, &one, sizeof(one));
+        return true;
+    }
+
+    /**
+     * Take the next job: higher classes first, unless a lower class job has
+     * been waiting for more than WORKER_MAX_WAIT ms (I/O thread only).
+     */
+    bool Worker::next(Job &job) {
+        const unsigned long now    = millis();
+        int                 chosen = -1;
+
+        for (int p = 0; p < PRIORITY_COUNT; p++) {
+            const Job *front = _jobs[p].front();
+            if (!front)
+                continue;
+            if (chosen < 0)
+                chosen = p;
+            if (now - front->queued_at > WORKER_MAX_WAIT) {
+                chosen = p;
+                break;
+            }
+        }
+        if (chosen < 0 || !_jobs[chosen].pop(job))
+            return false;
+
+        QueueStats    &stats = _stats[chosen];
+        const uint32_t wait  = static_cast<uint32_t>(now - job.queued_at);
+        stats.served++;
+        stats.wait_sum += wait;
+        if (wait > stats.wait_max)
+            stats.wait_max = wait;
+        return true;
+    }
+
+    size_t Worker::depth(Priority priority) const {
+        return _jobs[priority].size();
+    }
+
+    /**
+     * Seconds a rejected client should wait, from the work already queued.
+     */
+    uint32_t Worker::retry_after() const {
+        size_t queued = 0;
+        for (const auto &jobs : _jobs) queued += jobs.size();
+
+        const uint32_t seconds =
+            static_cast<uint32_t>((queued * _service_avg + 999) / 1000);
+        return seconds ? seconds : 1;
+    }
+
+    /**
+     * Take the next reply or status broadcast (HTTP thread only).
+     */
+    bool Worker::pop(Reply &reply) { return _replies.pop(reply); }
+
+    void Worker::start() {
+        _verify  = true; // read the initial status
+        _running = true;
+        _thread  = std::thread(&Worker::run, this);
+    }
+
+    void Worker::stop() {
+        if (!_running.exchange(false))
+            return;
+
+        const uint64_t one = 1;
+        (void)!::write(_wake_fd, &one, sizeof(one));
+        _thread.join();
+    }
+
+    /**
+     * I/O thread: serve queued requests, then read the status back to verify
+     * the commands just run, and every WORKER_UPDATE_INTERVAL milliseconds
+     * unless set_update_interval() turned the polling off.
+     */
+    void Worker::run() {
+        const int          epoll = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev    = {};
+        ev.events                = EPOLLIN;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, _wake_fd, &ev);
+
+        while (_running) {
+            const unsigned long elapsed = millis() - _last_update;
+            int                 timeout = -1; // without polling, until a request
+            uint64_t            count;
+
+            if (_verify || (_update_interval && elapsed >= _update_interval))
+                timeout = 0;
+            else if (_update_interval)
+                timeout = static_cast<int>(_update_interval - elapsed);
+
+            if (epoll_wait(epoll, &ev, 1, timeout) > 0)
+                (void)!::read(_wake_fd, &count, sizeof(count));
+
+            Job job;
+            while (_running && next(job)) {
+                const unsigned long started = millis();
+                Reply               reply;
+                reply.client = job.client;
+                respond(job, reply);
+                // Reads like GetValue refresh the cache on the way
+                if (status_changed())
+                    broadcast_status();
+                post(std::move(reply));
+                _service_avg = static_cast<uint32_t>(
+                    (_service_avg * 7 + (millis() - started)) / 8);
+            }
+
+            if (_verify ||
+                (_update_interval && millis() - _last_update >= _update_interval)) {
+                _verify      = false;
+                _last_update = millis();
+                if (online())
+                    refresh_status();
+            }
+        }
+
+        close(epoll);
+    }
+
+    /**
+     * Hand a reply to the HTTP thread, waiting while its queue is full.
+     */
+    void Worker::post(Reply &&reply) {
+        while (!_replies.push(std::move(reply))) {
+            if (!_running)
+                return;
+            delay(1);
+        }
+
+        const uint64_t one = 1;
+        (void)!::write(_notify_fd, &one, sizeof(one));
+    }
+
+    bool Worker::online() const {
+        return !_offline || millis() - _offline_since > WORKER_OFFLINE_BACKOFF;
+    }
+
+    void Worker::set_online(bool connected) {
+        // The backoff starts when the unit goes offline, or again when the
+        // first request after it still times out
+        if (!connected && (!_offline || online()))
+            _offline_since = millis();
+        _offline = !connected;
+    }
+
+    /**
+     * Append the "data" object, same fields as handle_get_status().
+     */
+    void Worker::append_status(std::string &out) {
+        const Z906::t_packetdata packet = _amp.get_data();
+
+        out += "\"data\":{";
+        append_field(out, "main_level", long{packet.main_level});
+        append_field(out, "center_level", long{packet.center_level});
+        append_field(out, "rear_level", long{packet.rear_level});
+        append_field(out, "sub_level", long{packet.sub_level});
+        append_field(out, "current_input", long{packet.current_input});
+        append_field(out, "current_fx", long{_amp.current_effect()});
+        append_field(out, "muted", _amp.muted_state());
+        append_field(out, "decode_mode", _amp.decode_mode());
+        append_field(out, "fx_input_1", long{packet.fx_input_1});
+        append_field(out, "fx_input_2", long{packet.fx_input_2});
+        append_field(out, "fx_input_3", long{packet.fx_input_3});
+        append_field(out, "fx_input_4", long{packet.fx_input_4});
+        append_field(out, "fx_input_5", long{packet.fx_input_5});
+        append_field(out, "fx_input_aux", long{packet.fx_input_aux});
+        append_field(out, "spdif_status", long{packet.spdif_status});
+        append_field(out, "signal_status", long{packet.signal_status});
+        append_field(out, "stby", long{packet.stby});
+        append_field(out, "auto_stby", long{packet.auto_stby});
+        close_object(out);
+    }
+
+    /**
+     * Send the cached status content as JSON to all WebSocket clients.
+     */
+    void Worker::broadcast_status() {
+        Reply reply;
+
+        track_status();
+        reply.generation = _generation;
+
+        reply.body = "{\"device\":" + std::to_string(index) + ",";
+        append_status(reply.body);
+        reply.body += '}';
+        status_fields(_amp, reply.fields);
+        post(std::move(reply));
+    }
+
+    /**
+     * Whether the cached status differs from the one of the current
+     * generation, like Device::status_changed().
+     */
+    bool Worker::status_changed() const {
+        const Z906::t_packetdata status = _amp.get_data();
+
+        if (_amp.status_age() == UINT32_MAX)
+            return false;
+        return !_generation || memcmp(&status, &_tracked, sizeof(status)) != 0 ||
+               _amp.muted_state() != _tracked_muted ||
+               _amp.decode_mode() != _tracked_decode;
+    }
+
+    /**
+     * Advance the status generation if the cached status differs from the
+     * last one seen, like Device::track_status(). Returns true if it did.
+     */
+    bool Worker::track_status() {
+        if (_generation && !status_changed())
+            return false;
+
+        _tracked        = _amp.get_data();
+        _tracked_muted  = _amp.muted_state();
+        _tracked_decode = _amp.decode_mode();
+        _generation++;
+        return true;
+    }
+
+    /**
+     * Read the status back from the unit and broadcast it if it differs from
+     * the last status broadcast. Other reads may have refreshed the cache
+     * since, so the cache itself is no reference.
+     */
+    void Worker::refresh_status() {
+        if (_amp.update() && status_changed())
+            broadcast_status();
+    }
+
+    /**
+     * Run a request against the unit, mirroring respond_to_request() of the
+     * firmware.
+     */
+    void Worker::respond(const Job &job, Reply &reply) {
+        const Endpoint &endpoint = *job.endpoint;
+        std::string     fields;
+        bool            success = true;
+        int             cmdResponse;
+        long            value;
+
+        // A status read within STATUS_CACHE_TTL proves the unit is connected
+        if (!online() ||
+            (_amp.status_age() > STATUS_CACHE_TTL && _amp.request(VERSION) == Z906_ERROR)) {
+            set_online(false);
+            reply.body = "{\"status\":\"disconnected\"}";
+            return;
+        }
+        set_online(true);
+        // The probe may have read a change made on the console
+        if (status_changed())
+            broadcast_status();
+
+        switch (endpoint.type) {
+        case EndpointType::SelectInput:
+            _amp.input(endpoint.action);
+            broadcast_status();
+            _verify = true;
+            break;
+        case EndpointType::RunCommand:
+            cmdResponse = _amp.cmd(endpoint.action);
+            broadcast_status();
+            _verify = true;
+            if (cmdResponse != Z906_ERROR) {
+                append_field(fields, "value", long{cmdResponse});
+            } else {
+                success = false;
+            }
+            break;
+        case EndpointType::SetValue:
+            if (job.value >= 0L && job.value <= 255L) {
+                success = _amp.cmd(endpoint.action, static_cast<uint8_t>(job.value)) !=
+                          Z906_ERROR;
+                if (success) {
+                    broadcast_status();
+                    _verify = true;
+                }
+            } else {
+                reply.code = 400;
+                success    = false;
+                fields     = "\"message\":\"Invalid value. Value must be "
+                             "between 0 and 255.\",";
+            }
+            break;
+        case EndpointType::GetValue:
+            value   = _amp.request(endpoint.action);
+            success = value != Z906_ERROR;
+            if (success)
+                append_field(fields, "value", value);
+            break;
+        case EndpointType::RunFunction:
+            switch (endpoint.action) {
+            case FunctionAction::Status:
+                reply.generation = _generation;
+                append_field(fields, "generation", static_cast<long>(_generation));
+                append_status(fields);
+                fields += ',';
+                break;
+            case FunctionAction::Mute:
+                append_field(fields, "value", _amp.muted_state());
+                break;
+            case FunctionAction::Effect:
+                append_field(fields, "value", long{_amp.current_effect()});
+                break;
+            case FunctionAction::Temperature:
+                value   = _amp.main_sensor();
+                success = value != Z906_ERROR;
+                if (success)
+                    append_field(fields, "value", value);
+                break;
+            case FunctionAction::Decode:
+                append_field(fields, "value", _amp.decode_mode());
+                break;
+            case FunctionAction::Volume:
+                value   = _amp.input_volume();
+                success = value != Z906_ERROR;
+                if (success)
+                    append_field(fields, "value", value);
+                break;
+            default: // do nothing
+                break;
+            }
+            break;
+        default:
+            reply.code = 405;
+            success    = false;
+            fields     = "\"message\":\"Your action was recognised, but it is "
+                         "not supported.\",";
+            break;
+        }
+
+        reply.body = "{\"status\":\"connected\",";
+        append_field(reply.body, "success", success);
+        reply.body += fields;
+        close_object(reply.body);
+    }
+
+} // namespace z906remote
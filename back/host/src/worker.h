@@ -0,0 +1,144 @@
+#pragma once
+
+#include "endpoints.h"
+#include "mqtt_bridge.h"
+#include "spsc_queue.h"
+#include <Arduino.h>
+#include <Z906Arduino.h>
+#include <Z906Trace.h>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+#define WORKER_QUEUE_SIZE 8
+#define WORKER_MAX_WAIT 2000
+#define WORKER_REPLY_QUEUE_SIZE 64
+#define WORKER_OFFLINE_BACKOFF 10000
+#define WORKER_UPDATE_INTERVAL 60000
+
+namespace z906remote {
+
+    /**
+     * A request handed from the HTTP thread to a unit's I/O thread.
+     */
+    struct Job {
+        uint64_t        client    = 0;
+        const Endpoint *endpoint  = nullptr;
+        long            value     = -1;
+        unsigned long   queued_at = 0;
+    };
+
+    /**
+     * Counters of one priority class, readable from any thread.
+     */
+    struct QueueStats {
+        std::atomic<uint32_t> served{0};
+        std::atomic<uint32_t> rejected{0};
+        std::atomic<uint32_t> wait_sum{0}; // ms
+        std::atomic<uint32_t> wait_max{0}; // ms
+        std::atomic<uint32_t> depth_max{0};
+    };
+
+    /**
+     * A JSON document handed back to the HTTP thread. Replies for client 0 are
+     * status updates broadcast to every WebSocket client, with the raw fields
+     * for the MQTT bridge. Status replies carry the status generation.
+     */
+    struct Reply {
+        uint64_t    client     = 0;
+        int         code       = 200;
+        std::string body;
+        uint8_t     fields[STATUS_FIELD_COUNT] = {};
+        uint32_t    generation = 0;
+    };
+
+    /**
+     * Print into a stdio file it closes, the output of a serial trace.
+     */
+    class FilePrint : public Print {
+    public:
+        explicit FilePrint(FILE *file) : _file(file) {}
+        ~FilePrint() override { fclose(_file); }
+
+        FilePrint(const FilePrint &)            = delete;
+        FilePrint &operator=(const FilePrint &) = delete;
+
+        size_t write(uint8_t c) override { return fputc(c, _file) != EOF; }
+        void   flush() override { fflush(_file); }
+
+    private:
+        FILE *_file;
+    };
+
+    /**
+     * Owns one Z906 unit and the thread doing all of its serial I/O, so one
+     * unit's timeouts never delay another unit or the HTTP thread.
+     * Given a trace path, the serial traffic is recorded to it, see Z906Trace.
+     */
+    class Worker {
+    public:
+        Worker(uint8_t index, const char *path, int notify_fd,
+               const char *trace = nullptr);
+        ~Worker();
+
+        Worker(const Worker &)            = delete;
+        Worker &operator=(const Worker &) = delete;
+
+        bool     is_open() const;
+        bool     push(Job &&);
+        bool     pop(Reply &);
+        void     start();
+        void     stop();
+        void     set_loudness(bool enabled) { _amp.set_loudness(enabled); } // before start()
+        void     set_update_interval(unsigned long ms) { _update_interval = ms; } // 0: off
+        size_t   depth(Priority) const;
+        uint32_t retry_after() const;
+        uint32_t service_avg() const { return _service_avg; }
+        uint32_t generation() const { return _generation; }
+
+        const QueueStats &stats(Priority priority) const {
+            return _stats[priority];
+        }
+
+        const uint8_t index;
+
+    private:
+        void run();
+        bool next(Job &);
+        void respond(const Job &, Reply &);
+        void broadcast_status();
+        void refresh_status();
+        void post(Reply &&);
+        bool online() const;
+        void set_online(bool);
+        void append_status(std::string &);
+        bool status_changed() const;
+        bool track_status();
+
+        HardwareSerial                           _serial;
+        Z906Trace<HardwareSerial>                _trace;
+        std::unique_ptr<FilePrint>               _trace_out;
+        bool                                     _trace_failed = false;
+        Z906Serial<Z906Trace<HardwareSerial>>    _amp;
+        SpscQueue<Job, WORKER_QUEUE_SIZE>        _jobs[PRIORITY_COUNT];
+        QueueStats                               _stats[PRIORITY_COUNT];
+        std::atomic<uint32_t>                    _service_avg{0}; // ms
+        SpscQueue<Reply, WORKER_REPLY_QUEUE_SIZE> _replies;
+        int                                      _wake_fd;
+        int                                      _notify_fd;
+        std::atomic<bool>                        _running{false};
+        std::thread                              _thread;
+        unsigned long                            _last_update     = 0;
+        unsigned long                            _update_interval = WORKER_UPDATE_INTERVAL;
+        bool                                     _verify          = false;
+        unsigned long                            _offline_since   = 0;
+        bool                                     _offline         = false;
+        Z906::t_packetdata                       _tracked         = {};
+        bool                                     _tracked_muted   = false;
+        bool                                     _tracked_decode  = false;
+        std::atomic<uint32_t>                    _generation{0};
+    };
+
+} // namespace z906remote
@@ -0,0 +1,152 @@
+/**
+ * Z906 Remote host daemon.
+ * Serves the firmware REST/WebSocket API for Z906 units attached to the
+ * serial ports (USB-UART adapters) of a Linux machine.
+ */
+#include "http_server.h"
+#include "mqtt_bridge.h"
+#include "mqtt_client.h"
+#include "version.h"
+#include "worker.h"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    volatile bool running = true;
+
+    void on_signal(int) { running = false; }
+
+    void usage(const char *name) {
+        fprintf(stderr,
+                "usage: %s [-p port] [-d docroot] [-m broker] [-t prefix] "
+                "[-r trace] [-l] serial_device...\n"
+                "  -p port     HTTP port (default 8080)\n"
+                "  -d docroot  web app directory, e.g. back/data\n"
+                "  -m broker   MQTT broker, [user[:password]@]host[:port]\n"
+                "  -t prefix   MQTT topic prefix (default " MQTT_PREFIX ")\n"
+                "  -r trace    record the serial traffic of device n to "
+                "<trace>n.trace\n"
+                "  -l          loudness compensation of the rear, center and "
+                "sub levels\n",
+                name);
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    uint16_t    port    = 8080;
+    const char *docroot = nullptr;
+    std::string broker;
+    const char *prefix   = MQTT_PREFIX;
+    const char *trace    = nullptr;
+    bool        loudness = false;
+    int         opt;
+
+    while ((opt = getopt(argc, argv, "p:d:m:t:r:lh")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = static_cast<uint16_t>(atoi(optarg));
+            break;
+        case 'd':
+            docroot = optarg;
+            break;
+        case 'm':
+            broker = optarg;
+            break;
+        case 't':
+            prefix = optarg;
+            break;
+        case 'r':
+            trace = optarg;
+            break;
+        case 'l':
+            loudness = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || argc - optind > 255) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    z906remote::HttpServer server(port, docroot);
+    if (!server.begin())
+        return 1;
+
+    // One I/O thread per unit, device n is the n-th serial port
+    std::vector<std::unique_ptr<z906remote::Worker>> workers;
+    for (int i = optind; i < argc; i++) {
+        const uint8_t index = static_cast<uint8_t>(i - optind);
+        std::string   path;
+        if (trace)
+            path = trace + std::to_string(index) + ".trace";
+        workers.emplace_back(new z906remote::Worker(
+            index, argv[i], server.notify_fd(), trace ? path.c_str() : nullptr));
+        if (!workers.back()->is_open())
+            return 1;
+        server.add_worker(workers.back().get());
+        workers.back()->set_loudness(loudness);
+        workers.back()->start();
+    }
+
+    // Optional MQTT bridge, fed by the same status broadcasts as /ws
+    std::unique_ptr<z906remote::MqttClient> mqtt;
+    std::unique_ptr<z906remote::MqttBridge> bridge;
+    if (!broker.empty()) {
+        std::string  user, password;
+        uint16_t     mqtt_port = MQTT_PORT;
+        const size_t at        = broker.rfind('@');
+        if (at != std::string::npos) {
+            user = broker.substr(0, at);
+            broker.erase(0, at + 1);
+            const size_t colon = user.find(':');
+            if (colon != std::string::npos) {
+                password = user.substr(colon + 1);
+                user.erase(colon);
+            }
+        }
+        const size_t colon = broker.rfind(':');
+        if (colon != std::string::npos) {
+            mqtt_port = static_cast<uint16_t>(atoi(broker.c_str() + colon + 1));
+            broker.erase(colon);
+        }
+
+        mqtt.reset(new z906remote::MqttClient(broker, mqtt_port, user, password));
+        bridge.reset(new z906remote::MqttBridge(
+            prefix,
+            [&mqtt](const char *topic, const char *payload) {
+                return mqtt->publish(topic, payload, true);
+            },
+            [&server](uint8_t device, const Endpoint &endpoint, long value) {
+                server.command(device, endpoint, value);
+            }));
+        mqtt->set_will(bridge->availability_topic(), "offline");
+        mqtt->on_connect([&mqtt, &bridge]() {
+            mqtt->subscribe(bridge->command_filter());
+            bridge->connected();
+        });
+        mqtt->on_message([&bridge](const char *topic, const char *payload,
+                                   size_t len) {
+            bridge->message(topic, payload, len);
+        });
+        server.set_mqtt(mqtt.get(), bridge.get());
+    }
+
+    fprintf(stderr, "z906d %s listening on port %u with %zu device(s)\n",
+            FIRMWARE_VERSION, port, workers.size());
+    server.run(running);
+
+    for (auto &worker : workers) worker->stop();
+    return 0;
+}
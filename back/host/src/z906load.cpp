@@ -0,0 +1,698 @@
+/**
+ * Load generator for the Z906 Remote HTTP/WebSocket API.
+ *
+ * Runs concurrent clients against z906d, usually on fakeamp, or against a
+ * unit. Each HTTP client runs sessions drawn from a weighted mix:
+ *
+ *   poll   GET /status, as the dashboards do
+ *   drag   a burst of /volume/main/set steps, a slider being dragged
+ *   input  an input switch, then a /status read
+ *   read   any read-only route of endpoints[]
+ *
+ * WebSocket clients send text frames on /ws and time their echo, counting
+ * the status broadcasts they receive meanwhile. /heap is sampled during the
+ * run. Reports throughput, p50/p99/p999 latency and error rates per session
+ * kind, and the heap low-water mark of the device.
+ */
+#include "endpoints.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    enum Kind { Poll, Drag, Switch, Query, Socket, KIND_COUNT };
+
+    const char *const KIND_NAMES[KIND_COUNT] = {"poll", "drag", "input", "read",
+                                                "ws"};
+
+    const uint64_t TIMEOUT     = 5000000; // us before a request counts as lost
+    const uint64_t HEAP_PERIOD = 250000;  // us between /heap samples
+    const int      DRAG_STEPS  = 10;
+
+    struct Options {
+        int         clients    = 8;
+        int         sockets    = 2;
+        int         seconds    = 10;
+        int         think      = 100; // ms between sessions, jittered
+        int         drag_step  = 40;  // ms between the steps of a drag
+        unsigned    weights[KIND_COUNT] = {6, 3, 1, 0, 0};
+        std::string prefix; // /dev/n, empty for the first unit
+        std::string host = "127.0.0.1";
+        std::string port = "8080";
+    };
+
+    struct Stats {
+        std::vector<uint32_t> latencies; // us, answered requests
+        unsigned long         busy   = 0; // 503
+        unsigned long         failed = 0; // other error statuses
+        unsigned long         errors = 0; // connection errors and timeouts
+        unsigned long         pushed = 0; // WebSocket broadcasts received
+    };
+
+    struct Client {
+        int                     fd        = -1;
+        bool                    websocket = false;
+        bool                    monitor   = false; // the /heap sampler
+        bool                    open      = false; // upgraded, for a websocket
+        std::string             in;
+        std::string             out;
+        Kind                    kind = Poll;
+        std::deque<std::string> steps;   // paths left in the session
+        uint64_t                started = 0; // us, request in flight, 0: none
+        uint64_t                next_at = 0; // us, next request due
+        std::string             token;       // echo awaited on a websocket
+        unsigned                sequence = 0;
+    };
+
+    struct Heap {
+        bool          seen      = false;
+        bool          host      = false; // z906d reports bytes in use
+        unsigned long low       = ~0UL;  // free, or the maximum in use
+        unsigned long reported  = 0;     // the device's own mark at the end
+        unsigned long samples   = 0;
+    };
+
+    volatile bool running = true;
+
+    Options                  options;
+    Stats                    stats[KIND_COUNT];
+    Heap                     heap;
+    std::vector<Client>      clients;
+    std::vector<const char *> reads; // read-only routes of endpoints[]
+    std::mt19937             rng{std::random_device{}()};
+    addrinfo                *target = nullptr;
+    int                      epoll  = -1;
+
+    void on_signal(int) { running = false; }
+
+    uint64_t now_us() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    unsigned random_below(unsigned n) {
+        return std::uniform_int_distribution<unsigned>(0, n - 1)(rng);
+    }
+
+    /**
+     * Think time before the next session, uniform over [think/2, 3*think/2].
+     */
+    uint64_t think_us() {
+        const unsigned think = options.think * 1000;
+        return think / 2 + random_below(think + 1);
+    }
+
+    /**
+     * Parse name=weight pairs, e.g. poll=6,drag=3,input=1.
+     */
+    bool parse_mix(const char *mix) {
+        unsigned weights[KIND_COUNT] = {};
+        std::string list(mix);
+        size_t      pos = 0;
+
+        while (pos <= list.size()) {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos)
+                end = list.size();
+            const std::string item  = list.substr(pos, end - pos);
+            const size_t      equal = item.find('=');
+            const std::string name  = item.substr(0, equal);
+            int               kind  = 0;
+            while (kind < Socket && name != KIND_NAMES[kind]) kind++;
+            if (kind == Socket) {
+                fprintf(stderr, "unknown session kind '%s'\n", name.c_str());
+                return false;
+            }
+            weights[kind] = equal == std::string::npos
+                                ? 1
+                                : strtoul(item.c_str() + equal + 1, nullptr, 10);
+            pos = end + 1;
+        }
+
+        unsigned total = 0;
+        for (unsigned weight : weights) total += weight;
+        if (!total) {
+            fprintf(stderr, "empty mix\n");
+            return false;
+        }
+        std::copy(weights, weights + KIND_COUNT, options.weights);
+        return true;
+    }
+
+    /**
+     * Queue the paths of a new session drawn from the mix.
+     */
+    void start_session(Client &client) {
+        unsigned total = 0;
+        for (unsigned weight : options.weights) total += weight;
+
+        unsigned pick = random_below(total);
+        int      kind = 0;
+        while (pick >= options.weights[kind]) pick -= options.weights[kind++];
+        client.kind = static_cast<Kind>(kind);
+
+        const std::string &p = options.prefix;
+        switch (client.kind) {
+        case Drag: {
+            int value = random_below(256);
+            int step  = random_below(2) ? 6 : -6;
+            for (int i = 0; i < DRAG_STEPS; i++) {
+                if (value + step < 0 || value + step > 255)
+                    step = -step;
+                value += step;
+                client.steps.push_back(p + "/volume/main/set?value=" +
+                                       std::to_string(value));
+            }
+            break;
+        }
+        case Switch:
+            client.steps.push_back(p + "/input/" + std::to_string(random_below(6)));
+            client.steps.push_back(p + "/status");
+            break;
+        case Query:
+            client.steps.push_back(p + reads[random_below(reads.size())]);
+            break;
+        default:
+            client.steps.push_back(p + "/status");
+            break;
+        }
+    }
+
+    void watch(Client &client, int op) {
+        epoll_event event{};
+        event.events   = EPOLLIN | (client.out.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+        event.data.u32 = static_cast<uint32_t>(&client - clients.data());
+        epoll_ctl(epoll, op, client.fd, &event);
+    }
+
+    void disconnect(Client &client) {
+        if (client.fd < 0)
+            return;
+        epoll_ctl(epoll, EPOLL_CTL_DEL, client.fd, nullptr);
+        close(client.fd);
+        client.fd   = -1;
+        client.open = false;
+        client.in.clear();
+        client.out.clear();
+    }
+
+    /**
+     * Start a non-blocking connection, the request waits in the out buffer.
+     */
+    bool connect_client(Client &client) {
+        client.fd = socket(target->ai_family,
+                           target->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           target->ai_protocol);
+        if (client.fd < 0)
+            return false;
+
+        const int one = 1;
+        setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(client.fd, target->ai_addr, target->ai_addrlen) < 0 &&
+            errno != EINPROGRESS) {
+            close(client.fd);
+            client.fd = -1;
+            return false;
+        }
+        watch(client, EPOLL_CTL_ADD);
+        return true;
+    }
+
+    void send_request(Client &client, const std::string &path, uint64_t now) {
+        client.out += "GET " + path + " HTTP/1.1\r\nHost: " + options.host +
+                      "\r\n\r\n";
+        client.started = now;
+        if (client.fd < 0 ? !connect_client(client)
+                          : (watch(client, EPOLL_CTL_MOD), false)) {
+            if (!client.monitor)
+                stats[client.kind].errors++;
+            client.out.clear();
+            client.started = 0;
+            client.next_at = now + think_us();
+        }
+    }
+
+    /**
+     * Send a masked text frame on an upgraded websocket.
+     */
+    void send_frame(Client &client, const std::string &payload) {
+        const uint8_t mask[4] = {0x5A, 0x39, 0x30, 0x36};
+
+        client.out += static_cast<char>(0x81);
+        client.out += static_cast<char>(0x80 | payload.size());
+        client.out.append(reinterpret_cast<const char *>(mask), 4);
+        for (size_t i = 0; i < payload.size(); i++)
+            client.out += static_cast<char>(payload[i] ^ mask[i % 4]);
+        watch(client, EPOLL_CTL_MOD);
+    }
+
+    /**
+     * Start whatever is due on a client: the next request of its session, a
+     * new session, an echo, a heap sample, or give up on a lost request.
+     */
+    void tick(Client &client, uint64_t now) {
+        if (client.started) {
+            if (now - client.started < TIMEOUT)
+                return;
+            if (!client.monitor)
+                stats[client.kind].errors++;
+            disconnect(client);
+            client.started = 0;
+            client.token.clear();
+            client.steps.clear();
+            client.next_at = now + think_us();
+        }
+        if (now < client.next_at || !running)
+            return;
+
+        if (client.monitor) {
+            send_request(client,
+                         heap.samples || heap.seen ? "/heap" : "/heap?reset", now);
+            return;
+        }
+        if (client.websocket) {
+            if (client.fd < 0) {
+                client.out = "GET /ws HTTP/1.1\r\nHost: " + options.host +
+                             "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                             "Sec-WebSocket-Version: 13\r\n\r\n";
+                client.started = now;
+                if (!connect_client(client)) {
+                    stats[Socket].errors++;
+                    client.out.clear();
+                    client.started = 0;
+                    client.next_at = now + think_us();
+                }
+            } else if (client.open) {
+                client.token = "z906load " +
+                               std::to_string(&client - clients.data()) + "." +
+                               std::to_string(client.sequence++);
+                client.started = now;
+                send_frame(client, client.token);
+            }
+            return;
+        }
+
+        if (client.steps.empty())
+            start_session(client);
+        const std::string path = client.steps.front();
+        client.steps.pop_front();
+        send_request(client, path, now);
+    }
+
+    unsigned long json_field(const std::string &body, const char *name,
+                             bool &found) {
+        const std::string key = std::string("\"") + name + "\":";
+        const size_t      pos = body.find(key);
+
+        found = pos != std::string::npos;
+        return found ? strtoul(body.c_str() + pos + key.size(), nullptr, 10) : 0;
+    }
+
+    void record_heap(int code, const std::string &body) {
+        bool found;
+
+        heap.samples++;
+        if (code != 200)
+            return;
+
+        unsigned long value = json_field(body, "free", found);
+        if (found) {
+            heap.low      = std::min(heap.low, value);
+            heap.reported = json_field(body, "free_min", found);
+        } else {
+            value = json_field(body, "used", found);
+            if (!found)
+                return;
+            heap.host     = true;
+            heap.low      = heap.seen ? std::max(heap.low, value) : value;
+            heap.reported = json_field(body, "used_max", found);
+        }
+        heap.seen = true;
+    }
+
+    /**
+     * Account a complete HTTP response and schedule the next request.
+     */
+    void answered(Client &client, int code, const std::string &body,
+                  uint64_t now) {
+        if (client.monitor) {
+            record_heap(code, body);
+            client.started = 0;
+            client.next_at = now + HEAP_PERIOD;
+            return;
+        }
+
+        Stats &s = stats[client.kind];
+        if (code == 200 || code == 304)
+            s.latencies.push_back(static_cast<uint32_t>(now - client.started));
+        else if (code == 503)
+            s.busy++;
+        else
+            s.failed++;
+
+        client.started = 0;
+        client.next_at = now + (client.steps.empty()
+                                    ? think_us()
+                                    : options.drag_step * 1000ULL);
+    }
+
+    /**
+     * Consume the websocket frames in the input buffer.
+     */
+    void process_frames(Client &client, uint64_t now) {
+        while (client.in.size() >= 2) {
+            const uint8_t b0     = static_cast<uint8_t>(client.in[0]);
+            uint64_t      len    = static_cast<uint8_t>(client.in[1]) & 0x7F;
+            size_t        header = 2;
+
+            if (len == 126) {
+                if (client.in.size() < 4)
+                    return;
+                len = static_cast<uint64_t>(static_cast<uint8_t>(client.in[2])) << 8 |
+                      static_cast<uint8_t>(client.in[3]);
+                header = 4;
+            } else if (len == 127) {
+                if (client.in.size() < 10)
+                    return;
+                len = 0;
+                for (int i = 2; i < 10; i++)
+                    len = len << 8 | static_cast<uint8_t>(client.in[i]);
+                header = 10;
+            }
+            if (client.in.size() < header + len)
+                return;
+
+            const std::string payload = client.in.substr(header, len);
+            client.in.erase(0, header + len);
+            if ((b0 & 0x0F) == 0x8) {
+                stats[Socket].errors++;
+                disconnect(client);
+                client.started = 0;
+                client.next_at = now + think_us();
+                return;
+            }
+            if ((b0 & 0x0F) != 0x1)
+                continue;
+
+            if (!client.token.empty() && payload == "Echo: " + client.token) {
+                stats[Socket].latencies.push_back(
+                    static_cast<uint32_t>(now - client.started));
+                client.token.clear();
+                client.started = 0;
+                client.next_at = now + think_us();
+            } else if (payload.compare(0, 6, "Echo: ") != 0) {
+                stats[Socket].pushed++;
+            }
+        }
+    }
+
+    /**
+     * Consume the HTTP responses in the input buffer. Returns false once the
+     * connection is to be closed.
+     */
+    bool process_http(Client &client, bool eof, uint64_t now) {
+        for (;;) {
+            const size_t end = client.in.find("\r\n\r\n");
+            if (end == std::string::npos)
+                return !eof;
+
+            std::string head = client.in.substr(0, end + 2);
+            std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+            const int    code   = atoi(client.in.c_str() + 9);
+            const size_t length = head.find("\r\ncontent-length:");
+            const bool   close_after =
+                head.find("\r\nconnection: close") != std::string::npos;
+            size_t size = 0;
+
+            if (client.websocket) {
+                client.in.erase(0, end + 4);
+                if (code != 101) {
+                    stats[Socket].failed++;
+                    return false;
+                }
+                client.open    = true;
+                client.started = 0;
+                client.next_at = now + think_us();
+                process_frames(client, now);
+                return true;
+            }
+
+            if (length != std::string::npos) {
+                size = strtoul(head.c_str() + length + 17, nullptr, 10);
+            } else if (code != 304 && code != 204) {
+                // Delimited by the end of the connection
+                if (!eof)
+                    return true;
+                size = client.in.size() - end - 4;
+            }
+            if (client.in.size() < end + 4 + size)
+                return !eof;
+
+            const std::string body = client.in.substr(end + 4, size);
+            client.in.erase(0, end + 4 + size);
+            if (client.started)
+                answered(client, code, body, now);
+            if (close_after || eof)
+                return false;
+        }
+    }
+
+    void on_event(Client &client, uint32_t events, uint64_t now) {
+        if (events & EPOLLOUT && !client.out.empty()) {
+            const ssize_t n = ::send(client.fd, client.out.data(),
+                                     client.out.size(), MSG_NOSIGNAL);
+            if (n > 0)
+                client.out.erase(0, n);
+            else if (errno != EAGAIN)
+                events |= EPOLLERR;
+            if (client.out.empty())
+                watch(client, EPOLL_CTL_MOD);
+        }
+
+        bool eof = events & (EPOLLERR | EPOLLHUP);
+        if (events & EPOLLIN) {
+            char buffer[4096];
+            for (;;) {
+                const ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    client.in.append(buffer, n);
+                    continue;
+                }
+                if (n == 0 || errno != EAGAIN)
+                    eof = true;
+                break;
+            }
+        }
+
+        const bool keep = client.websocket && client.open
+                              ? (process_frames(client, now), !eof)
+                              : process_http(client, eof, now);
+        if (keep || client.fd < 0)
+            return;
+
+        // Closed with a request in flight and no answer
+        if (client.started) {
+            if (!client.monitor)
+                stats[client.kind].errors++;
+            client.started = 0;
+            client.token.clear();
+            client.next_at = now + think_us();
+        }
+        disconnect(client);
+    }
+
+    uint32_t percentile(const std::vector<uint32_t> &sorted, double p) {
+        if (sorted.empty())
+            return 0;
+        size_t rank = static_cast<size_t>(p * sorted.size() + 0.999999);
+        return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+    }
+
+    void print_row(const char *name, Stats &s, double seconds) {
+        std::sort(s.latencies.begin(), s.latencies.end());
+        const unsigned long answered = s.latencies.size();
+        const unsigned long total    = answered + s.busy + s.failed + s.errors;
+        const double        rate     = total ? 100.0 / total : 0;
+
+        printf("%-6s %9lu %8.1f", name, total, total / seconds);
+        for (const double p : {0.5, 0.99, 0.999}) {
+            if (answered)
+                printf(" %8.2f", percentile(s.latencies, p) / 1e3);
+            else
+                printf(" %8s", "-");
+        }
+        printf(" %6.2f%% %6.2f%% %6.2f%%", s.busy * rate, s.failed * rate,
+               s.errors * rate);
+        if (s.pushed)
+            printf("  %.1f pushes/s", s.pushed / seconds);
+        printf("\n");
+    }
+
+    void report(double seconds) {
+        Stats total;
+
+        printf("%-6s %9s %8s %8s %8s %8s %7s %7s %7s\n", "kind", "requests",
+               "req/s", "p50 ms", "p99 ms", "p999 ms", "503", "failed",
+               "errors");
+        for (int kind = 0; kind < KIND_COUNT; kind++) {
+            Stats &s = stats[kind];
+            if (s.latencies.empty() && !s.busy && !s.failed && !s.errors)
+                continue;
+            if (kind != Socket) {
+                total.latencies.insert(total.latencies.end(),
+                                       s.latencies.begin(), s.latencies.end());
+                total.busy   += s.busy;
+                total.failed += s.failed;
+                total.errors += s.errors;
+            }
+            print_row(KIND_NAMES[kind], s, seconds);
+        }
+        print_row("http", total, seconds);
+
+        if (!heap.seen)
+            printf("heap: /heap not available\n");
+        else if (heap.host)
+            printf("heap: %lu bytes in use at most sampled, %lu reported by "
+                   "the daemon, over %lu samples\n",
+                   heap.low, heap.reported, heap.samples);
+        else
+            printf("heap: %lu bytes free at least sampled, %lu reported by "
+                   "the device, over %lu samples\n",
+                   heap.low, heap.reported, heap.samples);
+    }
+
+    void usage(const char *name) {
+        fprintf(stderr,
+                "usage: %s [-c clients] [-w websockets] [-d seconds] [-m mix] "
+                "[-t think] [-s step] [-u unit] host[:port]\n"
+                "  -c clients     HTTP clients (default 8)\n"
+                "  -w websockets  /ws clients (default 2)\n"
+                "  -d seconds     duration of the run (default 10)\n"
+                "  -m mix         weighted sessions of poll, drag, input and "
+                "read\n"
+                "                 (default poll=6,drag=3,input=1)\n"
+                "  -t think       ms between the sessions of a client "
+                "(default 100)\n"
+                "  -s step        ms between the steps of a drag (default 40)\n"
+                "  -u unit        address /dev/<unit>/ routes\n",
+                name);
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:w:d:m:t:s:u:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            options.clients = atoi(optarg);
+            break;
+        case 'w':
+            options.sockets = atoi(optarg);
+            break;
+        case 'd':
+            options.seconds = atoi(optarg);
+            break;
+        case 'm':
+            if (!parse_mix(optarg))
+                return 2;
+            break;
+        case 't':
+            options.think = atoi(optarg);
+            break;
+        case 's':
+            options.drag_step = atoi(optarg);
+            break;
+        case 'u':
+            options.prefix = std::string("/dev/") + optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc || options.clients < 0 || options.sockets < 0 ||
+        options.seconds <= 0 || options.think <= 0 || options.drag_step < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const std::string address = argv[optind];
+    const size_t      colon   = address.rfind(':');
+    options.host = address.substr(0, colon);
+    if (colon != std::string::npos)
+        options.port = address.substr(colon + 1);
+
+    addrinfo hints{};
+    hints.ai_socktype = SOCK_STREAM;
+    const int error = getaddrinfo(options.host.c_str(), options.port.c_str(),
+                                  &hints, &target);
+    if (error) {
+        fprintf(stderr, "%s: %s\n", address.c_str(), gai_strerror(error));
+        return 1;
+    }
+
+    for (const Endpoint &e : endpoints) {
+        if (e.type == GetValue || e.type == RunFunction)
+            reads.push_back(e.path);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    // Clients start spread over a think time, not all at once
+    const uint64_t start = now_us();
+    clients.resize(options.clients + options.sockets + 1);
+    for (size_t i = 0; i < clients.size(); i++) {
+        clients[i].websocket = i >= static_cast<size_t>(options.clients) &&
+                               i + 1 < clients.size();
+        clients[i].monitor   = i + 1 == clients.size();
+        clients[i].kind      = clients[i].websocket ? Socket : Poll;
+        clients[i].next_at   = clients[i].monitor ? start : start + think_us();
+    }
+
+    printf("z906load: %d clients, %d websockets, %d s against %s\n",
+           options.clients, options.sockets, options.seconds, address.c_str());
+
+    const uint64_t deadline = start + options.seconds * 1000000ULL;
+    epoll_event    events[64];
+    uint64_t       now = start;
+    while (running && now < deadline) {
+        uint64_t wake = deadline;
+        for (Client &client : clients) {
+            tick(client, now);
+            wake = std::min(wake, client.started ? client.started + TIMEOUT
+                                                 : client.next_at);
+        }
+
+        const int timeout = wake > now ? static_cast<int>((wake - now + 999) / 1000)
+                                       : 0;
+        const int count   = epoll_wait(epoll, events, 64, timeout);
+        now = now_us();
+        for (int i = 0; i < count; i++)
+            on_event(clients[events[i].data.u32], events[i].events, now);
+    }
+
+    report((now - start) / 1e6);
+    for (Client &client : clients) disconnect(client);
+    freeaddrinfo(target);
+    close(epoll);
+    return 0;
+}
@@ -0,0 +1,418 @@
+/**
+ * Replay of a recorded Z906 serial trace, see Z906Trace.
+ *
+ * Plays the amplifier side of the trace through an in-memory serial port into
+ * the unmodified Z906 library, issuing the library calls that produced the
+ * recorded TX bytes. The bytes the library writes must match the trace. Time
+ * is virtual: the library runs on a clock following the recorded timing, so a
+ * replay is deterministic and takes no longer than the library's own
+ * processing, which is what the latencies report. Neither the transport nor
+ * the clock need the Arduino core.
+ */
+#include <Z906Core.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    // Virtual clock of the library, in microseconds
+    unsigned long long clock_us = 0;
+
+    const unsigned long POLL_STEP = 1000; // us, time passing per empty poll
+
+    struct Event {
+        unsigned long long   at = 0; // us since the start of the trace
+        bool                 tx = false;
+        std::vector<uint8_t> bytes;
+        int                  line = 0;
+    };
+
+    /**
+     * Read a trace file, returns false on a malformed line.
+     */
+    bool load(const char *path, std::vector<Event> &events) {
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            perror(path);
+            return false;
+        }
+
+        char               buffer[512];
+        int                line = 0;
+        unsigned long long at   = 0;
+        bool               ok   = true;
+        while (ok && fgets(buffer, sizeof(buffer), file)) {
+            line++;
+            if (buffer[0] == '#' || buffer[0] == '\n')
+                continue;
+
+            Event event;
+            char *pos   = buffer;
+            at         += strtoull(pos, &pos, 10);
+            event.at    = at;
+            event.line  = line;
+            while (*pos == ' ') pos++;
+            if (strncmp(pos, "TX", 2) == 0 || strncmp(pos, "RX", 2) == 0) {
+                event.tx  = pos[0] == 'T';
+                pos      += 2;
+            } else {
+                ok = false;
+            }
+
+            for (;;) {
+                char         *end;
+                unsigned long value = strtoul(pos, &end, 16);
+                if (end == pos)
+                    break;
+                if (value > 0xFF)
+                    ok = false;
+                event.bytes.push_back(static_cast<uint8_t>(value));
+                pos = end;
+            }
+            if (event.bytes.empty())
+                ok = false;
+            if (!ok)
+                fprintf(stderr, "%s:%d: malformed trace line\n", path, line);
+            events.push_back(std::move(event));
+        }
+        fclose(file);
+        return ok;
+    }
+
+    /**
+     * The amplifier side of a trace as a serial port. Recorded RX bytes become
+     * available once the TX before them is written, after the recorded delay.
+     */
+    class ReplayStream {
+    public:
+        explicit ReplayStream(const std::vector<Event> &events)
+            : _events(events) {}
+
+        int available() {
+            const size_t before = _rx.size();
+
+            release();
+            if (_rx.empty() || (_polled && _rx.size() == before)) {
+                // The library is waiting, let time pass up to the next reply
+                unsigned long long step = POLL_STEP;
+                if (_next < _events.size() && !_events[_next].tx &&
+                    due(_events[_next]) > clock_us)
+                    step = std::min(step, due(_events[_next]) - clock_us);
+                clock_us += step;
+                release();
+            }
+            _polled = true;
+            return static_cast<int>(_rx.size());
+        }
+
+        int read() {
+            release();
+            _polled = false;
+            if (_rx.empty())
+                return -1;
+
+            const uint8_t c = _rx.front();
+            _rx.pop_front();
+            return c;
+        }
+
+        int peek() {
+            release();
+            return _rx.empty() ? -1 : _rx.front();
+        }
+
+        size_t write(uint8_t c) {
+            if (_diverged)
+                return 1;
+
+            // Replies the library did not wait for arrive late
+            while (_next < _events.size() && !_events[_next].tx) {
+                const Event &event = _events[_next++];
+                _rx.insert(_rx.end(), event.bytes.begin(), event.bytes.end());
+            }
+
+            if (_next == _events.size()) {
+                fprintf(stderr, "end of trace: library wrote %02x\n", c);
+                _diverged = true;
+                return 1;
+            }
+
+            const Event &event = _events[_next];
+            if (event.bytes[_tx_pos] != c) {
+                fprintf(stderr, "line %d: expected %02x, library wrote %02x\n",
+                        event.line, event.bytes[_tx_pos], c);
+                _diverged = true;
+                return 1;
+            }
+
+            if (++_tx_pos == event.bytes.size()) {
+                _anchor_at = event.at;
+                _anchor    = clock_us;
+                _tx_pos    = 0;
+                _next++;
+            }
+            return 1;
+        }
+
+        void flush() {}
+
+        /**
+         * Index of the next TX event to be written, or the end of the trace.
+         */
+        size_t next_tx() const {
+            size_t i = _next;
+            while (i < _events.size() && !_events[i].tx) i++;
+            return i;
+        }
+
+        /**
+         * Let the time recorded between the last TX and the given event pass,
+         * less the time the library takes before writing it.
+         */
+        void wait_for(const Event &event, unsigned long long lead) {
+            const unsigned long long target = due(event);
+            if (target > clock_us + lead)
+                clock_us = target - lead;
+        }
+
+        bool diverged() const { return _diverged; }
+
+    private:
+        unsigned long long due(const Event &event) const {
+            return _anchor + (event.at - _anchor_at);
+        }
+
+        void release() {
+            while (_next < _events.size() && !_events[_next].tx &&
+                   due(_events[_next]) <= clock_us) {
+                const Event &event = _events[_next++];
+                _rx.insert(_rx.end(), event.bytes.begin(), event.bytes.end());
+            }
+        }
+
+        const std::vector<Event> &_events;
+        std::deque<uint8_t>       _rx;
+        size_t                    _next      = 0;
+        size_t                    _tx_pos    = 0;
+        unsigned long long        _anchor_at = 0; // trace time of the last TX
+        unsigned long long        _anchor    = 0; // clock_us of the last TX
+        bool                      _polled    = false;
+        bool                      _diverged  = false;
+    };
+
+    /**
+     * Clock of the library, see Z906Core.
+     */
+    struct VirtualClock {
+        static uint32_t millis() { return static_cast<uint32_t>(clock_us / 1000); }
+        static void     delay(uint32_t ms) { clock_us += ms * 1000ULL; }
+    };
+
+    typedef Z906Core<ReplayStream, VirtualClock> ReplayAmp;
+
+    enum CallType { Update, Command, SetValue, Input, Off, Temp, Gain, CALLS };
+
+    const char *const CALL_NAMES[CALLS] = {"update",      "cmd",  "cmd(a,b)",
+                                           "input",       "off",  "main_sensor",
+                                           "input_volume"};
+
+    struct Call {
+        CallType type = Command;
+        uint8_t  a    = 0;
+        uint8_t  b    = 0;
+    };
+
+    /**
+     * The library call writing the TX event at index, judged from its bytes.
+     */
+    Call identify(const std::vector<Event> &events, size_t index,
+                  const Z906 &amp) {
+        const std::vector<uint8_t> &bytes = events[index].bytes;
+        Call                        call;
+
+        call.a = bytes[0];
+        if (bytes[0] == 0xAA && bytes.size() > 3) {
+            // Status buffer written back, the first changed field was set
+            const Z906::t_packetdata cached = amp.get_data();
+            uint8_t                  status[sizeof(cached)];
+            memcpy(status, &cached, sizeof(cached));
+
+            call.type = SetValue;
+            call.a    = MAIN_LEVEL;
+            for (size_t i = MAIN_LEVEL; i + 1 < bytes.size(); i++) {
+                if (i < sizeof(status) && bytes[i] != status[i]) {
+                    call.a = static_cast<uint8_t>(i);
+                    break;
+                }
+            }
+            call.b = bytes[call.a];
+            if (call.a >= MAIN_LEVEL && call.a <= SUB_LEVEL) {
+                // 0...255 value the library scales back to it
+                call.b = volume_value(call.b);
+            }
+        } else if (bytes.size() == 4 && bytes[0] == MUTE_ON &&
+                   bytes[3] == MUTE_OFF) {
+            call.type = Input;
+            call.a    = bytes[1];
+            call.b    = bytes[2];
+        } else if (bytes[0] == GET_STATUS) {
+            call.type = Update;
+        } else if (bytes[0] == GET_TEMP) {
+            call.type = Temp;
+        } else if (bytes[0] == GET_INPUT_GAIN) {
+            call.type = Gain;
+        } else if (bytes[0] == PWM_OFF) {
+            size_t next = index + 1;
+            while (next < events.size() && !events[next].tx) next++;
+            if (next < events.size() &&
+                events[next].bytes[0] == RESET_PWR_UP_TIME)
+                call.type = Off;
+        }
+        return call;
+    }
+
+    long run(Z906 &amp, const Call &call) {
+        switch (call.type) {
+        case Update:
+            return amp.update();
+        case Command:
+            return amp.cmd(call.a);
+        case SetValue:
+            return amp.cmd(call.a, call.b);
+        case Input:
+            amp.input(call.a, call.b);
+            return call.a;
+        case Off:
+            amp.off();
+            return 0;
+        case Temp:
+            return amp.main_sensor();
+        case Gain:
+            return amp.input_volume();
+        default:
+            return 0;
+        }
+    }
+
+    struct Stats {
+        std::vector<double> wall;   // us
+        unsigned long long  serial = 0; // virtual us
+        unsigned            failed = 0;
+    };
+
+    double percentile(std::vector<double> &samples, double p) {
+        if (samples.empty())
+            return 0;
+        std::sort(samples.begin(), samples.end());
+        const size_t index = static_cast<size_t>(p * (samples.size() - 1));
+        return samples[index];
+    }
+
+    /**
+     * Replay the whole trace once, returns false if the library diverged.
+     */
+    bool replay(const std::vector<Event> &events, Stats *stats, bool verbose) {
+        ReplayStream stream(events);
+        ReplayAmp    amp(stream);
+
+        for (size_t index = stream.next_tx(); index < events.size();
+             index        = stream.next_tx()) {
+            const Call call = identify(events, index, amp);
+
+            // The library waits SERIAL_DEADTIME before writing a command
+            stream.wait_for(events[index], SERIAL_DEADTIME * 1000ULL);
+
+            const unsigned long long started = clock_us;
+            const auto wall_start = std::chrono::steady_clock::now();
+            const long result     = run(amp, call);
+            const auto wall_end   = std::chrono::steady_clock::now();
+
+            if (stream.diverged())
+                return false;
+
+            Stats &entry = stats[call.type];
+            entry.wall.push_back(
+                std::chrono::duration<double, std::micro>(wall_end - wall_start)
+                    .count());
+            entry.serial += clock_us - started;
+            if (result == Z906_ERROR || (call.type == Update && !result))
+                entry.failed++;
+
+            if (verbose) {
+                const Z906::t_packetdata status = amp.get_data();
+                printf("%d %s %02x %02x = %ld | %u %u %u %u in %u muted %d "
+                       "stby %u\n",
+                       events[index].line, CALL_NAMES[call.type], call.a,
+                       call.b, result, status.main_level, status.rear_level,
+                       status.center_level, status.sub_level,
+                       status.current_input, amp.muted_state(), status.stby);
+            }
+        }
+        return true;
+    }
+
+    void usage(const char *name) {
+        fprintf(stderr,
+                "usage: %s [-n iterations] [-v] trace\n"
+                "  -n iterations  replays of the trace (default 1)\n"
+                "  -v             print each call, its result and the status\n",
+                name);
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    int  iterations = 1;
+    bool verbose    = false;
+    int  opt;
+
+    while ((opt = getopt(argc, argv, "n:vh")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<Event> events;
+    if (!load(argv[optind], events))
+        return 1;
+
+    Stats stats[CALLS];
+    for (int i = 0; i < iterations; i++) {
+        if (!replay(events, stats, verbose && i == 0))
+            return 2;
+    }
+
+    printf("%-14s %7s %7s %10s %10s %10s %10s\n", "call", "count", "failed",
+           "avg_us", "p99_us", "max_us", "serial_ms");
+    for (int i = 0; i < CALLS; i++) {
+        Stats &entry = stats[i];
+        if (entry.wall.empty())
+            continue;
+
+        double sum = 0;
+        for (double sample : entry.wall) sum += sample;
+        const double count = static_cast<double>(entry.wall.size());
+        printf("%-14s %7zu %7u %10.2f %10.2f %10.2f %10.2f\n", CALL_NAMES[i],
+               entry.wall.size(), entry.failed, sum / count,
+               percentile(entry.wall, 0.99), percentile(entry.wall, 1.0),
+               static_cast<double>(entry.serial) / count / 1000.0);
+    }
+    return 0;
+}
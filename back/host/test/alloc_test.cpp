@@ -0,0 +1,391 @@
+/**
+ * Heap traffic of the hot paths, checked against budgets.
+ *
+ * malloc() and operator new are hooked to count the allocations and the peak
+ * of the bytes in use. Every operation runs a few times to reach its steady
+ * state, then is measured over further runs. The largest count and peak seen
+ * must stay within the budgets file, an operation without a budget fails too.
+ * A peak budget of "-" is not checked: the bytes of the worker paths depend
+ * on the libc and libstdc++, their allocation counts do not.
+ *
+ * The units are simulated by fakeamp:
+ *   z906.*    the Z906 library, Z906Serial<HardwareSerial> on the first pty
+ *   mqtt.*    the MQTT mapping of the status, shared with the firmware
+ *   worker.*  the request path of z906d on the second pty: Worker::respond(),
+ *             broadcast_status() and append_status(), the counterparts of
+ *             respond_to_request(), broadcastStatus() and handle_get_status()
+ *
+ * usage: z906alloc [-w] fakeamp budgets
+ *   -w  print the measured budgets instead of checking them
+ */
+#include "mqtt_bridge.h"
+#include "worker.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <map>
+#include <new>
+#include <signal.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace z906remote;
+
+namespace {
+    std::atomic<bool>          tracking{false};
+    std::atomic<unsigned long> allocations{0};
+    std::atomic<long>          in_use{0}; // bytes
+    std::atomic<long>          peak{0};   // bytes
+
+    void account_alloc(void *pointer) {
+        if (!pointer)
+            return;
+
+        const long now = in_use += static_cast<long>(malloc_usable_size(pointer));
+        if (!tracking)
+            return;
+
+        allocations++;
+        long seen = peak;
+        while (now > seen && !peak.compare_exchange_weak(seen, now)) {
+        }
+    }
+
+    void account_free(void *pointer) {
+        if (pointer)
+            in_use -= static_cast<long>(malloc_usable_size(pointer));
+    }
+} // namespace
+
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void *__libc_memalign(size_t, size_t);
+void  __libc_free(void *);
+
+void *malloc(size_t size) {
+    void *pointer = __libc_malloc(size);
+    account_alloc(pointer);
+    return pointer;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *pointer = __libc_calloc(count, size);
+    account_alloc(pointer);
+    return pointer;
+}
+
+void *realloc(void *old, size_t size) {
+    account_free(old);
+    void *pointer = __libc_realloc(old, size);
+    account_alloc(pointer ? pointer : (size ? old : nullptr));
+    return pointer;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    void *pointer = __libc_memalign(alignment, size);
+    account_alloc(pointer);
+    return pointer;
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) {
+    *result = __libc_memalign(alignment, size);
+    account_alloc(*result);
+    return *result || !size ? 0 : ENOMEM;
+}
+
+void free(void *pointer) {
+    account_free(pointer);
+    __libc_free(pointer);
+}
+}
+
+void *operator new(size_t size) {
+    void *pointer = malloc(size ? size : 1);
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void  operator delete(void *pointer) noexcept { free(pointer); }
+void  operator delete[](void *pointer) noexcept { free(pointer); }
+void  operator delete(void *pointer, size_t) noexcept { free(pointer); }
+void  operator delete[](void *pointer, size_t) noexcept { free(pointer); }
+
+namespace {
+    const int WARMUP     = 3;
+    const int ITERATIONS = 10;
+    const int SETTLE     = 50; // ms for a unit's read-back after a reply
+
+    struct Budget {
+        unsigned long allocations = 0;
+        long          peak        = 0; // bytes above the start of a run, -1: any
+    };
+
+    struct Result {
+        std::string name;
+        Budget      measured;
+    };
+
+    std::vector<Result> results;
+
+    /**
+     * Run an operation WARMUP times, then keep the worst of ITERATIONS runs.
+     */
+    template <class Operation> void measure(const char *name, Operation operation) {
+        Budget worst;
+
+        for (int i = 0; i < WARMUP; i++) operation(i);
+        for (int i = 0; i < ITERATIONS; i++) {
+            allocations = 0;
+            const long start = in_use;
+            peak             = start;
+            tracking         = true;
+            operation(WARMUP + i);
+            tracking = false;
+
+            worst.allocations = std::max(worst.allocations, allocations.load());
+            worst.peak        = std::max(worst.peak, peak - start);
+        }
+        results.push_back({name, worst});
+    }
+
+    /**
+     * Read the budgets file: "name allocations peak" lines, # comments. A
+     * peak of "-" accepts any.
+     */
+    bool load_budgets(const char *path, std::map<std::string, Budget> &budgets) {
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            perror(path);
+            return false;
+        }
+
+        char line[256];
+        while (fgets(line, sizeof(line), file)) {
+            char   name[128];
+            char   peak[32];
+            Budget budget;
+            if (line[0] == '#' ||
+                sscanf(line, "%127s %lu %31s", name, &budget.allocations, peak) != 3)
+                continue;
+            budget.peak   = strcmp(peak, "-") ? strtol(peak, nullptr, 10) : -1;
+            budgets[name] = budget;
+        }
+        fclose(file);
+        return true;
+    }
+
+    /**
+     * Start fakeamp with the given number of units, returns its pid.
+     */
+    pid_t start_fakeamp(const char *path, int units,
+                        std::vector<std::string> &ptys) {
+        int pipe_fds[2];
+        if (pipe(pipe_fds) < 0)
+            return -1;
+
+        const pid_t pid = fork();
+        if (pid == 0) {
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            const std::string count = std::to_string(units);
+            execl(path, path, count.c_str(), static_cast<char *>(nullptr));
+            _exit(127);
+        }
+        close(pipe_fds[1]);
+
+        FILE *out = fdopen(pipe_fds[0], "r");
+        char  line[256];
+        while (static_cast<int>(ptys.size()) < units && fgets(line, sizeof(line), out)) {
+            line[strcspn(line, "\n")] = '\0';
+            ptys.push_back(line);
+        }
+        fclose(out);
+        return pid;
+    }
+
+    const Endpoint *find_endpoint(const char *path) {
+        for (const Endpoint &e : endpoints) {
+            if (!strcmp(e.path, path))
+                return &e;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Drain the replies of a worker, returns true if the one for client 1
+     * was among them.
+     */
+    bool drain(Worker &worker, Reply &reply) {
+        bool answered = false;
+        while (worker.pop(reply)) answered |= reply.client == 1;
+        return answered;
+    }
+
+    /**
+     * Run a request through a worker: queue it, wait for its reply, then for
+     * the read-back and broadcasts it triggers.
+     */
+    bool request(Worker &worker, Reply &reply, const char *path, long value) {
+        Job job;
+        job.client   = 1;
+        job.endpoint = find_endpoint(path);
+        job.value    = value;
+        if (!job.endpoint || !worker.push(std::move(job)))
+            return false;
+
+        for (int waited = 0; !drain(worker, reply); waited++) {
+            if (waited == 2000)
+                return false;
+            delay(1);
+        }
+        delay(SETTLE);
+        drain(worker, reply);
+        return true;
+    }
+
+    bool publish(const char *, const char *) { return true; }
+
+    void run_library(const char *pty) {
+        HardwareSerial             serial(pty);
+        Z906Serial<HardwareSerial> amp(serial);
+        uint8_t                    fields[STATUS_FIELD_COUNT];
+
+        serial.begin(BAUD_RATE, SERIAL_CONFIG);
+        measure("z906.update", [&](int) { amp.update(); });
+        measure("z906.request", [&](int) { amp.request(MAIN_LEVEL); });
+        measure("z906.cmd", [&](int i) { amp.cmd(i % 2 ? MUTE_ON : MUTE_OFF); });
+        measure("z906.set_value", [&](int i) {
+            amp.cmd(MAIN_LEVEL, static_cast<uint8_t>(i % 2 ? 100 : 150));
+        });
+        measure("z906.input", [&](int i) {
+            amp.input(i % 2 ? SELECT_INPUT_2 : SELECT_INPUT_1);
+        });
+        measure("z906.main_sensor", [&](int) { amp.main_sensor(); });
+        measure("z906.input_volume", [&](int) { amp.input_volume(); });
+        measure("z906.status_fields", [&](int) { status_fields(amp, fields); });
+
+        MqttBridge bridge("z906", publish, nullptr);
+        status_fields(amp, fields);
+        bridge.status_changed(0, fields);
+        delay(MQTT_COALESCE_DELAY);
+        bridge.loop();
+        measure("mqtt.status_changed", [&](int i) {
+            fields[MainLevel] = static_cast<uint8_t>(i);
+            bridge.status_changed(0, fields);
+        });
+        measure("mqtt.publish", [&](int) {
+            bridge.connected();
+            bridge.loop();
+        });
+    }
+
+    bool run_worker(const char *pty) {
+        const int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        Worker    worker(1, pty, notify_fd);
+        Reply     reply;
+        bool      ok = true;
+
+        if (!worker.is_open()) {
+            fprintf(stderr, "%s: cannot open\n", pty);
+            return false;
+        }
+        // Only the read-backs of the requests measured, no periodic polling
+        worker.set_update_interval(0);
+        worker.start();
+        delay(SETTLE);
+        drain(worker, reply);
+
+        const auto run = [&](const char *name, const char *path, long value,
+                             long other) {
+            measure(name, [&](int i) {
+                ok &= request(worker, reply, path, i % 2 ? value : other);
+            });
+        };
+        run("worker.status", "/status", -1, -1);
+        run("worker.get_value", "/volume/main", -1, -1);
+        run("worker.command", "/mute/on", -1, -1);
+        run("worker.set_value", "/volume/main/set", 100, 150);
+        run("worker.input", "/input/1", -1, -1);
+        run("worker.temperature", "/temperature", -1, -1);
+        run("worker.input_volume", "/input/volume", -1, -1);
+
+        worker.stop();
+        close(notify_fd);
+        return ok;
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    const bool write = argc > 1 && !strcmp(argv[1], "-w");
+    if (argc != 3 + write) {
+        fprintf(stderr, "usage: %s [-w] fakeamp budgets\n", argv[0]);
+        return 2;
+    }
+
+    std::map<std::string, Budget> budgets;
+    if (!write && !load_budgets(argv[2 + write], budgets))
+        return 2;
+
+    std::vector<std::string> ptys;
+    const pid_t              fakeamp = start_fakeamp(argv[1 + write], 2, ptys);
+    if (fakeamp < 0 || ptys.size() != 2) {
+        fprintf(stderr, "%s: no simulated units\n", argv[1 + write]);
+        return 2;
+    }
+
+    run_library(ptys[0].c_str());
+    const bool served = run_worker(ptys[1].c_str());
+    kill(fakeamp, SIGTERM);
+    waitpid(fakeamp, nullptr, 0);
+    if (!served) {
+        fprintf(stderr, "worker requests failed\n");
+        return 1;
+    }
+
+    if (write) {
+        printf("# operation allocations peak_bytes\n");
+        for (const Result &result : results) {
+            // The worker paths are budgeted by allocations only
+            const std::string peak = result.name.rfind("worker.", 0)
+                                         ? std::to_string(result.measured.peak)
+                                         : "-";
+            printf("%s %lu %s\n", result.name.c_str(),
+                   result.measured.allocations, peak.c_str());
+        }
+        return 0;
+    }
+
+    int failures = 0;
+    printf("%-22s %12s %12s\n", "operation", "allocations", "peak bytes");
+    for (const Result &result : results) {
+        const auto budget = budgets.find(result.name);
+        const char *verdict = "";
+
+        if (budget == budgets.end()) {
+            verdict = "  FAIL: no budget";
+            failures++;
+        } else if (result.measured.allocations > budget->second.allocations ||
+                   (budget->second.peak >= 0 &&
+                    result.measured.peak > budget->second.peak)) {
+            verdict = "  FAIL: over budget";
+            failures++;
+        }
+        printf("%-22s %5lu / %-5lu %5ld / %-5ld%s\n", result.name.c_str(),
+               result.measured.allocations,
+               budget == budgets.end() ? 0 : budget->second.allocations,
+               result.measured.peak,
+               budget == budgets.end() ? 0 : budget->second.peak, verdict);
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include "device.h"
+#include "endpoints.h"
+#include <Arduino.h>
+
+#define AUTOMATION_MAX_RULES 16
+#define AUTOMATION_MAX_DEVICES 4
+#define AUTOMATION_FILE "/rules.bin"
+#define AUTOMATION_FILE_VERSION 1
+#define AUTOMATION_TICK 1000      // ms between looks at the earliest deadline
+#define AUTOMATION_EVERY_DAY 0x7F // days of a rule, bit 0 is Sunday
+#ifndef AUTOMATION_UTC_OFFSET
+#    define AUTOMATION_UTC_OFFSET 0 // s, the rules run on local time
+#endif
+
+namespace z906remote {
+
+    enum RuleKind : uint8_t { RuleAt, RuleIdle };
+
+    /**
+     * A rule, stored as it is in AUTOMATION_FILE.
+     *
+     * RuleAt fires at minutes past midnight on the days set in days. RuleIdle
+     * fires once the unit has been on without an input signal for minutes.
+     * Both send endpoints[endpoint] to the unit, with value for SetValue
+     * endpoints. A RuleAt setting a level gets there in steps over ramp
+     * minutes.
+     */
+    struct Rule {
+        RuleKind kind;
+        uint8_t  device;
+        uint8_t  days;
+        uint8_t  endpoint;
+        uint16_t minutes;
+        uint8_t  value;
+        uint8_t  ramp;
+    };
+
+    static_assert(sizeof(Rule) == 8, "rules are stored in 8 bytes");
+
+    /**
+     * Time-based rules, run through the command path of the REST endpoints.
+     *
+     * The rules wait in a binary heap ordered by their next deadline, so a
+     * tick only compares the earliest one with the time, whatever the rule
+     * count. A rule is put back in the heap after it fired, at its next day
+     * or ramp step. RuleAt deadlines come from the NTP time, these rules stay
+     * off until it is known. RuleIdle deadlines follow the status broadcasts.
+     */
+    class Automation {
+    public:
+        typedef uint32_t (*Clock)(); // local epoch s, 0 while unknown
+        typedef void (*Command)(uint8_t, const Endpoint &, long);
+
+        void begin(Device *, uint8_t, Clock, Command);
+        bool add(const Rule &);
+        bool remove(uint8_t);
+        void status_changed(const Device &);
+        void loop();
+        long due_in(uint8_t) const;
+
+        uint8_t     count() const { return _count; }
+        const Rule &rule(uint8_t id) const { return _rules[id]; }
+
+    private:
+        struct Ramp {
+            uint8_t       level    = 0;
+            uint8_t       target   = 0;
+            unsigned long interval = 0; // ms per level
+            bool          active   = false;
+        };
+
+        bool valid(const Rule &) const;
+        void load();
+        bool save() const;
+        void arm_all();
+        void arm(uint8_t, uint32_t = 0);
+        void fire(uint8_t);
+        void ramp_step(uint8_t);
+        void schedule(uint8_t, unsigned long);
+        void cancel(uint8_t);
+        bool earlier(uint8_t, uint8_t) const;
+        void swap(uint8_t, uint8_t);
+        void sift_up(uint8_t);
+        void sift_down(uint8_t);
+
+        Device       *_devices       = nullptr;
+        uint8_t       _devices_count = 0;
+        Clock         _clock         = nullptr;
+        Command       _command       = nullptr;
+        bool          _timed         = false; // the RuleAt rules are armed
+
+        Rule          _rules[AUTOMATION_MAX_RULES];
+        Ramp          _ramps[AUTOMATION_MAX_RULES];
+        bool          _latched[AUTOMATION_MAX_RULES] = {}; // fired while idle
+        uint8_t       _count = 0;
+
+        // Heap of rule ids by _due, _pos[id] is the place of a rule or -1
+        uint8_t       _heap[AUTOMATION_MAX_RULES];
+        int8_t        _pos[AUTOMATION_MAX_RULES];
+        unsigned long _due[AUTOMATION_MAX_RULES];
+        uint8_t       _size = 0;
+
+        // millis() since which a unit has been idle, if it is
+        unsigned long _idle_since[AUTOMATION_MAX_DEVICES];
+        bool          _idle[AUTOMATION_MAX_DEVICES] = {};
+    };
+
+} // namespace z906remote
@@ -0,0 +1,48 @@
+#pragma once
+#include "endpoints.h"
+#include "longpoll.h"
+#include "scheduler.h"
+#include <ESPAsyncWebServer.h>
+#include <Z906.h>
+
+#define DEVICE_OFFLINE_BACKOFF 10000
+#define DEVICE_POLL_INTERVAL 60000
+
+namespace z906remote {
+
+    /**
+     * One Z906 unit: its protocol core, bound to its serial link, and its
+     * request scheduler. The status generation increases every time the cached
+     * status changes.
+     */
+    class Device {
+    public:
+        Device(uint8_t index, Z906 &amp);
+
+        bool push(AsyncWebServerRequest *, const Endpoint &, long);
+        bool push_command(const Endpoint &, long);
+        bool push_update();
+        bool pop(Job &);
+        bool online() const;
+        void set_online(bool);
+        bool status_changed() const;
+        bool track_status();
+
+        uint32_t generation() const { return _generation; }
+
+        const uint8_t index;
+        Z906         &amp;
+        Scheduler     scheduler;
+        LongPoll      waiters;
+
+    private:
+        bool               _update_queued  = false;
+        unsigned long      _offline_since  = 0;
+        bool               _offline        = false;
+        Z906::t_packetdata _tracked        = {};
+        bool               _tracked_muted  = false;
+        bool               _tracked_decode = false;
+        uint32_t           _generation     = 0;
+    };
+
+} // namespace z906remote
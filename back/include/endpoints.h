@@ -5,12 +5,28 @@ enum EndpointType { SelectInput, RunCommand, SetValue, GetValue, RunFunction };
 
 enum FunctionAction { Status, Mute, Effect, Temperature, Decode, Volume };
 
+// Scheduling classes of the serial link, highest priority first
+enum Priority { Interactive, Read, Telemetry, PRIORITY_COUNT };
+
 struct Endpoint {
     const char        *path;
     const EndpointType type;
     const uint8_t      action;
 };
 
+/**
+ * Commands changing the unit are served first, then reads, then the
+ * status polling of dashboards.
+ */
+constexpr Priority priority_of(const Endpoint &endpoint) {
+    return endpoint.type == SelectInput || endpoint.type == RunCommand ||
+                   endpoint.type == SetValue
+               ? Interactive
+           : endpoint.type == RunFunction && endpoint.action == Status
+               ? Telemetry
+               : Read;
+}
+
 constexpr Endpoint endpoints[] = {
 
     {"/volume/main/set", SetValue, MAIN_LEVEL}, // Set the Main Level to the parameter value
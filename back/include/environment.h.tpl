@@ -11,3 +11,34 @@ const Network network_credentials[] = {
 };
 
 const char *OTApassword = "MYPASSSWORDHERE";
+
+// Additional Z906 units, each on its own serial link (device 1, 2, ...).
+// Uncomment to attach a second unit to a software serial port (RX, TX pins).
+// #define Z906_SOFTSERIAL_RX D5
+// #define Z906_SOFTSERIAL_TX D6
+
+// Uncomment to move the hardware UART of the first unit to GPIO13 (RX) and
+// GPIO15 (TX), freeing the USB serial port.
+// #define Z906_UART_SWAP
+
+// Uncomment to raise the rear, center and sub levels at low main levels
+// (loudness compensation), see README.
+// #define Z906_LOUDNESS
+
+// Uncomment to publish the status to an MQTT broker and accept commands on
+// z906/<device>/<field>/set, see README. MQTT_USER/MQTT_PASSWORD are optional.
+// #define MQTT_HOST "192.168.1.10"
+// #define MQTT_PORT 1883
+// #define MQTT_USER "z906"
+// #define MQTT_PASSWORD "secret"
+
+// WiFi fallback: after WIFI_AP_FALLBACK ms without a network (0 disables it),
+// a soft-AP is opened so local clients can still control the amp at
+// http://192.168.4.1. The password is optional, at least 8 characters.
+// #define WIFI_AP_FALLBACK 60000
+// #define WIFI_AP_SSID "LOGITECH-Z906"
+// #define WIFI_AP_PASSWORD "secret_password"
+
+// Offset of the local time of the automation rules from UTC in seconds, e.g.
+// 3600 for CET. Daylight saving time is not applied.
+// #define AUTOMATION_UTC_OFFSET 3600
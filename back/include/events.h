@@ -0,0 +1,49 @@
+#pragma once
+#include <ESPAsyncWebServer.h>
+#include <functional>
+
+#define EVENT_REPLAY_SIZE 4
+#define EVENT_MAX_CLIENTS 4
+#define EVENT_HEARTBEAT 15000
+#define EVENT_RETRY 3000 // ms, clients reconnect after 1 to 2 times this
+
+namespace z906remote {
+
+    /**
+     * Server-Sent Events status stream.
+     *
+     * Published statuses get increasing ids and the last EVENT_REPLAY_SIZE are
+     * kept, so a client reconnecting with Last-Event-ID gets what it missed.
+     * heartbeat() is meant to run every EVENT_HEARTBEAT ms, idle connections
+     * then only receive a comment line. Each client gets its own reconnect
+     * delay, so clients dropped together, e.g. by a WiFi outage, come back
+     * spread out.
+     */
+    class StatusEvents {
+    public:
+        typedef std::function<void(AsyncEventSourceClient *, uint32_t)>
+            SnapshotHandler;
+
+        explicit StatusEvents(const char *url);
+
+        void begin(AsyncWebServer &, SnapshotHandler);
+        void publish(const String &);
+        void heartbeat();
+
+    private:
+        struct Event {
+            uint32_t id = 0;
+            String   data;
+        };
+
+        void on_connect(AsyncEventSourceClient *);
+        void on_disconnect(AsyncEventSourceClient *);
+
+        AsyncEventSource        _source;
+        SnapshotHandler         _snapshot;
+        Event                   _ring[EVENT_REPLAY_SIZE];
+        uint32_t                _last_id = 0;
+        AsyncEventSourceClient *_clients[EVENT_MAX_CLIENTS] = {};
+    };
+
+} // namespace z906remote
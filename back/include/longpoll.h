@@ -0,0 +1,36 @@
+#pragma once
+#include <ESPAsyncWebServer.h>
+#include <functional>
+
+#define LONGPOLL_SLOTS 4
+#define LONGPOLL_MAX_WAIT 30000
+
+namespace z906remote {
+
+    /**
+     * Requests parked until a unit's status generation advances.
+     *
+     * A parked request is answered by wake() when the status changes, or by
+     * expire() once its wait is over. When every slot is taken park() fails
+     * and the request is answered right away, like a plain poll.
+     */
+    class LongPoll {
+    public:
+        typedef std::function<void(AsyncWebServerRequest *)> Responder;
+
+        bool park(AsyncWebServerRequest *, unsigned long wait);
+        void wake(Responder);
+        void expire(Responder);
+
+    private:
+        struct Waiter {
+            AsyncWebServerRequestPtr request;
+            unsigned long            parked_at = 0;
+            unsigned long            wait      = 0;
+            bool                     used      = false;
+        };
+
+        Waiter _waiters[LONGPOLL_SLOTS];
+    };
+
+} // namespace z906remote
@@ -0,0 +1,82 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define LOOP_BUDGET 20 // ms, default stall budget
+#define LOOP_MAX_STAGES 12
+#define LOOP_OFFENDERS 8
+#define LOOP_SOURCE_SIZE 24
+
+namespace z906remote {
+
+    /**
+     * Stall instrumentation of loop() and the async handlers.
+     *
+     * loop() marks each of its stages, the time of every iteration goes to a
+     * histogram and per-stage maxima. An iteration or handler over the budget
+     * is kept with its stage breakdown, free heap and stack among the
+     * LOOP_OFFENDERS slowest seen. The free heap is also sampled after every
+     * iteration and handler, for its low-water mark.
+     */
+    class LoopMonitor {
+    public:
+        /**
+         * Times an async handler for as long as it is in scope.
+         */
+        class Scope {
+        public:
+            Scope(LoopMonitor &monitor, const char *source)
+                : _monitor(monitor), _source(source), _started(micros()) {}
+            ~Scope() { _monitor.record_handler(_source, micros() - _started); }
+
+        private:
+            LoopMonitor &_monitor;
+            const char  *_source;
+            uint32_t     _started;
+        };
+
+        void start();
+        void stage(const char *);
+        void finish();
+        void record_handler(const char *, uint32_t);
+        void set_budget(uint32_t ms) { _budget = ms * 1000; }
+        void reset();
+        void report(JsonDocument &) const;
+        void reset_heap() { _heap_min = ESP.getFreeHeap(); }
+        uint32_t heap_min() const { return _heap_min; }
+
+    private:
+        struct Offender {
+            uint32_t at       = 0; // millis() at the end
+            uint32_t duration = 0; // us
+            char     source[LOOP_SOURCE_SIZE] = {};
+            uint32_t stages[LOOP_MAX_STAGES]  = {}; // us, loop iterations only
+            uint32_t free_heap  = 0;
+            uint32_t free_stack = 0;
+        };
+
+        static constexpr uint8_t HISTOGRAM_SIZE = 11;
+
+        int  stage_index(const char *);
+        void record(const char *, uint32_t, const uint32_t *);
+        void sample_heap();
+
+        uint32_t    _budget = LOOP_BUDGET * 1000; // us
+        uint32_t    _iteration_start = 0;
+        uint32_t    _stage_start     = 0;
+        int         _stage           = -1;
+        uint32_t    _current[LOOP_MAX_STAGES] = {};
+        const char *_stage_names[LOOP_MAX_STAGES] = {};
+        uint32_t    _stage_max[LOOP_MAX_STAGES]   = {};
+        uint64_t    _stage_total[LOOP_MAX_STAGES] = {};
+        uint32_t    _histogram[HISTOGRAM_SIZE]    = {};
+        uint32_t    _iterations    = 0;
+        uint32_t    _stalls        = 0;
+        uint32_t    _max           = 0;
+        uint32_t    _handler_max   = 0;
+        uint32_t    _handler_count = 0;
+        uint32_t    _heap_min      = UINT32_MAX; // bytes
+        Offender    _offenders[LOOP_OFFENDERS];
+    };
+
+} // namespace z906remote
@@ -0,0 +1,90 @@
+#pragma once
+#include "endpoints.h"
+#include <Arduino.h>
+#include <Z906.h>
+#include <functional>
+
+#ifndef MQTT_PREFIX
+#    define MQTT_PREFIX "z906"
+#endif
+#ifndef MQTT_PORT
+#    define MQTT_PORT 1883
+#endif
+#define MQTT_RECONNECT_INTERVAL 5000
+#define MQTT_MAX_DEVICES 4
+#define MQTT_COALESCE_DELAY 250  // ms without change before publishing
+#define MQTT_COALESCE_MAX 1000   // ms after which a burst is published anyway
+#define MQTT_TOPIC_SIZE 64
+
+namespace z906remote {
+
+    // Fields of handle_get_status(), in the same order
+    enum StatusField {
+        MainLevel,
+        CenterLevel,
+        RearLevel,
+        SubLevel,
+        CurrentInput,
+        CurrentFx,
+        Muted,
+        DecodeMode,
+        FxInput1,
+        FxInput2,
+        FxInput3,
+        FxInput4,
+        FxInput5,
+        FxInputAux,
+        SpdifStatus,
+        SignalStatus,
+        Stby,
+        AutoStby,
+        STATUS_FIELD_COUNT
+    };
+
+    void status_fields(Z906 &, uint8_t[STATUS_FIELD_COUNT]);
+
+    /**
+     * Transport independent MQTT mapping of the units.
+     *
+     * Each status field is published retained on <prefix>/<device>/<field>,
+     * only when it changed. Changes are coalesced until the state has been
+     * stable for MQTT_COALESCE_DELAY ms, so a slider drag publishes once.
+     * Messages on <prefix>/<device>/<field>/set are mapped onto endpoints[].
+     */
+    class MqttBridge {
+    public:
+        typedef std::function<bool(const char *, const char *)> PublishHandler;
+        typedef std::function<void(uint8_t, const Endpoint &, long)>
+            CommandHandler;
+
+        MqttBridge(const char *prefix, PublishHandler, CommandHandler);
+
+        void        status_changed(uint8_t, const uint8_t[STATUS_FIELD_COUNT]);
+        void        connected();
+        void        loop();
+        void        message(const char *, const char *, size_t);
+        const char *command_filter() const { return _filter; }
+        const char *availability_topic() const { return _availability; }
+
+    private:
+        struct DeviceState {
+            uint8_t       pending[STATUS_FIELD_COUNT]   = {};
+            uint8_t       published[STATUS_FIELD_COUNT] = {};
+            uint32_t      unpublished  = 0; // bitmask of fields to publish
+            bool          known        = false;
+            bool          dirty        = false;
+            unsigned long first_change = 0;
+            unsigned long last_change  = 0;
+        };
+
+        void flush(uint8_t);
+
+        const char     *_prefix;
+        PublishHandler  _publish;
+        CommandHandler  _command;
+        DeviceState     _devices[MQTT_MAX_DEVICES];
+        char            _filter[MQTT_TOPIC_SIZE];
+        char            _availability[MQTT_TOPIC_SIZE];
+    };
+
+} // namespace z906remote
@@ -0,0 +1,59 @@
+#pragma once
+#include "endpoints.h"
+#include <ESPAsyncWebServer.h>
+
+#define SCHEDULER_QUEUE_SIZE 6
+#define SCHEDULER_MAX_WAIT 2000
+
+namespace z906remote {
+
+    /**
+     * A pending piece of work for a unit's serial link. A job without an
+     * endpoint is a status read-back, see refreshStatus(). A detached job has
+     * no client waiting for the response, e.g. an MQTT command.
+     */
+    struct Job {
+        AsyncWebServerRequestPtr request;
+        const Endpoint          *endpoint  = nullptr;
+        long                     value     = 0;
+        unsigned long            queued_at = 0;
+        bool                     detached  = false;
+    };
+
+    struct SchedulerStats {
+        uint32_t served    = 0;
+        uint32_t rejected  = 0;
+        uint32_t wait_sum  = 0; // ms
+        uint32_t wait_max  = 0; // ms
+        uint8_t  depth_max = 0;
+    };
+
+    /**
+     * Bounded priority queue in front of a unit's serial link.
+     *
+     * Each priority class has its own ring of SCHEDULER_QUEUE_SIZE jobs, a
+     * full class rejects new jobs instead of piling up handlers. Higher
+     * classes are served first, unless a lower class job has been waiting
+     * for more than SCHEDULER_MAX_WAIT ms.
+     */
+    class Scheduler {
+    public:
+        bool     push(Job &&, Priority);
+        bool     pop(Job &);
+        void     record_service(unsigned long);
+        size_t   depth(Priority) const;
+        bool     empty() const;
+        uint32_t retry_after() const;
+
+        const SchedulerStats &stats(Priority) const;
+        uint32_t              service_avg() const { return _service_avg; }
+
+    private:
+        Job            _queue[PRIORITY_COUNT][SCHEDULER_QUEUE_SIZE];
+        size_t         _head[PRIORITY_COUNT]  = {};
+        size_t         _count[PRIORITY_COUNT] = {};
+        SchedulerStats _stats[PRIORITY_COUNT];
+        uint32_t       _service_avg = 0; // ms, moving average
+    };
+
+} // namespace z906remote
@@ -0,0 +1,40 @@
+#pragma once
+#include "device.h"
+#include <Arduino.h>
+#include <ESP8266mDNS.h>
+
+#define ADVERT_SERVICE "z906" // advertised as _z906._tcp
+#define ADVERT_PROTOCOL "tcp"
+#define ADVERT_ANNOUNCE_MIN 1000 // ms between announcements of status changes
+#define ADVERT_VALUE_SIZE 32
+
+namespace z906remote {
+
+    /**
+     * DNS-SD advertisement of the units, so LAN controllers can browse them
+     * and see their coarse state without connecting.
+     *
+     * The TXT record carries the API version (api), the firmware version
+     * (fw), the unit count (n) and per unit a digest d<index> of
+     * "power,input,main level,generation", or "-" while its status is
+     * unknown. The record is built when queried, status changes are also
+     * announced, at most every ADVERT_ANNOUNCE_MIN ms so a slider drag does
+     * not flood the network.
+     */
+    class ServiceAdvert {
+    public:
+        void begin(Device *, uint8_t, uint16_t);
+        void status_changed() { _changed = true; }
+        void loop();
+
+    private:
+        void fill_txt(MDNSResponder::hMDNSService);
+
+        Device                     *_devices      = nullptr;
+        uint8_t                     _count        = 0;
+        MDNSResponder::hMDNSService _service      = nullptr;
+        bool                        _changed      = false;
+        unsigned long               _announced_at = 0;
+    };
+
+} // namespace z906remote
@@ -0,0 +1,52 @@
+#pragma once
+#include "loop_monitor.h"
+#include <Arduino.h>
+
+#define TASK_MAX 12
+#define TASK_WHEEL_SLOTS 32
+#define TASK_TICK 16      // ms per wheel slot
+#define TASK_WAKE_CHECK 5 // ms between checks for queued requests in sleep
+
+namespace z906remote {
+
+    /**
+     * Cooperative scheduler of periodic work in loop().
+     *
+     * Tasks sit in a hashed timing wheel of TASK_WHEEL_SLOTS slots of
+     * TASK_TICK ms, so a tick only looks at the tasks hashed to its slot.
+     * run() executes what is due and returns the time to the next deadline,
+     * which loop() can sleep through.
+     */
+    class Tasks {
+    public:
+        typedef void (*Callback)();
+
+        Tasks();
+
+        int           add(const char *name, Callback, unsigned long interval,
+                          unsigned long first = 0);
+        void          schedule(int, unsigned long);
+        unsigned long run(LoopMonitor &);
+
+    private:
+        struct Task {
+            const char   *name     = nullptr;
+            Callback      callback = nullptr;
+            unsigned long interval = 0;
+            unsigned long due      = 0;
+            int8_t        next     = -1; // in the same slot
+            bool          queued   = false;
+        };
+
+        void          insert(int);
+        void          remove(int);
+        unsigned long next_deadline(unsigned long) const;
+
+        Task          _tasks[TASK_MAX];
+        int8_t        _wheel[TASK_WHEEL_SLOTS];
+        uint8_t       _count   = 0;
+        unsigned long _tick    = 0; // next tick to process
+        bool          _started = false;
+    };
+
+} // namespace z906remote
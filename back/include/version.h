@@ -3,3 +3,4 @@
 #define FIRMWARE_VERSION_MAJOR 2
 #define FIRMWARE_VERSION_MINOR 1
 #define FIRMWARE_VERSION_PATCH 0
+#define API_VERSION 1 // REST/WebSocket API revision, advertised over DNS-SD
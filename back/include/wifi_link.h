@@ -0,0 +1,83 @@
+#pragma once
+#include <Arduino.h>
+
+#ifndef WIFI_AP_FALLBACK
+#    define WIFI_AP_FALLBACK 60000 // ms offline before the soft-AP opens, 0: never
+#endif
+#ifndef WIFI_AP_SSID
+#    define WIFI_AP_SSID "LOGITECH-Z906"
+#endif
+#ifndef WIFI_AP_PASSWORD
+#    define WIFI_AP_PASSWORD "" // open, or at least 8 characters
+#endif
+#define WIFI_MAX_NETWORKS 4
+#define WIFI_TICK 250               // ms between steps of the state machine
+#define WIFI_BOOT_WAIT 15000        // ms setup() waits for a first connection
+#define WIFI_CONNECT_TIMEOUT 10000  // ms per network attempt
+#define WIFI_BACKOFF_MIN 1000       // ms between rounds over the networks
+#define WIFI_BACKOFF_MAX 60000
+#define WIFI_RESUME_SPREAD 5000     // ms over which work resumes on recovery
+#define WIFI_AP_BUSY_WAIT 300000    // ms between rounds while the soft-AP has clients
+#define WIFI_AP_RETRY 30000         // ms before a soft-AP that failed to open is retried
+
+namespace z906remote {
+
+    /**
+     * Station link as a non-blocking state machine, step() runs every
+     * WIFI_TICK ms from a task.
+     *
+     * The networks are tried in turn, WIFI_CONNECT_TIMEOUT ms each. After a
+     * round without success the next one waits a jittered, doubling backoff.
+     * Once offline for longer than the fallback time a soft-AP is opened, so
+     * local clients keep control of the units. It closes when the station is
+     * back and the last client has left it. The soft-AP follows the channel
+     * of the station scans, which drops its clients, so while it has some the
+     * rounds stop after the current attempt and only run every
+     * WIFI_AP_BUSY_WAIT ms.
+     */
+    class WifiLink {
+    public:
+        typedef void (*Callback)();
+
+        enum State : uint8_t { Idle, Connecting, Waiting, Connected };
+
+        bool add_network(const char *ssid, const char *password);
+        void set_fallback(unsigned long ms, const char *ssid,
+                          const char *password);
+        void begin(Callback on_connected);
+        void step();
+
+        bool  connected() const { return _state == Connected; }
+        bool  ap_active() const { return _ap_active; }
+        State state() const { return _state; }
+
+    private:
+        struct Network {
+            const char *ssid     = nullptr;
+            const char *password = nullptr;
+        };
+
+        void attempt(uint8_t);
+        void next_network();
+        void open_ap();
+        void close_ap();
+        bool ap_in_use() const;
+
+        Network       _networks[WIFI_MAX_NETWORKS];
+        uint8_t       _count        = 0;
+        uint8_t       _network      = 0;
+        State         _state        = Idle;
+        Callback      _on_connected = nullptr;
+        unsigned long _since        = 0; // start of the attempt or the wait
+        unsigned long _wait         = 0;
+        unsigned long _backoff      = WIFI_BACKOFF_MIN;
+        unsigned long _offline_at   = 0;
+        unsigned long _ap_fallback  = WIFI_AP_FALLBACK;
+        const char   *_ap_ssid      = WIFI_AP_SSID;
+        const char   *_ap_password  = WIFI_AP_PASSWORD;
+        bool          _ap_active    = false;
+        bool          _ap_failed    = false;
+        unsigned long _ap_tried     = 0;
+    };
+
+} // namespace z906remote
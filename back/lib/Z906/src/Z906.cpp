@@ -1,11 +1,4 @@
 #include "Z906.h"
-#include <HardwareSerial.h>
-
-// Constructor for Z906 class.
-Z906::Z906(HardwareSerial &serial) {
-    _dev_serial = &serial;
-    _dev_serial->begin(BAUD_RATE, SERIAL_CONFIG);
-}
 
 /**
  * Calculate the Longitudinal Redundancy Check (LRC) for {-1,-1}.
@@ -14,38 +7,12 @@ Z906::Z906(HardwareSerial &serial) {
  * @param length Length of the data array.
  * @return Calculated LRC value.
  */
-uint8_t Z906::LRC(const uint8_t *pData, size_t length) {
+uint8_t Z906::LRC(const uint8_t *pData, size_t length) const {
     uint8_t lrc = 0;
     for (size_t i = 1; i < length - 1; i++) lrc -= pData[i];
     return lrc;
 }
 
-/**
- * Turn the Z906 unit on.
- *
- * This function sends the command to turn on the Z906 unit.
- */
-void Z906::on() { write(PWM_ON); }
-
-/**
- * Turn the Z906 unit off and reset power-up time.
- *
- * This function sends the command to turn off the Z906 unit, resets the
- * power-up time, and discards the acknowledgment (ACK) message for a clean
- * serial buffer.
- */
-void Z906::off() {
-    // Send the command to turn off the Z906 unit
-    write(PWM_OFF);
-
-    // Reset the power-up time and save changes to EEPROM
-    uint8_t cmd[] = {RESET_PWR_UP_TIME, 0x37, EEPROM_SAVE};
-    write(cmd, sizeof(cmd));
-
-    // Discard the acknowledgment (ACK) message for a clean serial buffer
-    flush();
-}
-
 /**
  * Get the muted state
  */
@@ -63,356 +30,420 @@ int Z906::current_effect() const {
     return _status.buffer[INPUT_FX[_status.buffer[STATUS_CURRENT_INPUT]]];
 }
 
-
 Z906::t_packetdata Z906::get_data() const { return _status.data; }
 
 /**
- * Change the input on the Z906 unit specifying an effect.
- *
- * This function changes the input on the Z906 unit and specifies an effect if
- * provided. If no effect is selected, it uses the default effect (same as
- * console default).
+ * Store a status frame read from the unit as the status cache, if it is valid.
  *
- * @param input The input to be set on the Z906 unit.
- * @param effect The effect to be applied to the input.
+ * @param status The frame received.
+ * @param statusLen Size of the full frame, incl. control words and checksum.
+ * @param now millis() of the reception.
+ * @return true if the frame was valid and stored.
  */
-void Z906::input(uint8_t input, uint8_t effect) {
-    // If no effect is selected, use the default (same as console default)
-    if (effect == 0xFF) {
-        if (input == SELECT_INPUT_2 || input == SELECT_INPUT_AUX) {
-            effect = SELECT_EFFECT_3D;
-        } else {
-            effect = SELECT_EFFECT_NO;
-        }
+bool Z906::store_status(const t_packet &status, size_t statusLen, uint32_t now) {
+    // Validate the received status data
+    if (status.buffer[STATUS_STX] != EXP_STX || status.buffer[STATUS_MODEL] != EXP_MODEL_STATUS ||
+        status.buffer[statusLen - 1] != LRC(status.buffer, statusLen)) {
+        return false;
     }
 
-    // Send the command to change the input with specified effect
-    uint8_t cmd[] = {MUTE_ON, input, effect, MUTE_OFF};
-    write(cmd, sizeof(cmd));
+    // Update successful, refresh the cache
+    _status         = status;
+    _status_len     = statusLen;
+    STATUS_CHECKSUM = static_cast<uint8_t>(_status_len - 1);
+    _status_valid   = true;
+    _status_time    = now;
 
-    // Discard the acknowledgment (ACK) message for a clean serial buffer
-    flush();
+    if (_loudness) {
+        sync_trims();
+    }
+    return true;
 }
 
 /**
- * Flush the serial communication buffers.
+ * Decode a value of the status cache for request().
  *
- * This function introduces a deadtime delay to avoid UART TX collisions and
- * clears the RX buffer.
+ * @param cmd The command indicating the type of data requested.
+ * @return The requested data.
  */
-void Z906::flush() {
-    // Introduce a deadtime delay to avoid UART TX collisions
-    delay(SERIAL_DEADTIME);
-
-    // Clear the RX buffer by reading any available data
-    while (_dev_serial->available() > 0) {
-        _dev_serial->read();
+int Z906::status_value(uint8_t cmd) const {
+    switch (cmd) {
+    case VERSION:
+        // Combine version bytes to form a single integer
+        return _status.buffer[STATUS_VER_C] + 10 * _status.buffer[STATUS_VER_B] +
+               100 * _status.buffer[STATUS_VER_A];
+    case GET_STATUS:
+        return !_status.buffer[STATUS_STBY];
+    case CURRENT_INPUT:
+        // Increment the current input value by 1
+        return _status.buffer[STATUS_CURRENT_INPUT];
+    case MAIN_LEVEL:
+    case REAR_LEVEL:
+    case CENTER_LEVEL:
+    case SUB_LEVEL:
+        // The value last set while the level holds, so it reads back as set
+        if (volume_level(_values[cmd - MAIN_LEVEL]) == level(cmd)) {
+            return _values[cmd - MAIN_LEVEL];
+        }
+        // Normalize volume data to the range 0...255
+        return volume_value(level(cmd));
+    default:
+        // Return the requested data based on the command
+        return _status.buffer[cmd];
     }
 }
 
 /**
- * Write a single-byte command to the Z906 TX port.
- *
- * This function writes a specified single-byte command to the Z906 TX port,
- * flushing the TX buffer afterward.
+ * Set a parameter in the status cache, to be written back to the unit.
  *
- * @param cmd The single-byte command to be written.
+ * @param cmdA The parameter to be updated (e.g., MAIN_LEVEL, REAR_LEVEL, etc.).
+ * @param cmdB The value to be set, 0...255 for the levels.
  */
-void Z906::write(uint8_t cmd) {
-    // Flush the communication buffers to ensure a clean start
-    flush();
+void Z906::set_value(uint8_t cmdA, uint8_t cmdB) {
+    if (cmdA == MAIN_LEVEL || cmdA == REAR_LEVEL || cmdA == CENTER_LEVEL || cmdA == SUB_LEVEL) {
+        // Normalize volume to the range 0...MAX_VOL
+        const uint8_t value = volume_level(cmdB);
+        _values[cmdA - MAIN_LEVEL] = cmdB;
 
-    // Write the specified single-byte command to the Z906 TX port
-    _dev_serial->write(cmd);
+        if (!_loudness) {
+            _status.buffer[cmdA] = value;
+        } else {
+            // The trims are compensated in the same frame as the main level
+            if (!_trims_known) {
+                sync_trims();
+            }
+            if (cmdA == MAIN_LEVEL) {
+                _status.buffer[cmdA] = value;
+            } else {
+                _trim[cmdA - REAR_LEVEL] = value;
+            }
+            compensate();
+        }
+    } else {
+        // Update the specified parameter in the internal status buffer
+        _status.buffer[cmdA] = cmdB;
+    }
 
-    // Flush the TX buffer to ensure the command is sent to the device
-    _dev_serial->flush();
+    // Update the checksum in the status buffer
+    _status.buffer[STATUS_CHECKSUM] = LRC(_status.buffer, _status_len);
 }
 
 /**
- * Write a command (byte array) to the Z906 TX port.
+ * Build the command sequence changing the input, muted while switching.
  *
- * This function writes a command represented by a byte array to the Z906 TX
- * port, flushing the TX buffer afterward.
+ * If no effect is selected, it uses the default effect (same as console
+ * default).
  *
- * @param pCmd A pointer to the byte array representing the command.
- * @param cmdLen The length of the command byte array.
+ * @param input The input to be set on the Z906 unit.
+ * @param effect The effect to be applied to the input, 0xFF for the default.
+ * @param cmd The four command bytes.
  */
-void Z906::write(uint8_t *pCmd, size_t cmdLen) {
-    // Flush the communication buffers to ensure a clean start
-    flush();
-
-    // Write each byte of the command byte array to the Z906 TX port
-    for (size_t i = 0; i < cmdLen; i++) {
-        _dev_serial->write(pCmd[i]);
+void Z906::input_command(uint8_t input, uint8_t effect, uint8_t cmd[4]) const {
+    // If no effect is selected, use the default (same as console default)
+    if (effect == 0xFF) {
+        if (input == SELECT_INPUT_2 || input == SELECT_INPUT_AUX) {
+            effect = SELECT_EFFECT_3D;
+        } else {
+            effect = SELECT_EFFECT_NO;
+        }
     }
 
-    // Flush the TX buffer to ensure the command is sent to the device
-    _dev_serial->flush();
+    cmd[0] = MUTE_ON;
+    cmd[1] = input;
+    cmd[2] = effect;
+    cmd[3] = MUTE_OFF;
 }
 
 /**
- * Update the status of the Z906 device.
- * This function sends a command to retrieve the current status of the Z906,
- * reads the response from the serial interface, and validates the received
- * data.
+ * Model the effect of a single-byte command on the status cache, so it
+ * reflects the unit state without reading it back.
  *
- * @return 1 if the update is successful, 0 otherwise.
+ * @param cmd The single-byte command sent to the Z906 unit.
  */
-int Z906::update() {
-    // Send command to request device status
-    write(GET_STATUS);
-
-    // Record the current time for timeout monitoring
-    const uint32_t currentMillis = millis();
-
-    // Wait until the expected status data is available in the serial buffer
-    while (_dev_serial->available() < STATUS_LENGTH + 1) {
-        // Check for timeout
-        if (millis() - currentMillis > SERIAL_TIME_OUT) {
-            return 0;
-        }
+void Z906::apply(uint8_t cmd) {
+    const uint8_t input = _status.buffer[STATUS_CURRENT_INPUT] % 6;
+    uint8_t      *fx    = &_status.buffer[INPUT_FX[input]];
+
+    switch (cmd) {
+    case SELECT_INPUT_1:
+        _status.buffer[STATUS_CURRENT_INPUT] = 0;
+        break;
+    case SELECT_INPUT_2:
+        _status.buffer[STATUS_CURRENT_INPUT] = 1;
+        break;
+    case SELECT_INPUT_3:
+        _status.buffer[STATUS_CURRENT_INPUT] = 2;
+        break;
+    case SELECT_INPUT_4:
+        _status.buffer[STATUS_CURRENT_INPUT] = 3;
+        break;
+    case SELECT_INPUT_5:
+        _status.buffer[STATUS_CURRENT_INPUT] = 4;
+        break;
+    case SELECT_INPUT_AUX:
+        _status.buffer[STATUS_CURRENT_INPUT] = 5;
+        break;
+    case LEVEL_MAIN_UP:
+        step(STATUS_MAIN_LEVEL, 1);
+        break;
+    case LEVEL_MAIN_DOWN:
+        step(STATUS_MAIN_LEVEL, -1);
+        break;
+    case LEVEL_SUB_UP:
+        step(STATUS_SUB_LEVEL, 1);
+        break;
+    case LEVEL_SUB_DOWN:
+        step(STATUS_SUB_LEVEL, -1);
+        break;
+    case LEVEL_CENTER_UP:
+        step(STATUS_CENTER_LEVEL, 1);
+        break;
+    case LEVEL_CENTER_DOWN:
+        step(STATUS_CENTER_LEVEL, -1);
+        break;
+    case LEVEL_REAR_UP:
+        step(STATUS_REAR_LEVEL, 1);
+        break;
+    case LEVEL_REAR_DOWN:
+        step(STATUS_REAR_LEVEL, -1);
+        break;
+    case PWM_OFF:
+        _status.buffer[STATUS_STBY] = 1;
+        break;
+    case PWM_ON:
+        _status.buffer[STATUS_STBY] = 0;
+        break;
+    case SELECT_EFFECT_3D:
+        *fx = EFFECT_3D;
+        break;
+    case SELECT_EFFECT_21:
+        *fx = EFFECT_21;
+        break;
+    case SELECT_EFFECT_41:
+        *fx = EFFECT_41;
+        break;
+    case SELECT_EFFECT_NO:
+        *fx = EFFECT_NO;
+        break;
+    case SELECT_EFFECT_51:
+        _decode_mode = true;
+        return;
+    case DISABLE_EFFECT_51:
+        _decode_mode = false;
+        return;
+    case MUTE_ON:
+    case MUTE_OFF:
+        _muted_state                 = cmd == MUTE_ON;
+        _status.buffer[STATUS_MUTED] = _muted_state;
+        break;
+    default:
+        return;
     }
 
-    // Read the status data into the buffer
-    for (int i = 0; i <= STATUS_LENGTH; i++) {
-        _status.buffer[i] = _dev_serial->read();
-    }
-
-    // Extract payload size and calculate the total buffer size
-    const size_t payloadLen = _status.buffer[STATUS_LENGTH]; // Size of the payload
-    _status_len = payloadLen + 4; // Size of full status buffer in RAM
-
-    // Wait until the full payload is available in the serial buffer
-    while (static_cast<size_t>(_dev_serial->available()) < payloadLen + 1U) {
-        // Check for timeout
-        if (millis() - currentMillis > SERIAL_TIME_OUT) {
-            return 0;
-        }
+    // Keep the cached packet consistent
+    if (_status_len) {
+        _status.buffer[STATUS_CHECKSUM] = LRC(_status.buffer, _status_len);
     }
+}
 
-    // Read payload and checksum into the status buffer
-    for (size_t i = 0; i <= payloadLen; i++) {
-        _status.buffer[i + STATUS_LENGTH + 1] = _dev_serial->read();
+/**
+ * Step a level of the status cache by one unit, within 0...MAX_VOL.
+ */
+void Z906::step(uint8_t level, int delta) {
+    const int value = _status.buffer[level] + delta;
+    if (value >= 0 && value <= MAX_VOL) {
+        _status.buffer[level] = static_cast<uint8_t>(value);
     }
-    STATUS_CHECKSUM = _status_len - 1;
 
-    // Validate the received status data
-    if (_status.buffer[STATUS_STX] != EXP_STX || _status.buffer[STATUS_MODEL] != EXP_MODEL_STATUS ||
-        _status.buffer[STATUS_CHECKSUM] != LRC(_status.buffer, _status_len)) {
-        return 0;
+    // The unit steps the compensated level, move the trim along with it
+    if (_loudness && _trims_known && level != STATUS_MAIN_LEVEL) {
+        uint8_t  &trim    = _trim[level - STATUS_REAR_LEVEL];
+        const int stepped = trim + delta;
+        if (stepped >= 0 && stepped <= MAX_VOL) {
+            trim = static_cast<uint8_t>(stepped);
+        }
     }
-
-    // Update successful
-    return 1;
 }
 
 /**
- * Request data from the Z906 unit based on the specified command.
- *
- * This function updates the internal status buffer by querying the device,
- * and then returns specific data based on the provided command.
+ * Get a level in hundredths of a dB, see VOLUME_CALIBRATION.
  *
- * @param cmd The command indicating the type of data to request from the Z906
- * unit.
- * @return The requested data, or 0 if the update operation fails or the command
- * is invalid.
+ * @param channel MAIN_LEVEL, REAR_LEVEL, CENTER_LEVEL or SUB_LEVEL.
+ * @return The level of the status cache, VOLUME_DB_MUTE at level 0.
  */
-int Z906::request(const uint8_t cmd) {
-    if (update()) {
-        // Return specific data based on the provided command
-        switch (cmd) {
-        case VERSION:
-            // Combine version bytes to form a single integer
-            return _status.buffer[STATUS_VER_C] + 10 * _status.buffer[STATUS_VER_B] +
-                   100 * _status.buffer[STATUS_VER_A];
-        case GET_STATUS:
-            return !_status.buffer[STATUS_STBY];
-        case CURRENT_INPUT:
-            // Increment the current input value by 1
-            return _status.buffer[STATUS_CURRENT_INPUT];
-        case MAIN_LEVEL:
-        case REAR_LEVEL:
-        case CENTER_LEVEL:
-        case SUB_LEVEL:
-            // Normalize volume data to the range 0...255
-            return static_cast<uint8_t>(
-                (static_cast<uint16_t>(_status.buffer[cmd]) * 255) / MAX_VOL);
-        default:
-            // Return the requested data based on the command
-            return _status.buffer[cmd];
-        }
-    }
+int16_t Z906::level_db(uint8_t channel) const { return volume_centi_db(level(channel)); }
 
-    // Return 0 if the update operation fails
-    return 0;
+/**
+ * Set a level in hundredths of a dB, rounded to the closest level.
+ *
+ * @param channel MAIN_LEVEL, REAR_LEVEL, CENTER_LEVEL or SUB_LEVEL.
+ * @param centi_db The level, VOLUME_DB_MUTE or anything below level 1 mutes.
+ * @return The value set, or Z906_ERROR, see cmd(cmdA, cmdB).
+ */
+int Z906::set_level_db(uint8_t channel, int16_t centi_db) {
+    return cmd(channel, volume_value(volume_level_for_db(centi_db)));
 }
 
 /**
- * Send a command to the Z906 device and return the response.
- *
- * This function sends a specified command to the Z906 device, waits for the
- * response, and returns the received data.
+ * Enable or disable loudness compensation.
  *
- * @param cmd The command to be sent to the Z906 device.
- * @return The response received from the Z906 device, or 0 if the operation
- * times out.
+ * While enabled the rear, center and sub levels are trims: the unit gets them
+ * raised by loudness_offset() at the main level, in the frame written by each
+ * cmd(cmdA, cmdB). Reading them returns the trims. The level steps sent as
+ * single commands leave the offsets as they are until the next such frame.
+ * Disabling restores the trims, also with the next frame written.
  */
-int Z906::cmd(const uint8_t cmd) {
-    // Send the specified command to the device
-    write(cmd);
-
-    // Update muted state
-    if (cmd == MUTE_ON || MUTE_OFF) {
-        _muted_state = (cmd - MUTE_ON) == 0;
-    }
-
-    if (cmd == SELECT_EFFECT_51 || DISABLE_EFFECT_51) {
-        _decode_mode = (cmd - SELECT_EFFECT_51) == 0;
+void Z906::set_loudness(bool enabled) {
+    if (enabled == _loudness) {
+        return;
     }
 
-    // Record the current time for timeout monitoring
-    const uint32_t currentMillis = millis();
-
-    // Wait until response data is available in the serial buffer
-    while (_dev_serial->available() == 0) {
-        // Check for timeout
-        if (millis() - currentMillis > SERIAL_TIME_OUT) {
-            return 0;
+    if (!enabled && _trims_known) {
+        for (uint8_t c = 0; c < LOUDNESS_CHANNELS; c++) {
+            _status.buffer[STATUS_REAR_LEVEL + c] = _trim[c];
+        }
+        if (_status_len) {
+            _status.buffer[STATUS_CHECKSUM] = LRC(_status.buffer, _status_len);
         }
     }
 
-    // Return the received response
-    return _dev_serial->read();
+    _loudness    = enabled;
+    _trims_known = false;
+    if (_loudness && _status_len) {
+        sync_trims();
+    }
 }
 
+bool Z906::loudness() const { return _loudness; }
+
 /**
- * Send a command to update a specific parameter on the Z906 device.
- *
- * This function updates a specified parameter on the Z906 device with the
- * provided value, normalizes the volume if necessary, and sends the updated
- * status to the device. Additionally, it discards the acknowledgment (ACK)
- * message to maintain a clean serial buffer.
- *
- * @param cmd_a The command representing the parameter to be updated (e.g.,
- * MAIN_LEVEL, REAR_LEVEL, etc.).
- * @param cmd_b The value to be set for the specified parameter.
+ * Level 0...MAX_VOL of a channel, the trim in loudness mode.
  */
-void Z906::cmd(const uint8_t cmdA, uint8_t cmdB) {
-    // Update the internal status buffer with the current device status
-    update();
-
-    // Normalize volume to the range 0...255 if applicable
-    if (cmdA == MAIN_LEVEL || cmdA == REAR_LEVEL || cmdA == CENTER_LEVEL || cmdA == SUB_LEVEL) {
-        cmdB = static_cast<uint8_t>((static_cast<uint16_t>(cmdB) * MAX_VOL) / 255);
+uint8_t Z906::level(uint8_t channel) const {
+    if (_loudness && _trims_known && channel >= REAR_LEVEL && channel <= SUB_LEVEL) {
+        return _trim[channel - REAR_LEVEL];
     }
+    return _status.buffer[channel];
+}
 
-    // Update the specified parameter in the internal status buffer
-    _status.buffer[cmdA] = cmdB;
-
-    // Update the checksum in the status buffer
-    _status.buffer[STATUS_CHECKSUM] = LRC(_status.buffer, _status_len);
-
-    // Send the updated status buffer to the Z906 device
-    write(_status.buffer, _status_len);
-
-    // Discard the acknowledgment (ACK) message to maintain a clean serial buffer
-    flush();
+/**
+ * Level of a loudness channel in the unit, for a trim and a main level.
+ */
+uint8_t Z906::compensated(uint8_t channel, uint8_t main) const {
+    const int value = _trim[channel] + loudness_offset(static_cast<LoudnessChannel>(channel), main);
+    return static_cast<uint8_t>(value < 0 ? 0 : value > MAX_VOL ? MAX_VOL : value);
 }
 
 /**
- * Print the current status of the Z906 device to the serial monitor.
- *
- * This function updates the internal status buffer by querying the device,
- * and then prints each byte of the status buffer in hexadecimal format to the
- * serial monitor.
+ * Raise the rear, center and sub levels of the status cache for its main level.
  */
-void Z906::print_status() {
-    // Update the internal status buffer with the current device status
-    update();
-
-    // Print each byte of the status buffer in hexadecimal format
-    for (size_t i = 0; i < _status_len; i++) {
-        Serial.print(_status.buffer[i], HEX);
-        Serial.print(" ");
+void Z906::compensate() {
+    _trim_main = _status.buffer[STATUS_MAIN_LEVEL];
+    for (uint8_t c = 0; c < LOUDNESS_CHANNELS; c++) {
+        _status.buffer[STATUS_REAR_LEVEL + c] = compensated(c, _trim_main);
     }
-
-    Serial.print("\n");
 }
 
 /**
- * Retrieve the temperature reading from the main sensor of the Z906 device.
- *
- * This function sends a command to request the temperature reading from the
- * main sensor, waits for the response, and returns the temperature value if the
- * operation is successful.
+ * Derive the trims from the levels of the status cache.
  *
- * @return The temperature reading from the main sensor, or 0 if the operation
- * times out or the response is invalid.
+ * A level is taken as the trim plus the offset for the main level it was
+ * compensated for, so neither a restart nor a read-back compensates twice. A
+ * level that differs from what was written was changed on the console, its
+ * trim follows.
  */
-uint8_t Z906::main_sensor() {
-    // Send command to request temperature from the main sensor
-    write(GET_TEMP);
-
-    // Record the current time for timeout monitoring
-    const uint32_t currentMillis = millis();
-
-    // Wait until the full temperature response is available in the serial buffer
-    while (_dev_serial->available() < TEMP_TOTAL_LENGTH) {
-        // Check for timeout
-        if (millis() - currentMillis > SERIAL_TIME_OUT)
-            return 0;
+void Z906::sync_trims() {
+    if (!_trims_known) {
+        _trim_main = _status.buffer[STATUS_MAIN_LEVEL];
     }
 
-    // Read the temperature response into a temporary buffer
-    uint8_t temp[TEMP_TOTAL_LENGTH];
-    for (auto &x : temp) {
-        x = _dev_serial->read();
+    for (uint8_t c = 0; c < LOUDNESS_CHANNELS; c++) {
+        const uint8_t applied = _status.buffer[STATUS_REAR_LEVEL + c];
+        if (_trims_known && applied == compensated(c, _trim_main)) {
+            continue;
+        }
+
+        const int trim = applied - loudness_offset(static_cast<LoudnessChannel>(c), _trim_main);
+        _trim[c]       = static_cast<uint8_t>(trim < 0 ? 0 : trim);
     }
+    _trims_known = true;
+}
 
-    // Validate the temperature response
-    if (temp[2] != EXP_MODEL_TEMP)
-        return 0;
+// Upper bounds of the round trip buckets in ms, the last bucket is open
+static const uint16_t RTT_BOUNDS[] = {1,  2,  3,  4,   6,   8,   12,  16,  24, 32,
+                                      48, 64, 96, 128, 192, 256, 384, 512, 768};
 
-    // Return the temperature reading from the main sensor
-    return temp[7];
+/**
+ * Account the round trip of a reply, from the end of the request to the last
+ * byte received.
+ *
+ * @param reply The type of the reply.
+ * @param ms The round trip.
+ */
+void Z906::record_rtt(Reply reply, uint32_t ms) {
+    static_assert(sizeof(RTT_BOUNDS) / sizeof(RTT_BOUNDS[0]) == RTT_BUCKETS - 1,
+                  "one bound per bucket but the last");
+    RttHistogram &rtt    = _rtt[reply];
+    uint8_t       bucket = 0;
+
+    while (bucket < RTT_BUCKETS - 1 && ms > RTT_BOUNDS[bucket]) bucket++;
+
+    // Halve the counts once the window is full, so the timeouts follow drifts
+    if (rtt.total >= SERIAL_RTT_WINDOW) {
+        rtt.total = 0;
+        for (uint16_t &count : rtt.counts) {
+            count     /= 2;
+            rtt.total += count;
+        }
+    }
+    rtt.counts[bucket]++;
+    rtt.total++;
 }
 
 /**
- * Retrieve the current volume of the active input.
+ * Get the 99th percentile of the round trips of a reply type, rounded up to
+ * its bucket.
  *
- * This function sends a command to request the current volume of the active
- * input, waits for the response and returns the volume value if the operation
- * is successful.
- *
- * @return The volume reading of the current input, 0 if input is silent or if
- * the operation times out or the response is invalid.
+ * @return The round trip in ms, 0 before the first reply.
  */
-uint32_t Z906::input_volume() {
-    // Send command to request current volume
-    write(GET_INPUT_GAIN);
-
-    // Record the current time for timeout monitoring
-    const uint32_t currentMillis = millis();
-
-    // Wait until the full volume response is available in the serial buffer
-    while (_dev_serial->available() < GAIN_TOTAL_LENGTH) {
-        // Check for timeout
-        if (millis() - currentMillis > SERIAL_TIME_OUT)
-            return 0;
-    }
+uint32_t Z906::rtt_p99(Reply reply) const {
+    const RttHistogram &rtt  = _rtt[reply];
+    const uint32_t      rank = rtt.total - rtt.total / 100; // ceil(0.99 total)
+    uint32_t            seen = 0;
 
-    // Read the volume response into a temporary buffer
-    uint8_t temp[GAIN_TOTAL_LENGTH];
-    for (auto &x : temp) {
-        x = _dev_serial->read();
+    if (!rtt.total)
+        return 0;
+    for (uint8_t bucket = 0; bucket < RTT_BUCKETS - 1; bucket++) {
+        seen += rtt.counts[bucket];
+        if (seen >= rank)
+            return RTT_BOUNDS[bucket];
     }
+    return SERIAL_TIME_OUT;
+}
 
-    // Validate the volume response
-    if (temp[2] != EXP_MODEL_GAIN)
-        return 0;
+/**
+ * Get the time to wait for a reply: the p99 round trip times
+ * SERIAL_TIME_OUT_FACTOR within SERIAL_TIME_OUT_MIN...SERIAL_TIME_OUT, or the
+ * ceiling until SERIAL_RTT_WARMUP replies were timed.
+ *
+ * @return The timeout in ms.
+ */
+uint32_t Z906::timeout(Reply reply) const {
+    if (_rtt[reply].total < SERIAL_RTT_WARMUP)
+        return SERIAL_TIME_OUT;
+
+    const uint32_t limit = rtt_p99(reply) * SERIAL_TIME_OUT_FACTOR;
+    return limit < SERIAL_TIME_OUT_MIN ? SERIAL_TIME_OUT_MIN
+           : limit > SERIAL_TIME_OUT   ? SERIAL_TIME_OUT
+                                       : limit;
+}
 
-    // Return the volume reading from the main sensor
-    return ((uint32_t)temp[4] << 16) | ((uint32_t)temp[5] << 8) | ((uint32_t)temp[6]);
-    ;
+/**
+ * Get a pseudo-random delay below range (xorshift), to spread the retries.
+ */
+uint32_t Z906::jitter(uint32_t range) {
+    _jitter_state ^= _jitter_state << 13;
+    _jitter_state ^= _jitter_state >> 17;
+    _jitter_state ^= _jitter_state << 5;
+    return range ? _jitter_state % range : 0;
 }
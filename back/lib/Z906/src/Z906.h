@@ -1,13 +1,28 @@
 #pragma once
 
-#include "Arduino.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Z906Volume.h"
 
 // Serial Settings
 #define BAUD_RATE 57600
 #define SERIAL_CONFIG SERIAL_8O1
-#define SERIAL_TIME_OUT 1000
+#define SERIAL_TIME_OUT 1000      // ms, ceiling of the reply timeouts
+#define SERIAL_TIME_OUT_MIN 20    // ms, floor of the reply timeouts
+#define SERIAL_TIME_OUT_FACTOR 3  // reply timeout: p99 round trip times this
+#define SERIAL_RTT_WARMUP 16      // replies timed before the p99 is used
+#define SERIAL_RTT_WINDOW 256     // replies kept, the counts halve beyond
+#define SERIAL_READ_RETRIES 2     // extra attempts of a failed read
+#define SERIAL_RETRY_DELAY 10     // ms before a retry, plus as much jitter
 #define SERIAL_DEADTIME 5
 
+// Result of a failed exchange, distinct from any value read
+#define Z906_ERROR (-1)
+
+// Age below which the status cache is trusted without reading it back (ms)
+#define STATUS_CACHE_TTL 1000
+
 #define STATUS_BUFFER_SIZE 0x20
 #define ACK_TOTAL_LENGTH 0x05
 #define TEMP_TOTAL_LENGTH 0x0A
@@ -79,9 +94,20 @@
 #define SPK_CENTER 0x04
 #define SPK_SUB 0x20
 
+/**
+ * Z906 protocol state and API, independent of the serial link.
+ *
+ * Holds the status cache and the encoding and decoding of the frames. The I/O
+ * is done by Z906Core, bound at compile time to a transport and a clock, see
+ * Z906Core.h. Code driving units on different links holds them as Z906, the
+ * calls are dispatched once per operation, never per byte.
+ */
 class Z906 {
 
 public:
+    // Replies timed separately, their round trips differ with their length
+    enum Reply : uint8_t { REPLY_STATUS, REPLY_ACK, REPLY_TEMP, REPLY_GAIN, REPLY_TYPES };
+
     typedef struct s_packetdata {
         uint8_t stx;
         uint8_t model;
@@ -108,25 +134,33 @@ public:
         uint8_t pad[10];
     } t_packetdata;
 
-    Z906(HardwareSerial &serial);
+    virtual ~Z906() = default;
+
+    virtual int cmd(const uint8_t)          = 0;
+    virtual int cmd(const uint8_t, uint8_t) = 0;
+    virtual int request(const uint8_t)      = 0;
+    virtual int update()                    = 0;
 
-    int  cmd(const uint8_t);
-    void cmd(const uint8_t, uint8_t);
-    int  request(const uint8_t);
-    void print_status();
+    virtual int     main_sensor()  = 0;
+    virtual int32_t input_volume() = 0;
 
-    uint8_t  main_sensor();
-    uint32_t input_volume();
+    virtual void     on()                           = 0;
+    virtual void     off()                          = 0;
+    virtual void     input(uint8_t, uint8_t = 0xFF) = 0;
+    virtual uint32_t status_age() const             = 0;
 
-    void         on();
-    void         off();
-    void         input(uint8_t, uint8_t = 0xFF);
     bool         muted_state() const;
     bool         decode_mode() const;
     int          current_effect() const;
     t_packetdata get_data() const;
-
-private:
+    uint32_t     rtt_p99(Reply) const;
+    uint32_t     timeout(Reply) const;
+    int16_t      level_db(uint8_t) const;
+    int          set_level_db(uint8_t, int16_t);
+    void         set_loudness(bool);
+    bool         loudness() const;
+
+protected:
     typedef union u_packet {
         t_packetdata data;
         uint8_t      buffer[STATUS_BUFFER_SIZE];
@@ -161,22 +195,52 @@ private:
     const uint8_t STATUS_AUTO_STBY     = 0x15;
     uint8_t STATUS_CHECKSUM = 0; // Will be dynamically derived in update()
 
-    const uint8_t MAX_VOL = 43; // Maximum volume can only be 43
+    const uint8_t MAX_VOL = VOLUME_MAX_LEVEL; // Maximum volume can only be 43
 
     const uint8_t INPUT_FX[6] = {STATUS_FX_INPUT_1, STATUS_FX_INPUT_2,
                                  STATUS_FX_INPUT_3, STATUS_FX_INPUT_4,
                                  STATUS_FX_INPUT_5, STATUS_FX_INPUT_AUX};
 
-    void    write(uint8_t);
-    void    write(uint8_t *, size_t);
-    void    flush();
-    int     update();
-    uint8_t LRC(const uint8_t *, size_t);
+    void     apply(uint8_t);
+    void     step(uint8_t, int);
+    bool     store_status(const t_packet &, size_t, uint32_t);
+    int      status_value(uint8_t) const;
+    void     set_value(uint8_t, uint8_t);
+    void     input_command(uint8_t, uint8_t, uint8_t[4]) const;
+    uint8_t  LRC(const uint8_t *, size_t) const;
+    void     record_rtt(Reply, uint32_t);
+    uint32_t jitter(uint32_t);
+    uint8_t  level(uint8_t) const;
+    uint8_t  compensated(uint8_t, uint8_t) const;
+    void     compensate();
+    void     sync_trims();
 
-    HardwareSerial *_dev_serial;
     bool            _muted_state = false;
     bool            _decode_mode = true;
-    t_packet        _status;
+    t_packet        _status = {};
     size_t _status_len = 0; // Size of the full message in the status buffer
                             // (incl. control words and checksum)
+    bool     _status_valid = false; // Last update() succeeded
+    uint32_t _status_time  = 0;     // millis() of the last successful update()
+
+    static constexpr uint8_t RTT_BUCKETS = 20;
+
+    // Round trips of the replies received, in buckets of RTT_BOUNDS
+    struct RttHistogram {
+        uint16_t counts[RTT_BUCKETS];
+        uint16_t total;
+    };
+
+    RttHistogram _rtt[REPLY_TYPES] = {};
+    uint32_t     _jitter_state    = 0x2545F491;
+
+    // 0...255 values last set for MAIN_LEVEL...SUB_LEVEL
+    uint8_t _values[SUB_LEVEL - MAIN_LEVEL + 1] = {};
+
+    // Loudness mode: the rear, center and sub levels set by the user, and the
+    // main level the levels in the unit were compensated for
+    bool    _loudness                = false;
+    bool    _trims_known             = false;
+    uint8_t _trim[LOUDNESS_CHANNELS] = {};
+    uint8_t _trim_main               = 0;
 };
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Z906Core.h"
+
+/**
+ * Clock of the Arduino core.
+ */
+struct ArduinoClock {
+    static uint32_t millis() { return ::millis(); }
+    static void     delay(uint32_t ms) { ::delay(ms); }
+};
+
+/**
+ * Z906 on a serial link of the Arduino core, e.g. Z906Serial<HardwareSerial>.
+ */
+template <class Transport> using Z906Serial = Z906Core<Transport, ArduinoClock>;
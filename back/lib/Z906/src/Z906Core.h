@@ -0,0 +1,489 @@
+#pragma once
+
+#include "Z906.h"
+#include <type_traits>
+#include <utility>
+
+/**
+ * Z906 serial I/O, bound at compile time to a transport and a clock.
+ *
+ * Transport is the concrete class of the serial link, opened by the caller at
+ * BAUD_RATE with 8O1 framing: HardwareSerial, SoftwareSerial, the host's
+ * termios HardwareSerial or an in-memory stream. It provides int available(),
+ * int read(), size_t write(uint8_t) and void flush(). Its members are called
+ * qualified, so they bind statically even where they override virtual Stream
+ * members; Transport must therefore not be an abstract base like Stream.
+ *
+ * Clock provides static uint32_t millis() and static void delay(uint32_t), see
+ * ArduinoClock in Z906Arduino.h.
+ *
+ * Replies are awaited for timeout(), derived from their past round trips. The
+ * reads, which are idempotent, are retried up to SERIAL_READ_RETRIES times
+ * with a doubled timeout after a jittered delay. Commands are not retried.
+ */
+template <class Transport, class Clock> class Z906Core final : public Z906 {
+    static_assert(std::is_convertible<decltype(Clock::millis()), uint32_t>::value,
+                  "Clock::millis() must return the time in milliseconds");
+    static_assert(std::is_convertible<decltype(std::declval<Transport &>().read()), int>::value,
+                  "Transport::read() must return the next byte or -1");
+
+public:
+    // Constructor for Z906Core class attached to an already configured link.
+    explicit Z906Core(Transport &serial) : _dev_serial(serial) {}
+
+    int      cmd(const uint8_t) override;
+    int      cmd(const uint8_t, uint8_t) override;
+    int      request(const uint8_t) override;
+    int      update() override;
+    int      main_sensor() override;
+    int32_t  input_volume() override;
+    void     on() override;
+    void     off() override;
+    void     input(uint8_t, uint8_t = 0xFF) override;
+    uint32_t status_age() const override;
+
+    template <class Output> void print_status(Output &);
+
+    Transport &transport() { return _dev_serial; }
+
+private:
+    int  available() { return _dev_serial.Transport::available(); }
+    int  read() { return _dev_serial.Transport::read(); }
+    void write(uint8_t);
+    void write(const uint8_t *, size_t);
+    void flush();
+    bool wait_for(int, uint32_t, uint32_t);
+
+    template <class Attempt> int32_t retry(Reply, Attempt);
+
+    int32_t read_status(uint32_t);
+    int32_t read_temperature(uint32_t);
+    int32_t read_gain(uint32_t);
+
+    Transport &_dev_serial;
+};
+
+/**
+ * Get the time elapsed since the status cache was last read from the unit,
+ * UINT32_MAX if it has never been read successfully.
+ */
+template <class Transport, class Clock>
+uint32_t Z906Core<Transport, Clock>::status_age() const {
+    return _status_valid ? Clock::millis() - _status_time : UINT32_MAX;
+}
+
+/**
+ * Turn the Z906 unit on.
+ *
+ * This function sends the command to turn on the Z906 unit.
+ */
+template <class Transport, class Clock> void Z906Core<Transport, Clock>::on() {
+    write(PWM_ON);
+    apply(PWM_ON);
+}
+
+/**
+ * Turn the Z906 unit off and reset power-up time.
+ *
+ * This function sends the command to turn off the Z906 unit, resets the
+ * power-up time, and discards the acknowledgment (ACK) message for a clean
+ * serial buffer.
+ */
+template <class Transport, class Clock> void Z906Core<Transport, Clock>::off() {
+    // Send the command to turn off the Z906 unit
+    write(PWM_OFF);
+    apply(PWM_OFF);
+
+    // Reset the power-up time and save changes to EEPROM
+    const uint8_t cmd[] = {RESET_PWR_UP_TIME, 0x37, EEPROM_SAVE};
+    write(cmd, sizeof(cmd));
+
+    // Discard the acknowledgment (ACK) message for a clean serial buffer
+    flush();
+}
+
+/**
+ * Change the input on the Z906 unit specifying an effect.
+ *
+ * @param input The input to be set on the Z906 unit.
+ * @param effect The effect to be applied to the input, 0xFF for the default.
+ */
+template <class Transport, class Clock>
+void Z906Core<Transport, Clock>::input(uint8_t input, uint8_t effect) {
+    // Send the command to change the input with specified effect
+    uint8_t cmd[4];
+    input_command(input, effect, cmd);
+    write(cmd, sizeof(cmd));
+    for (const uint8_t c : cmd) apply(c);
+
+    // Discard the acknowledgment (ACK) message for a clean serial buffer
+    flush();
+}
+
+/**
+ * Flush the serial communication buffers.
+ *
+ * This function introduces a deadtime delay to avoid UART TX collisions and
+ * clears the RX buffer.
+ */
+template <class Transport, class Clock> void Z906Core<Transport, Clock>::flush() {
+    // Introduce a deadtime delay to avoid UART TX collisions
+    Clock::delay(SERIAL_DEADTIME);
+
+    // Clear the RX buffer by reading any available data
+    while (available() > 0) {
+        read();
+    }
+}
+
+/**
+ * Write a single-byte command to the Z906 TX port, flushing the TX buffer
+ * afterward.
+ *
+ * @param cmd The single-byte command to be written.
+ */
+template <class Transport, class Clock>
+void Z906Core<Transport, Clock>::write(uint8_t cmd) {
+    // Flush the communication buffers to ensure a clean start
+    flush();
+
+    // Write the specified single-byte command to the Z906 TX port
+    _dev_serial.Transport::write(cmd);
+
+    // Flush the TX buffer to ensure the command is sent to the device
+    _dev_serial.Transport::flush();
+}
+
+/**
+ * Write a command (byte array) to the Z906 TX port, flushing the TX buffer
+ * afterward.
+ *
+ * @param pCmd A pointer to the byte array representing the command.
+ * @param cmdLen The length of the command byte array.
+ */
+template <class Transport, class Clock>
+void Z906Core<Transport, Clock>::write(const uint8_t *pCmd, size_t cmdLen) {
+    // Flush the communication buffers to ensure a clean start
+    flush();
+
+    // Write each byte of the command byte array to the Z906 TX port
+    for (size_t i = 0; i < cmdLen; i++) {
+        _dev_serial.Transport::write(pCmd[i]);
+    }
+
+    // Flush the TX buffer to ensure the command is sent to the device
+    _dev_serial.Transport::flush();
+}
+
+/**
+ * Wait until count bytes are available in the serial buffer.
+ *
+ * @param count The number of bytes expected.
+ * @param started millis() the wait started at.
+ * @param limit The timeout in ms.
+ * @return false if the timeout expired first.
+ */
+template <class Transport, class Clock>
+bool Z906Core<Transport, Clock>::wait_for(int count, uint32_t started,
+                                          uint32_t limit) {
+    while (available() < count) {
+        // Check for timeout
+        if (Clock::millis() - started > limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Run a read exchange, retrying it while it fails and attempts are left.
+ *
+ * Each retry waits SERIAL_RETRY_DELAY ms plus jitter and doubles the timeout.
+ * An attempt that already waited SERIAL_TIME_OUT is not retried, the unit is
+ * more likely gone than slow.
+ *
+ * @param reply The type of the reply, for its timeout.
+ * @param attempt Callable running one exchange within the given timeout.
+ * @return The result of the last attempt.
+ */
+template <class Transport, class Clock>
+template <class Attempt>
+int32_t Z906Core<Transport, Clock>::retry(Reply reply, Attempt attempt) {
+    uint32_t limit = timeout(reply);
+
+    for (uint8_t retries = 0;; retries++) {
+        const int32_t result = attempt(limit);
+        if (result != Z906_ERROR || retries == SERIAL_READ_RETRIES ||
+            limit >= SERIAL_TIME_OUT)
+            return result;
+
+        Clock::delay(SERIAL_RETRY_DELAY + jitter(SERIAL_RETRY_DELAY + 1));
+        limit = limit * 2 < SERIAL_TIME_OUT ? limit * 2 : SERIAL_TIME_OUT;
+    }
+}
+
+/**
+ * Update the status of the Z906 device.
+ * This function sends a command to retrieve the current status of the Z906,
+ * reads the response from the serial interface, and validates the received
+ * data. A timed out or invalid status is requested again, see retry().
+ *
+ * The status cache is only replaced when a valid status is received.
+ *
+ * @return 1 if the update is successful, 0 otherwise.
+ */
+template <class Transport, class Clock> int Z906Core<Transport, Clock>::update() {
+    return retry(REPLY_STATUS, [this](uint32_t limit) {
+               return read_status(limit);
+           }) != Z906_ERROR;
+}
+
+/**
+ * Request the status once, see update().
+ *
+ * @param limit The timeout in ms.
+ * @return 1 if a valid status was stored, Z906_ERROR otherwise.
+ */
+template <class Transport, class Clock>
+int32_t Z906Core<Transport, Clock>::read_status(uint32_t limit) {
+    // Receive into a scratch packet so a failed read keeps the cache intact
+    t_packet status = {};
+
+    // Send command to request device status
+    write(GET_STATUS);
+
+    // Record the current time for timeout monitoring
+    const uint32_t currentMillis = Clock::millis();
+
+    // Wait until the expected status data is available in the serial buffer
+    if (!wait_for(STATUS_LENGTH + 1, currentMillis, limit)) {
+        return Z906_ERROR;
+    }
+
+    // Read the status data into the buffer
+    for (int i = 0; i <= STATUS_LENGTH; i++) {
+        status.buffer[i] = static_cast<uint8_t>(read());
+    }
+
+    // Extract payload size and calculate the total buffer size
+    const size_t payloadLen = status.buffer[STATUS_LENGTH]; // Size of the payload
+    const size_t statusLen  = payloadLen + 4; // Size of full status buffer in RAM
+    if (statusLen > STATUS_BUFFER_SIZE) {
+        return Z906_ERROR;
+    }
+
+    // Wait until the full payload is available in the serial buffer
+    if (!wait_for(static_cast<int>(payloadLen + 1), currentMillis, limit)) {
+        return Z906_ERROR;
+    }
+
+    // Read payload and checksum into the status buffer
+    for (size_t i = 0; i <= payloadLen; i++) {
+        status.buffer[i + STATUS_LENGTH + 1] = static_cast<uint8_t>(read());
+    }
+
+    const uint32_t now = Clock::millis();
+    record_rtt(REPLY_STATUS, now - currentMillis);
+    return store_status(status, statusLen, now) ? 1 : Z906_ERROR;
+}
+
+/**
+ * Request data from the Z906 unit based on the specified command.
+ *
+ * This function updates the internal status buffer by querying the device,
+ * and then returns specific data based on the provided command.
+ *
+ * @param cmd The command indicating the type of data to request from the Z906
+ * unit.
+ * @return The requested data, or Z906_ERROR if the update operation fails.
+ */
+template <class Transport, class Clock>
+int Z906Core<Transport, Clock>::request(const uint8_t cmd) {
+    return update() ? status_value(cmd) : Z906_ERROR;
+}
+
+/**
+ * Send a command to the Z906 device and return the response.
+ *
+ * This function sends a specified command to the Z906 device, waits for the
+ * response, and returns the received data. The command is not retried, it
+ * may have been executed without its response arriving.
+ *
+ * @param cmd The command to be sent to the Z906 device.
+ * @return The response received from the Z906 device, or Z906_ERROR if the
+ * operation times out.
+ */
+template <class Transport, class Clock>
+int Z906Core<Transport, Clock>::cmd(const uint8_t cmd) {
+    // Send the specified command to the device
+    write(cmd);
+
+    // Reflect the command in the status cache
+    apply(cmd);
+
+    // Record the current time for timeout monitoring
+    const uint32_t currentMillis = Clock::millis();
+
+    // Wait until response data is available in the serial buffer
+    if (!wait_for(1, currentMillis, timeout(REPLY_ACK))) {
+        return Z906_ERROR;
+    }
+    record_rtt(REPLY_ACK, Clock::millis() - currentMillis);
+
+    // Return the received response
+    return read();
+}
+
+/**
+ * Send a command to update a specific parameter on the Z906 device.
+ *
+ * This function updates a specified parameter on the Z906 device with the
+ * provided value, normalizes the volume if necessary, and sends the updated
+ * status to the device. Additionally, it discards the acknowledgment (ACK)
+ * message to maintain a clean serial buffer.
+ *
+ * @param cmd_a The command representing the parameter to be updated (e.g.,
+ * MAIN_LEVEL, REAR_LEVEL, etc.).
+ * @param cmd_b The value to be set for the specified parameter.
+ * @return The value set, or Z906_ERROR if the status could not be refreshed
+ * and nothing was sent.
+ */
+template <class Transport, class Clock>
+int Z906Core<Transport, Clock>::cmd(const uint8_t cmdA, uint8_t cmdB) {
+    // Refresh the internal status buffer unless it was read very recently, the
+    // whole buffer is written back and must not carry stale settings
+    if (status_age() > STATUS_CACHE_TTL && !update()) {
+        return Z906_ERROR;
+    }
+
+    set_value(cmdA, cmdB);
+
+    // Send the updated status buffer to the Z906 device
+    write(_status.buffer, _status_len);
+
+    // Discard the acknowledgment (ACK) message to maintain a clean serial buffer
+    flush();
+    return cmdB;
+}
+
+/**
+ * Print the current status of the Z906 device.
+ *
+ * This function updates the internal status buffer by querying the device,
+ * and then prints each byte of the status buffer in hexadecimal format.
+ *
+ * @param out The output, e.g. Serial.
+ */
+template <class Transport, class Clock>
+template <class Output>
+void Z906Core<Transport, Clock>::print_status(Output &out) {
+    // Update the internal status buffer with the current device status
+    update();
+
+    // Print each byte of the status buffer in hexadecimal format
+    for (size_t i = 0; i < _status_len; i++) {
+        out.print(_status.buffer[i], 16); // HEX
+        out.print(" ");
+    }
+
+    out.print("\n");
+}
+
+/**
+ * Retrieve the temperature reading from the main sensor of the Z906 device.
+ *
+ * This function sends a command to request the temperature reading from the
+ * main sensor, waits for the response, and returns the temperature value if the
+ * operation is successful. A timed out or invalid response is requested again,
+ * see retry().
+ *
+ * @return The temperature reading from the main sensor, or Z906_ERROR if the
+ * operation times out or the response is invalid.
+ */
+template <class Transport, class Clock>
+int Z906Core<Transport, Clock>::main_sensor() {
+    return retry(REPLY_TEMP, [this](uint32_t limit) {
+        return read_temperature(limit);
+    });
+}
+
+/**
+ * Request the temperature once, see main_sensor().
+ *
+ * @param limit The timeout in ms.
+ */
+template <class Transport, class Clock>
+int32_t Z906Core<Transport, Clock>::read_temperature(uint32_t limit) {
+    // Send command to request temperature from the main sensor
+    write(GET_TEMP);
+
+    // Record the current time for timeout monitoring
+    const uint32_t currentMillis = Clock::millis();
+
+    // Wait until the full temperature response is available in the serial buffer
+    if (!wait_for(TEMP_TOTAL_LENGTH, currentMillis, limit))
+        return Z906_ERROR;
+    record_rtt(REPLY_TEMP, Clock::millis() - currentMillis);
+
+    // Read the temperature response into a temporary buffer
+    uint8_t temp[TEMP_TOTAL_LENGTH];
+    for (auto &x : temp) {
+        x = static_cast<uint8_t>(read());
+    }
+
+    // Validate the temperature response
+    if (temp[2] != EXP_MODEL_TEMP)
+        return Z906_ERROR;
+
+    // Return the temperature reading from the main sensor
+    return temp[7];
+}
+
+/**
+ * Retrieve the current volume of the active input.
+ *
+ * This function sends a command to request the current volume of the active
+ * input, waits for the response and returns the volume value if the operation
+ * is successful. A timed out or invalid response is requested again, see
+ * retry().
+ *
+ * @return The volume reading of the current input, 0 if input is silent, or
+ * Z906_ERROR if the operation times out or the response is invalid.
+ */
+template <class Transport, class Clock>
+int32_t Z906Core<Transport, Clock>::input_volume() {
+    return retry(REPLY_GAIN, [this](uint32_t limit) { return read_gain(limit); });
+}
+
+/**
+ * Request the input volume once, see input_volume().
+ *
+ * @param limit The timeout in ms.
+ */
+template <class Transport, class Clock>
+int32_t Z906Core<Transport, Clock>::read_gain(uint32_t limit) {
+    // Send command to request current volume
+    write(GET_INPUT_GAIN);
+
+    // Record the current time for timeout monitoring
+    const uint32_t currentMillis = Clock::millis();
+
+    // Wait until the full volume response is available in the serial buffer
+    if (!wait_for(GAIN_TOTAL_LENGTH, currentMillis, limit))
+        return Z906_ERROR;
+    record_rtt(REPLY_GAIN, Clock::millis() - currentMillis);
+
+    // Read the volume response into a temporary buffer
+    uint8_t temp[GAIN_TOTAL_LENGTH];
+    for (auto &x : temp) {
+        x = static_cast<uint8_t>(read());
+    }
+
+    // Validate the volume response
+    if (temp[2] != EXP_MODEL_GAIN)
+        return Z906_ERROR;
+
+    // Return the volume reading, 24 bits
+    return static_cast<int32_t>(((uint32_t)temp[4] << 16) |
+                                ((uint32_t)temp[5] << 8) | ((uint32_t)temp[6]));
+}
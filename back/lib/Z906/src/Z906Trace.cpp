@@ -0,0 +1,107 @@
+#include "Z906Trace.h"
+
+/**
+ * Start recording to the given output, writing the trace header.
+ *
+ * @param out The output receiving the trace lines, e.g. an open file.
+ */
+void TraceLog::begin(Print &out) {
+    end();
+
+    _out      = &out;
+    _previous = micros();
+    _arrived  = false;
+    _out->print("# z906-trace ");
+    _out->print(TRACE_VERSION);
+    _out->print("\n");
+}
+
+/**
+ * Stop recording, writing out the pending line.
+ */
+void TraceLog::end() {
+    if (!_out)
+        return;
+
+    print_line();
+    _out->flush();
+    _out = nullptr;
+}
+
+/**
+ * Account a poll of the RX buffer: note when unread bytes were first seen,
+ * for the stamp of the RX line.
+ */
+void TraceLog::seen(int count) {
+    if (count > 0 && !_arrived) {
+        _arrival = micros();
+        _arrived = true;
+    }
+}
+
+/**
+ * Log a byte read, if any.
+ */
+void TraceLog::received(int c) {
+    if (c < 0)
+        return;
+
+    log('R', static_cast<uint8_t>(c), _arrived ? _arrival : micros());
+    _arrived = false;
+}
+
+/**
+ * Log a byte written.
+ */
+void TraceLog::sent(uint8_t c) { log('T', c, micros()); }
+
+/**
+ * Append a byte to the pending line, first writing out the line if the byte
+ * cannot belong to it.
+ *
+ * @param direction 'T' for a written byte, 'R' for a read one.
+ * @param c The byte.
+ * @param at micros() the byte was sent or seen.
+ */
+void TraceLog::log(char direction, uint8_t c, uint32_t at) {
+    const uint32_t now = micros();
+
+    if (_line_len &&
+        (direction != _direction || _line_len == TRACE_LINE_SIZE ||
+         now - _last_byte > TRACE_GAP)) {
+        print_line();
+    }
+
+    if (!_line_len) {
+        _direction  = direction;
+        _line_start = at;
+    }
+    _line[_line_len++] = c;
+    _last_byte         = now;
+}
+
+/**
+ * Write out the pending line, if any.
+ */
+void TraceLog::print_line() {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+
+    if (!_line_len)
+        return;
+
+    // Bytes seen available before the previous line was started keep order
+    const uint32_t delta =
+        static_cast<int32_t>(_line_start - _previous) > 0 ? _line_start - _previous
+                                                          : 0;
+    _out->print(static_cast<unsigned long>(delta));
+    _out->print(_direction == 'T' ? " TX" : " RX");
+    for (size_t i = 0; i < _line_len; i++) {
+        _out->write(' ');
+        _out->write(HEX_DIGITS[_line[i] >> 4]);
+        _out->write(HEX_DIGITS[_line[i] & 0x0F]);
+    }
+    _out->write('\n');
+
+    _previous += delta;
+    _line_len = 0;
+}
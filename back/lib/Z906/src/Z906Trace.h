@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Arduino.h"
+
+// Trace Settings
+#define TRACE_VERSION 1
+#define TRACE_LINE_SIZE 32 // Bytes per trace line at most
+#define TRACE_GAP 1000     // Microseconds of silence ending a trace line
+
+/**
+ * Formatting of the trace lines of Z906Trace.
+ */
+class TraceLog {
+
+public:
+    void begin(Print &);
+    void end();
+    bool recording() const { return _out != nullptr; }
+    void seen(int);
+    void received(int);
+    void sent(uint8_t);
+
+private:
+    void log(char, uint8_t, uint32_t);
+    void print_line();
+
+    Print   *_out = nullptr;
+    char     _direction = 0; // 'T' or 'R' while a line is pending
+    uint8_t  _line[TRACE_LINE_SIZE];
+    size_t   _line_len   = 0;
+    uint32_t _line_start = 0; // micros() of the first byte of the line
+    uint32_t _last_byte  = 0; // micros() of the last byte logged
+    uint32_t _previous   = 0; // micros() of the previous line
+    uint32_t _arrival    = 0; // micros() unread RX bytes were first seen
+    bool     _arrived    = false;
+};
+
+/**
+ * Recorder of the serial traffic of a Z906 session.
+ *
+ * Sits between the library and its serial port as the transport of Z906Core,
+ * Z906Serial<Z906Trace<HardwareSerial>>, and logs every byte written (TX) and
+ * read (RX) as text lines:
+ *
+ *   # z906-trace 1
+ *   0 TX 34
+ *   1873 RX aa 0a 13 14 14 14 14 00 00 03 03 00 00 03 03 00 01 01 02 03 00 01 7f
+ *   60004992 TX 34
+ *
+ * The first field is the time in microseconds since the previous line. A line
+ * holds the bytes of one direction until the direction changes, TRACE_GAP
+ * passes without traffic or TRACE_LINE_SIZE bytes are logged. RX lines are
+ * stamped when the library first saw the bytes available, which is when they
+ * arrived for a library waiting on them. Lines starting with '#' are comments.
+ *
+ * Until begin() the traffic is passed through without being logged.
+ */
+template <class Transport> class Z906Trace {
+
+public:
+    explicit Z906Trace(Transport &serial) : _serial(serial) {}
+
+    void begin(Print &out) { _log.begin(out); }
+    void end() { _log.end(); }
+    bool recording() const { return _log.recording(); }
+
+    int available() {
+        const int count = _serial.Transport::available();
+        if (_log.recording())
+            _log.seen(count);
+        return count;
+    }
+
+    int read() {
+        const int c = _serial.Transport::read();
+        if (_log.recording())
+            _log.received(c);
+        return c;
+    }
+
+    int peek() { return _serial.Transport::peek(); }
+
+    size_t write(uint8_t c) {
+        if (_log.recording())
+            _log.sent(c);
+        return _serial.Transport::write(c);
+    }
+
+    void flush() { _serial.Transport::flush(); }
+
+private:
+    Transport &_serial;
+    TraceLog   _log;
+};
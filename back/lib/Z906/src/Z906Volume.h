@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VOLUME_MAX_LEVEL 43  // levels stored by the unit, 0...43
+#define VOLUME_MAX_VALUE 255 // levels exposed by the API, 0...255
+#define VOLUME_DB_MUTE INT16_MIN
+
+// Channels compensated in loudness mode, in the order of their status bytes
+enum LoudnessChannel : uint8_t { LOUDNESS_REAR, LOUDNESS_CENTER, LOUDNESS_SUB, LOUDNESS_CHANNELS };
+
+/**
+ * Points of the level to decibel curve, in hundredths of a dB, interpolated
+ * linearly in between. Level 0 is muted. These are nominal, 1.5 dB per level
+ * below full scale; replace them with the points measured on a unit.
+ */
+struct VolumePoint {
+    uint8_t level;
+    int16_t centi_db;
+};
+
+constexpr VolumePoint VOLUME_CALIBRATION[] = {{1, -6300}, {VOLUME_MAX_LEVEL, 0}};
+
+/**
+ * Loudness boost of a channel at a main level, in levels: the full boost at
+ * level 0, fading out quadratically up to the knee.
+ */
+constexpr int8_t loudness_curve(int main, int boost, int knee) {
+    return main >= knee ? 0
+                        : static_cast<int8_t>((boost * (knee - main) * (knee - main) +
+                                               knee * knee / 2) /
+                                              (knee * knee));
+}
+
+/**
+ * Volume scales of the Z906, generated at compile time.
+ *
+ * Conversions between values and levels round to the nearest in both
+ * directions, so the value of a level maps back to that level. A value read
+ * back can thus be written again without moving the level.
+ */
+struct VolumeTables {
+    uint8_t level[VOLUME_MAX_VALUE + 1];    // value to level
+    uint8_t value[VOLUME_MAX_LEVEL + 1];    // level to value
+    int16_t centi_db[VOLUME_MAX_LEVEL + 1]; // level to hundredths of a dB
+    int8_t  loudness[LOUDNESS_CHANNELS][VOLUME_MAX_LEVEL + 1]; // by main level
+
+    constexpr VolumeTables() : level(), value(), centi_db(), loudness() {
+        for (int v = 0; v <= VOLUME_MAX_VALUE; v++)
+            level[v] = static_cast<uint8_t>(
+                (v * VOLUME_MAX_LEVEL + VOLUME_MAX_VALUE / 2) / VOLUME_MAX_VALUE);
+        for (int l = 0; l <= VOLUME_MAX_LEVEL; l++)
+            value[l] = static_cast<uint8_t>(
+                (l * VOLUME_MAX_VALUE + VOLUME_MAX_LEVEL / 2) / VOLUME_MAX_LEVEL);
+
+        const size_t points = sizeof(VOLUME_CALIBRATION) / sizeof(VOLUME_CALIBRATION[0]);
+        centi_db[0] = VOLUME_DB_MUTE;
+        for (int l = 1; l <= VOLUME_MAX_LEVEL; l++) {
+            size_t p = 0;
+            while (p + 2 < points && VOLUME_CALIBRATION[p + 1].level <= l) p++;
+
+            const VolumePoint &a = VOLUME_CALIBRATION[p];
+            const VolumePoint &b = VOLUME_CALIBRATION[p + 1];
+            centi_db[l] = static_cast<int16_t>(
+                a.centi_db + (b.centi_db - a.centi_db) * (l - a.level) / (b.level - a.level));
+        }
+
+        // Nominal equal-loudness correction: the ear loses the bass first,
+        // then the surround, so the sub gets the most at low levels
+        for (int l = 0; l <= VOLUME_MAX_LEVEL; l++) {
+            loudness[LOUDNESS_REAR][l]   = loudness_curve(l, 3, 28);
+            loudness[LOUDNESS_CENTER][l] = loudness_curve(l, 2, 24);
+            loudness[LOUDNESS_SUB][l]    = loudness_curve(l, 8, 32);
+        }
+    }
+};
+
+inline constexpr VolumeTables VOLUME_TABLES{};
+
+/**
+ * Level of a 0...255 value.
+ */
+constexpr uint8_t volume_level(uint8_t value) { return VOLUME_TABLES.level[value]; }
+
+/**
+ * 0...255 value of a level, levels above VOLUME_MAX_LEVEL count as the top.
+ */
+constexpr uint8_t volume_value(uint8_t level) {
+    return VOLUME_TABLES.value[level > VOLUME_MAX_LEVEL ? VOLUME_MAX_LEVEL : level];
+}
+
+/**
+ * Hundredths of a dB of a level, VOLUME_DB_MUTE for level 0.
+ */
+constexpr int16_t volume_centi_db(uint8_t level) {
+    return VOLUME_TABLES.centi_db[level > VOLUME_MAX_LEVEL ? VOLUME_MAX_LEVEL : level];
+}
+
+/**
+ * Level closest to the given hundredths of a dB, 0 below the first level.
+ */
+constexpr uint8_t volume_level_for_db(int16_t centi_db) {
+    if (centi_db <= VOLUME_DB_MUTE || centi_db < VOLUME_TABLES.centi_db[1] -
+                                                     (VOLUME_TABLES.centi_db[2] -
+                                                      VOLUME_TABLES.centi_db[1]) / 2)
+        return 0;
+
+    uint8_t best = 1;
+    for (uint8_t l = 2; l <= VOLUME_MAX_LEVEL; l++) {
+        const int d_l    = VOLUME_TABLES.centi_db[l] - centi_db;
+        const int d_best = VOLUME_TABLES.centi_db[best] - centi_db;
+        if ((d_l < 0 ? -d_l : d_l) < (d_best < 0 ? -d_best : d_best))
+            best = l;
+    }
+    return best;
+}
+
+/**
+ * Levels added to a channel in loudness mode at the given main level.
+ */
+constexpr int8_t loudness_offset(LoudnessChannel channel, uint8_t main) {
+    return VOLUME_TABLES.loudness[channel][main > VOLUME_MAX_LEVEL ? VOLUME_MAX_LEVEL : main];
+}
+
+namespace volume_checks {
+    constexpr bool round_trips() {
+        for (int l = 0; l <= VOLUME_MAX_LEVEL; l++) {
+            if (volume_level(volume_value(static_cast<uint8_t>(l))) != l)
+                return false;
+        }
+        for (int v = 0; v <= VOLUME_MAX_VALUE; v++) {
+            const uint8_t level = volume_level(static_cast<uint8_t>(v));
+            if (volume_level(volume_value(level)) != level)
+                return false;
+        }
+        return true;
+    }
+
+    constexpr bool db_round_trips() {
+        for (int l = 0; l <= VOLUME_MAX_LEVEL; l++) {
+            if (volume_level_for_db(volume_centi_db(static_cast<uint8_t>(l))) != l)
+                return false;
+        }
+        return true;
+    }
+
+    static_assert(round_trips(), "levels must survive a trip through values");
+    static_assert(db_round_trips(), "levels must survive a trip through decibels");
+} // namespace volume_checks
@@ -0,0 +1,384 @@
+#include "automation.h"
+#include <LittleFS.h>
+#include <Z906Volume.h>
+
+namespace z906remote {
+
+    namespace {
+        const uint8_t ENDPOINT_COUNT = sizeof(endpoints) / sizeof(endpoints[0]);
+        const uint8_t FILE_MAGIC[2]  = {'Z', 'R'};
+
+        /**
+         * Cached level of a channel, 0...VOLUME_MAX_LEVEL.
+         */
+        uint8_t cached_level(const Z906::t_packetdata &status, uint8_t channel) {
+            switch (channel) {
+            case REAR_LEVEL:
+                return status.rear_level;
+            case CENTER_LEVEL:
+                return status.center_level;
+            case SUB_LEVEL:
+                return status.sub_level;
+            default:
+                return status.main_level;
+            }
+        }
+    } // namespace
+
+    /**
+     * Load the rules stored in AUTOMATION_FILE, LittleFS must be mounted.
+     * The clock gives the local time of the RuleAt rules, the command runs
+     * an endpoint on a unit like a detached REST request.
+     */
+    void Automation::begin(Device *devices, uint8_t count, Clock clock,
+                           Command command) {
+        _devices       = devices;
+        _devices_count = count;
+        _clock         = clock;
+        _command       = command;
+
+        load();
+        arm_all();
+    }
+
+    /**
+     * Store and arm a new rule. Returns false if it is invalid, if
+     * AUTOMATION_MAX_RULES are stored already or if it cannot be saved.
+     */
+    bool Automation::add(const Rule &rule) {
+        if (_count == AUTOMATION_MAX_RULES || !valid(rule))
+            return false;
+
+        const uint8_t id = _count++;
+        _rules[id]       = rule;
+        if (!save()) {
+            _count--;
+            return false;
+        }
+
+        _ramps[id]   = Ramp();
+        _latched[id] = false;
+        arm(id);
+        return true;
+    }
+
+    /**
+     * Delete a rule, the ids of the following rules move down by one. They
+     * keep their deadlines and ramps, the heap only gets the new ids.
+     */
+    bool Automation::remove(uint8_t id) {
+        if (id >= _count)
+            return false;
+
+        cancel(id);
+        for (uint8_t i = id; i + 1 < _count; i++) {
+            _rules[i]   = _rules[i + 1];
+            _ramps[i]   = _ramps[i + 1];
+            _latched[i] = _latched[i + 1];
+            _due[i]     = _due[i + 1];
+            _pos[i]     = _pos[i + 1];
+            if (_pos[i] >= 0)
+                _heap[_pos[i]] = i;
+        }
+        _pos[--_count] = -1;
+        return save();
+    }
+
+    /**
+     * Follow the idle state of a unit from its status broadcasts: on, and
+     * without an input signal. The RuleIdle rules of a unit are armed when it
+     * turns idle and disarmed when it no longer is.
+     */
+    void Automation::status_changed(const Device &device) {
+        if (device.index >= AUTOMATION_MAX_DEVICES ||
+            device.amp.status_age() == UINT32_MAX)
+            return;
+
+        const Z906::t_packetdata status = device.amp.get_data();
+        const bool               idle   = !status.stby && !status.signal_status;
+        if (idle == _idle[device.index])
+            return;
+
+        _idle[device.index]       = idle;
+        _idle_since[device.index] = millis();
+        for (uint8_t id = 0; id < _count; id++) {
+            if (_rules[id].kind != RuleIdle || _rules[id].device != device.index)
+                continue;
+            if (idle) {
+                arm(id);
+            } else {
+                cancel(id);
+                _latched[id] = false;
+            }
+        }
+    }
+
+    /**
+     * Fire the rules that are due, run every AUTOMATION_TICK ms.
+     */
+    void Automation::loop() {
+        if (!_timed && _clock && _clock()) {
+            _timed = true;
+            arm_all();
+        }
+
+        const unsigned long now = millis();
+        while (_size && static_cast<long>(now - _due[_heap[0]]) >= 0) {
+            const uint8_t id = _heap[0];
+            cancel(id);
+            fire(id);
+        }
+    }
+
+    /**
+     * Time in ms until a rule fires, -1 if it is not armed.
+     */
+    long Automation::due_in(uint8_t id) const {
+        if (id >= _count || _pos[id] < 0)
+            return -1;
+
+        const long wait = static_cast<long>(_due[id] - millis());
+        return wait > 0 ? wait : 0;
+    }
+
+    /**
+     * Rules only run commands, on a known unit, at a time that exists.
+     */
+    bool Automation::valid(const Rule &rule) const {
+        if (rule.endpoint >= ENDPOINT_COUNT ||
+            priority_of(endpoints[rule.endpoint]) != Interactive)
+            return false;
+
+        bool known = false;
+        for (uint8_t i = 0; i < _devices_count; i++)
+            known |= _devices[i].index == rule.device;
+        if (!known || rule.device >= AUTOMATION_MAX_DEVICES)
+            return false;
+
+        switch (rule.kind) {
+        case RuleAt:
+            return rule.minutes < 24 * 60 && rule.days & AUTOMATION_EVERY_DAY &&
+                   (!rule.ramp || endpoints[rule.endpoint].type == SetValue);
+        case RuleIdle:
+            return rule.minutes && !rule.ramp;
+        default:
+            return false;
+        }
+    }
+
+    /**
+     * The file holds a header, "ZR", the file version and the size of the
+     * endpoint table, then the rules. Rules saved against another table are
+     * dropped, their endpoint indexes would point elsewhere.
+     */
+    void Automation::load() {
+        File file = LittleFS.open(AUTOMATION_FILE, "r");
+        if (!file)
+            return;
+
+        uint8_t header[4];
+        Rule    rule;
+        if (file.read(header, sizeof(header)) == sizeof(header) &&
+            header[0] == FILE_MAGIC[0] && header[1] == FILE_MAGIC[1] &&
+            header[2] == AUTOMATION_FILE_VERSION && header[3] == ENDPOINT_COUNT) {
+            while (_count < AUTOMATION_MAX_RULES &&
+                   file.read(reinterpret_cast<uint8_t *>(&rule), sizeof(rule)) ==
+                       sizeof(rule)) {
+                if (valid(rule))
+                    _rules[_count++] = rule;
+            }
+        }
+        file.close();
+    }
+
+    bool Automation::save() const {
+        File file = LittleFS.open(AUTOMATION_FILE, "w");
+        if (!file)
+            return false;
+
+        const uint8_t header[4] = {FILE_MAGIC[0], FILE_MAGIC[1],
+                                   AUTOMATION_FILE_VERSION, ENDPOINT_COUNT};
+        const size_t  size      = _count * sizeof(Rule);
+        const bool    ok =
+            file.write(header, sizeof(header)) == sizeof(header) &&
+            file.write(reinterpret_cast<const uint8_t *>(_rules), size) == size;
+        file.close();
+        return ok;
+    }
+
+    /**
+     * Rebuild the heap from the rules, the ramps in progress are dropped.
+     */
+    void Automation::arm_all() {
+        _size = 0;
+        memset(_pos, -1, sizeof(_pos));
+        for (uint8_t id = 0; id < _count; id++) {
+            _ramps[id].active = false;
+            arm(id);
+        }
+    }
+
+    /**
+     * Put a rule in the heap at its next deadline, if it has one. A RuleAt
+     * rule skips the margin in s, so it does not fire twice in its minute.
+     */
+    void Automation::arm(uint8_t id, uint32_t margin) {
+        const Rule &rule = _rules[id];
+
+        if (rule.kind == RuleIdle) {
+            if (_idle[rule.device] && !_latched[id])
+                schedule(id, _idle_since[rule.device] + rule.minutes * 60000UL);
+            return;
+        }
+
+        const uint32_t now = _timed ? _clock() : 0;
+        if (!now)
+            return;
+
+        const uint32_t day    = now / 86400;
+        const uint32_t second = now % 86400;
+        const uint32_t at     = rule.minutes * 60UL;
+        for (uint32_t ahead = 0; ahead <= 7; ahead++) {
+            if (!(rule.days >> ((day + ahead + 4) % 7) & 1) || // 1970-01-01 was a Thursday
+                (!ahead && at < second + margin))
+                continue;
+
+            schedule(id, millis() + (ahead * 86400 + at - second) * 1000UL);
+            return;
+        }
+    }
+
+    /**
+     * Run the command of a rule, or start its ramp, then arm it again.
+     */
+    void Automation::fire(uint8_t id) {
+        const Rule     &rule     = _rules[id];
+        const Endpoint &endpoint = endpoints[rule.endpoint];
+        const long      value    = endpoint.type == SetValue ? rule.value : -1;
+
+        if (rule.kind == RuleIdle) {
+            _latched[id] = true;
+            _command(rule.device, endpoint, value);
+            return;
+        }
+        if (_ramps[id].active) {
+            ramp_step(id);
+            return;
+        }
+
+        if (rule.ramp) {
+            for (uint8_t i = 0; i < _devices_count; i++) {
+                if (_devices[i].index != rule.device)
+                    continue;
+
+                Ramp &ramp  = _ramps[id];
+                ramp.level  = cached_level(_devices[i].amp.get_data(), endpoint.action);
+                ramp.target = volume_level(rule.value);
+                if (ramp.level == ramp.target)
+                    break;
+
+                const uint8_t steps =
+                    ramp.level > ramp.target ? ramp.level - ramp.target : ramp.target - ramp.level;
+                ramp.interval = rule.ramp * 60000UL / steps;
+                ramp.active   = true;
+                ramp_step(id);
+                return;
+            }
+        }
+
+        _command(rule.device, endpoint, value);
+        arm(id, 60);
+    }
+
+    /**
+     * Move a ramp by one level, the last step sets the value of the rule.
+     */
+    void Automation::ramp_step(uint8_t id) {
+        const Rule     &rule     = _rules[id];
+        const Endpoint &endpoint = endpoints[rule.endpoint];
+        Ramp           &ramp     = _ramps[id];
+
+        const int level = ramp.level < ramp.target ? ramp.level + 1 : ramp.level - 1;
+        ramp.level      = static_cast<uint8_t>(level);
+        if (ramp.level == ramp.target) {
+            ramp.active = false;
+            _command(rule.device, endpoint, rule.value);
+            arm(id, 60);
+            return;
+        }
+
+        _command(rule.device, endpoint, volume_value(ramp.level));
+        schedule(id, millis() + ramp.interval);
+    }
+
+    void Automation::schedule(uint8_t id, unsigned long due) {
+        _due[id] = due;
+        if (_pos[id] < 0) {
+            _heap[_size] = id;
+            _pos[id]     = static_cast<int8_t>(_size);
+            sift_up(_size++);
+        } else {
+            sift_up(_pos[id]);
+            sift_down(_pos[id]);
+        }
+    }
+
+    void Automation::cancel(uint8_t id) {
+        const int8_t pos = _pos[id];
+        if (pos < 0)
+            return;
+
+        _pos[id] = -1;
+        if (pos == --_size)
+            return;
+
+        const uint8_t moved = _heap[_size];
+        _heap[pos]          = moved;
+        _pos[moved]         = pos;
+        sift_up(pos);
+        sift_down(_pos[moved]);
+    }
+
+    /**
+     * Whether the rule at heap place a is due before the one at b, across
+     * the wrap of millis().
+     */
+    bool Automation::earlier(uint8_t a, uint8_t b) const {
+        return static_cast<long>(_due[_heap[a]] - _due[_heap[b]]) < 0;
+    }
+
+    void Automation::swap(uint8_t a, uint8_t b) {
+        const uint8_t id = _heap[a];
+        _heap[a]         = _heap[b];
+        _heap[b]         = id;
+        _pos[_heap[a]]   = static_cast<int8_t>(a);
+        _pos[_heap[b]]   = static_cast<int8_t>(b);
+    }
+
+    void Automation::sift_up(uint8_t place) {
+        while (place) {
+            const uint8_t parent = static_cast<uint8_t>((place - 1) / 2);
+            if (!earlier(place, parent))
+                return;
+            swap(place, parent);
+            place = parent;
+        }
+    }
+
+    void Automation::sift_down(uint8_t place) {
+        for (;;) {
+            const uint8_t left     = static_cast<uint8_t>(2 * place + 1);
+            const uint8_t right    = static_cast<uint8_t>(left + 1);
+            uint8_t       earliest = place;
+            if (left < _size && earlier(left, earliest))
+                earliest = left;
+            if (right < _size && earlier(right, earliest))
+                earliest = right;
+            if (earliest == place)
+                return;
+            swap(place, earliest);
+            place = earliest;
+        }
+    }
+
+} // namespace z906remote
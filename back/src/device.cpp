@@ -0,0 +1,109 @@
+#include "device.h"
+
+namespace z906remote {
+
+    Device::Device(uint8_t index, Z906 &amp) : index(index), amp(amp) {}
+
+    /**
+     * Queue a request for this unit and pause it until it is serviced.
+     * Returns false if its priority class is full, the request is left
+     * untouched.
+     */
+    bool Device::push(AsyncWebServerRequest *request, const Endpoint &endpoint,
+                      long value) {
+        Job job;
+        job.request  = request->getRequestPtr();
+        job.endpoint = &endpoint;
+        job.value    = value;
+
+        if (!scheduler.push(std::move(job), priority_of(endpoint)))
+            return false;
+
+        request->pause();
+        return true;
+    }
+
+    /**
+     * Queue a request nobody waits a response for, like a HTTP request.
+     */
+    bool Device::push_command(const Endpoint &endpoint, long value) {
+        Job job;
+        job.endpoint = &endpoint;
+        job.value    = value;
+        job.detached = true;
+
+        return scheduler.push(std::move(job), priority_of(endpoint));
+    }
+
+    /**
+     * Queue a status read-back, periodic or verifying a command, unless one
+     * is already waiting.
+     */
+    bool Device::push_update() {
+        if (_update_queued)
+            return false;
+
+        _update_queued = scheduler.push(Job(), Telemetry);
+        return _update_queued;
+    }
+
+    /**
+     * Take the next job to run on the serial link, if any.
+     */
+    bool Device::pop(Job &job) {
+        if (!scheduler.pop(job))
+            return false;
+
+        if (!job.endpoint)
+            _update_queued = false;
+        return true;
+    }
+
+    /**
+     * Whether the cached status differs from the one of the current
+     * generation, e.g. after a read that refreshed the cache on the way.
+     * False as long as no status was read at all.
+     */
+    bool Device::status_changed() const {
+        const Z906::t_packetdata status = amp.get_data();
+
+        if (amp.status_age() == UINT32_MAX)
+            return false;
+        return !_generation || memcmp(&status, &_tracked, sizeof(status)) != 0 ||
+               amp.muted_state() != _tracked_muted ||
+               amp.decode_mode() != _tracked_decode;
+    }
+
+    /**
+     * Advance the status generation if the cached status differs from the
+     * last one seen. Returns true if it did.
+     */
+    bool Device::track_status() {
+        if (_generation && !status_changed())
+            return false;
+
+        _tracked        = amp.get_data();
+        _tracked_muted  = amp.muted_state();
+        _tracked_decode = amp.decode_mode();
+        _generation++;
+        return true;
+    }
+
+    /**
+     * A unit that timed out is considered offline for DEVICE_OFFLINE_BACKOFF
+     * milliseconds, so its requests fail fast instead of each waiting for
+     * SERIAL_TIME_OUT while the other units are starved.
+     */
+    bool Device::online() const {
+        return !_offline || millis() - _offline_since > DEVICE_OFFLINE_BACKOFF;
+    }
+
+    void Device::set_online(bool connected) {
+        // The backoff starts when the unit goes offline, or again when the
+        // first request after it still times out
+        if (!connected && (!_offline || online()))
+            _offline_since = millis();
+        _offline = !connected;
+    }
+
+} // namespace z906remote
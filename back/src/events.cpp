@@ -0,0 +1,86 @@
+#include "events.h"
+
+namespace z906remote {
+
+    StatusEvents::StatusEvents(const char *url) : _source(url) {}
+
+    /**
+     * Attach the stream to the web server. The snapshot handler sends the
+     * current status to clients that cannot be resumed from the ring.
+     */
+    void StatusEvents::begin(AsyncWebServer &server, SnapshotHandler snapshot) {
+        _snapshot = snapshot;
+        _source.onConnect(
+            [this](AsyncEventSourceClient *client) { on_connect(client); });
+        _source.onDisconnect(
+            [this](AsyncEventSourceClient *client) { on_disconnect(client); });
+        server.addHandler(&_source);
+    }
+
+    /**
+     * Send a status document to every client and keep it for replay.
+     */
+    void StatusEvents::publish(const String &status) {
+        Event &event = _ring[++_last_id % EVENT_REPLAY_SIZE];
+        event.id     = _last_id;
+        event.data   = status;
+
+        if (_source.count())
+            _source.send(status.c_str(), "status", _last_id);
+    }
+
+    /**
+     * Keep idle connections open through proxies with a comment line.
+     */
+    void StatusEvents::heartbeat() {
+        for (AsyncEventSourceClient *client : _clients) {
+            if (client && client->connected())
+                client->write(":\n\n", 3);
+        }
+    }
+
+    void StatusEvents::on_connect(AsyncEventSourceClient *client) {
+        AsyncEventSourceClient **slot = nullptr;
+        for (AsyncEventSourceClient *&c : _clients) {
+            if (!c) {
+                slot = &c;
+                break;
+            }
+        }
+        if (!slot) {
+            client->close();
+            return;
+        }
+        *slot = client;
+
+        // A retry field alone dispatches no event
+        char      retry[24];
+        const int len = snprintf(retry, sizeof(retry), "retry: %ld\n\n",
+                                 EVENT_RETRY + random(EVENT_RETRY));
+        client->write(retry, len);
+
+        // Resume from the ring if it still holds every missed event
+        const uint32_t last  = client->lastId();
+        const uint32_t first = _last_id >= EVENT_REPLAY_SIZE
+                                   ? _last_id - EVENT_REPLAY_SIZE + 1
+                                   : 1;
+        if (last && last <= _last_id && last + 1 >= first) {
+            for (uint32_t id = last + 1; id <= _last_id; id++) {
+                const Event &event = _ring[id % EVENT_REPLAY_SIZE];
+                client->send(event.data.c_str(), "status", event.id);
+            }
+            return;
+        }
+
+        if (_snapshot)
+            _snapshot(client, _last_id);
+    }
+
+    void StatusEvents::on_disconnect(AsyncEventSourceClient *client) {
+        for (AsyncEventSourceClient *&c : _clients) {
+            if (c == client)
+                c = nullptr;
+        }
+    }
+
+} // namespace z906remote
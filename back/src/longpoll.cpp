@@ -0,0 +1,59 @@
+#include "longpoll.h"
+
+namespace z906remote {
+
+    /**
+     * Hold a request for at most wait milliseconds (LONGPOLL_MAX_WAIT).
+     * Returns false if no slot is free, the request is left untouched.
+     */
+    bool LongPoll::park(AsyncWebServerRequest *request, unsigned long wait) {
+        for (Waiter &waiter : _waiters) {
+            if (waiter.used && !waiter.request.expired())
+                continue;
+
+            waiter.request   = request->getRequestPtr();
+            waiter.parked_at = millis();
+            waiter.wait = wait < LONGPOLL_MAX_WAIT ? wait : LONGPOLL_MAX_WAIT;
+            waiter.used = true;
+            request->pause();
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Answer every parked request, the status has changed.
+     */
+    void LongPoll::wake(Responder respond) {
+        for (Waiter &waiter : _waiters) {
+            if (!waiter.used)
+                continue;
+            waiter.used = false;
+
+            // The client may have gone away while parked
+            std::shared_ptr<AsyncWebServerRequest> request =
+                waiter.request.lock();
+            if (request)
+                respond(request.get());
+            waiter.request.reset();
+        }
+    }
+
+    /**
+     * Answer the parked requests whose wait is over.
+     */
+    void LongPoll::expire(Responder respond) {
+        for (Waiter &waiter : _waiters) {
+            if (!waiter.used || millis() - waiter.parked_at < waiter.wait)
+                continue;
+            waiter.used = false;
+
+            std::shared_ptr<AsyncWebServerRequest> request =
+                waiter.request.lock();
+            if (request)
+                respond(request.get());
+            waiter.request.reset();
+        }
+    }
+
+} // namespace z906remote
@@ -0,0 +1,181 @@
+#include "loop_monitor.h"
+
+namespace z906remote {
+
+    namespace {
+        // Upper bounds of the histogram buckets in ms, the last is open
+        const uint16_t BUCKETS[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000};
+    } // namespace
+
+    /**
+     * Start timing an iteration of loop().
+     */
+    void LoopMonitor::start() {
+        _iteration_start = micros();
+        _stage           = -1;
+        memset(_current, 0, sizeof(_current));
+    }
+
+    /**
+     * End the running stage, if any, and start the named one. Names are
+     * expected to be string literals.
+     */
+    void LoopMonitor::stage(const char *name) {
+        const uint32_t now = micros();
+
+        if (_stage >= 0)
+            _current[_stage] += now - _stage_start;
+        _stage       = stage_index(name);
+        _stage_start = now;
+    }
+
+    /**
+     * End the iteration: account its stages and time, and keep it if it went
+     * over the budget.
+     */
+    void LoopMonitor::finish() {
+        const uint32_t now      = micros();
+        const uint32_t duration = now - _iteration_start;
+
+        if (_stage >= 0)
+            _current[_stage] += now - _stage_start;
+        _stage = -1;
+
+        for (int i = 0; i < LOOP_MAX_STAGES && _stage_names[i]; i++) {
+            _stage_total[i] += _current[i];
+            if (_current[i] > _stage_max[i])
+                _stage_max[i] = _current[i];
+        }
+
+        uint8_t bucket = 0;
+        while (bucket < HISTOGRAM_SIZE - 1 &&
+               duration >= BUCKETS[bucket] * 1000UL)
+            bucket++;
+        _histogram[bucket]++;
+        _iterations++;
+        if (duration > _max)
+            _max = duration;
+        sample_heap();
+
+        if (duration > _budget)
+            record("loop", duration, _current);
+    }
+
+    /**
+     * Account an async handler run, see Scope.
+     */
+    void LoopMonitor::record_handler(const char *source, uint32_t duration) {
+        _handler_count++;
+        if (duration > _handler_max)
+            _handler_max = duration;
+        sample_heap();
+        if (duration > _budget)
+            record(source, duration, nullptr);
+    }
+
+    void LoopMonitor::reset() {
+        const uint32_t budget = _budget;
+
+        *this   = LoopMonitor();
+        _budget = budget;
+    }
+
+    /**
+     * Lower the heap low-water mark. Handlers sample it while their request
+     * and response are still allocated, near the peaks of a burst.
+     */
+    void LoopMonitor::sample_heap() {
+        const uint32_t free = ESP.getFreeHeap();
+
+        if (free < _heap_min)
+            _heap_min = free;
+    }
+
+    int LoopMonitor::stage_index(const char *name) {
+        for (int i = 0; i < LOOP_MAX_STAGES; i++) {
+            if (_stage_names[i] == name)
+                return i;
+            if (!_stage_names[i]) {
+                _stage_names[i] = name;
+                return i;
+            }
+        }
+        return LOOP_MAX_STAGES - 1; // shares the last slot once full
+    }
+
+    /**
+     * Keep a stall if it is among the slowest seen, replacing the fastest.
+     */
+    void LoopMonitor::record(const char *source, uint32_t duration,
+                             const uint32_t *stages) {
+        Offender *slot = &_offenders[0];
+
+        _stalls++;
+        for (Offender &offender : _offenders) {
+            if (offender.duration < slot->duration)
+                slot = &offender;
+        }
+        if (slot->duration >= duration)
+            return;
+
+        slot->at       = millis();
+        slot->duration = duration;
+        strncpy(slot->source, source, sizeof(slot->source) - 1);
+        slot->source[sizeof(slot->source) - 1] = '\0';
+        if (stages)
+            memcpy(slot->stages, stages, sizeof(slot->stages));
+        else
+            memset(slot->stages, 0, sizeof(slot->stages));
+        slot->free_heap  = ESP.getFreeHeap();
+        slot->free_stack = ESP.getFreeContStack();
+    }
+
+    /**
+     * Fill the /loop report, durations are in microseconds.
+     */
+    void LoopMonitor::report(JsonDocument &doc) const {
+        doc["budget_us"]  = _budget;
+        doc["iterations"] = _iterations;
+        doc["stalls"]     = _stalls;
+        doc["max_us"]     = _max;
+
+        JsonObject handlers = doc["handlers"].to<JsonObject>();
+        handlers["count"]  = _handler_count;
+        handlers["max_us"] = _handler_max;
+
+        JsonArray histogram = doc["histogram"].to<JsonArray>();
+        for (uint8_t i = 0; i < HISTOGRAM_SIZE; i++) {
+            JsonObject bucket = histogram.add<JsonObject>();
+            if (i < HISTOGRAM_SIZE - 1)
+                bucket["le_ms"] = BUCKETS[i];
+            bucket["count"] = _histogram[i];
+        }
+
+        JsonObject stages = doc["stages"].to<JsonObject>();
+        for (int i = 0; i < LOOP_MAX_STAGES && _stage_names[i]; i++) {
+            JsonObject stage = stages[_stage_names[i]].to<JsonObject>();
+            stage["max_us"] = _stage_max[i];
+            stage["avg_us"] = _iterations ? _stage_total[i] / _iterations : 0;
+        }
+
+        JsonArray offenders = doc["offenders"].to<JsonArray>();
+        for (const Offender &offender : _offenders) {
+            if (!offender.duration)
+                continue;
+
+            JsonObject entry     = offenders.add<JsonObject>();
+            entry["at"]          = offender.at;
+            entry["source"]      = offender.source;
+            entry["duration_us"] = offender.duration;
+            entry["free_heap"]   = offender.free_heap;
+            entry["free_stack"]  = offender.free_stack;
+
+            JsonObject breakdown = entry["stages"].to<JsonObject>();
+            for (int i = 0; i < LOOP_MAX_STAGES && _stage_names[i]; i++) {
+                if (offender.stages[i])
+                    breakdown[_stage_names[i]] = offender.stages[i];
+            }
+        }
+    }
+
+} // namespace z906remote
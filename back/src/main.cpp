@@ -4,92 +4,151 @@
  * (https://github.com/zarpli/LOGItech-Z906/)
  * (https://github.com/LewisSmallwood/IoT-Logitech-Z906)
  */
+#include "automation.h"
+#include "device.h"
 #include "endpoints.h"
 #include "environment.h"
+#include "events.h"
+#include "loop_monitor.h"
+#include "mqtt_bridge.h"
+#include "service_advert.h"
+#include "tasks.h"
 #include "version.h"
+#include "wifi_link.h"
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <ArduinoOTA.h>
 #include <ESP8266WiFi.h>
-#include <ESP8266WiFiMulti.h>
 #include <ESP8266mDNS.h>
 #include <ESPAsyncWebServer.h>
 #include <LittleFS.h>
 #include <NTPClient.h>
 #include <WString.h>
 #include <WiFiUdp.h>
-#include <Z906.h>
+#include <Z906Arduino.h>
+#include <coredecls.h>
+#ifdef Z906_SOFTSERIAL_RX
+#    include <SoftwareSerial.h>
+#endif
+#ifdef MQTT_HOST
+#    include <PubSubClient.h>
+#endif
 
 
 namespace z906remote {
 
     void init_wifi();
-    void connect_to_wifi();
     void on_connected();
     void onWebSocketMessage(void *, uint8_t *, size_t);
     void broadcastMessage(const String &);
-    void broadcastStatus();
+    void serializeStatus(Device &, String &);
+    void broadcastStatus(Device &);
+    void sendStatusSnapshot(AsyncEventSourceClient *, uint32_t);
+    void refreshStatus(Device &);
     void updateClients();
+    void init_tasks();
+    bool jobs_pending();
     void init_web_server();
-    void respond_to_request(AsyncWebServerRequest *, AsyncResponseStream *, const Endpoint &);
-    void handle_get_status(JsonDocument &);
-    void handle_muted_state(JsonDocument &);
-    void handle_get_temperature(JsonDocument &);
-    void handle_decode_mode_state(JsonDocument &);
-    void handle_current_effect(JsonDocument &);
-    void handle_get_volume(JsonDocument &);
+    void queue_request(AsyncWebServerRequest *, Device &, const Endpoint &);
+    bool answer_status_early(AsyncWebServerRequest *, Device &);
+    void status_etag(const Device &, String &);
+    void send_status(AsyncWebServerRequest *, Device &);
+    void send_not_modified(AsyncWebServerRequest *, Device &);
+    void route_device_request(AsyncWebServerRequest *);
+    void service_device(Device &);
+    void handle_scheduler_stats(AsyncWebServerRequest *);
+    void handle_loop_stats(AsyncWebServerRequest *);
+    void handle_heap_stats(AsyncWebServerRequest *);
+    void handle_rules(AsyncWebServerRequest *);
+    void handle_rule_add(AsyncWebServerRequest *);
+    void handle_rule_delete(AsyncWebServerRequest *);
+    void queue_command(uint8_t, const Endpoint &, long);
+    int  respond_to_request(Device &, const Job &, JsonDocument &);
+    void handle_get_status(Z906 &, JsonDocument &);
+    void handle_muted_state(Z906 &, JsonDocument &);
+    void handle_get_temperature(Z906 &, JsonDocument &);
+    void handle_decode_mode_state(Z906 &, JsonDocument &);
+    void handle_current_effect(Z906 &, JsonDocument &);
+    void handle_get_volume(Z906 &, JsonDocument &);
     bool validate_input_value(long, uint8_t &);
+#ifdef MQTT_HOST
+    void init_mqtt();
+    void handle_mqtt();
+    bool publish_mqtt(const char *, const char *);
+    void on_mqtt_message(char *, uint8_t *, unsigned int);
+#endif
 
     AsyncWebServer   SERVER(80);
-    ESP8266WiFiMulti WIFIMULTI;
+    WifiLink         WIFI;
     AsyncWebSocket   WS("/ws");
+    StatusEvents     EVENTS("/events");
+    LoopMonitor      MONITOR;
+    ServiceAdvert    ADVERT;
+    Automation       AUTOMATION;
+    Tasks            TASKS;
 
     WiFiUDP       ntpUDP;
     NTPClient     timeClient(ntpUDP, "pool.ntp.org", 0, 60000);
     time_t        currentTime;
-    unsigned long lastUpdate = 0;
-    unsigned long timerDelay = 60000;
+    uint32_t      bootId = 0; // tells ETags of different boots apart
+    int           ntpTask = -1;
+
+    // Instantiate one Z906 object per unit, each bound to its serial link
+    Z906Serial<HardwareSerial> AMP(Serial);
+#ifdef Z906_SOFTSERIAL_RX
+    SoftwareSerial             SOFTSERIAL(Z906_SOFTSERIAL_RX, Z906_SOFTSERIAL_TX);
+    Z906Serial<SoftwareSerial> SOFTAMP(SOFTSERIAL);
+#endif
+
+    Device DEVICES[] = {
+        {0, AMP},
+#ifdef Z906_SOFTSERIAL_RX
+        {1, SOFTAMP},
+#endif
+    };
 
-    // Instantiate a Z906 object and attach to Serial
-    Z906 LOGI(Serial);
+#ifdef MQTT_HOST
+    WiFiClient    MQTT_NET;
+    PubSubClient  MQTT_CLIENT(MQTT_NET);
+    MqttBridge    MQTT(MQTT_PREFIX, publish_mqtt, queue_command);
+    unsigned long mqttRetryAt = 0;
+#endif
 
     /**
-     * Setup and connect to a WiFi network.
+     * Setup the WiFi link and give it WIFI_BOOT_WAIT ms to connect, later it
+     * is kept up by the "wifi" task.
      */
     void init_wifi() {
-        // Setup station mode.
-        WiFi.mode(WIFI_STA);
-
         // Stored WiFi credentials.
         for (const Network &network : network_credentials)
-            WIFIMULTI.addAP(network.ssid, network.password);
-        delay(2000);
-
-        // Connect to the WiFi.
-        connect_to_wifi();
-    }
+            WIFI.add_network(network.ssid, network.password);
+        WIFI.set_fallback(WIFI_AP_FALLBACK, WIFI_AP_SSID, WIFI_AP_PASSWORD);
 
-    /**
-     * Connect to the WiFi.
-     */
-    void connect_to_wifi() {
-        // Wait for connection.
-        while (WIFIMULTI.run() != WL_CONNECTED) {
-            delay(1000);
+        WiFi.hostname("LOGITECH-Z906");
+        WIFI.begin(on_connected);
+        while (!WIFI.connected() && millis() < WIFI_BOOT_WAIT) {
+            delay(WIFI_TICK);
+            WIFI.step();
         }
-
-        on_connected();
     }
 
     /**
-     * When connection is restored, log the details.
+     * When connection is restored, resume the network work. The NTP sync and
+     * the MQTT reconnect are spread over WIFI_RESUME_SPREAD ms, so they do not
+     * all hit the link at once.
      */
     void on_connected() {
         // Set the hostname,
         WiFi.hostname("LOGITECH-Z906");
 
-        // Configure MDNS.
+        // Configure MDNS and advertise the units over DNS-SD.
         MDNS.begin("logitech-z906");
+        ADVERT.begin(DEVICES, sizeof(DEVICES) / sizeof(DEVICES[0]), 80);
+
+        TASKS.schedule(ntpTask, random(WIFI_RESUME_SPREAD));
+#ifdef MQTT_HOST
+        mqttRetryAt = millis() + random(WIFI_RESUME_SPREAD);
+#endif
     }
 
     /**
@@ -109,34 +168,128 @@ namespace z906remote {
     void broadcastMessage(const String &message) { WS.textAll(message); }
 
     /**
-     * Send the status content as JSON to all clients
+     * Serialize the cached status content of a unit as JSON
      */
-    void broadcastStatus() {
+    void serializeStatus(Device &device, String &status) {
         JsonDocument doc;
-        String       status;
 
-        // workaround until proper cmd response response handling is implemented
-        LOGI.request(GET_STATUS);
-
-        handle_get_status(doc);
+        doc["device"] = device.index;
+        handle_get_status(device.amp, doc);
         serializeJson(doc, status);
+    }
+
+    /**
+     * Send the cached status content of a unit to all WebSocket and
+     * Server-Sent Events clients
+     */
+    void broadcastStatus(Device &device) {
+        String status;
+
+        if (device.track_status()) {
+            device.waiters.wake([&device](AsyncWebServerRequest *request) {
+                send_status(request, device);
+            });
+            ADVERT.status_changed();
+            AUTOMATION.status_changed(device);
+        }
+
+        serializeStatus(device, status);
         WS.textAll(status);
+        EVENTS.publish(status);
+#ifdef MQTT_HOST
+        uint8_t fields[STATUS_FIELD_COUNT];
+        status_fields(device.amp, fields);
+        MQTT.status_changed(device.index, fields);
+#endif
     }
 
     /**
-     * Run broadcastStatus() periodically
+     * Send the current status of every unit to a new /events client
+     */
+    void sendStatusSnapshot(AsyncEventSourceClient *client, uint32_t id) {
+        for (Device &device : DEVICES) {
+            String status;
+            serializeStatus(device, status);
+            client->send(status.c_str(), "status", id);
+        }
+    }
+
+    /**
+     * Read the status back from the unit and broadcast it if it differs from
+     * the last status broadcast, e.g. after a change made on the console or a
+     * command whose effect was not modelled exactly. Other reads may have
+     * refreshed the cache since, so the cache itself is no reference.
+     */
+    void refreshStatus(Device &device) {
+        if (device.amp.update() && device.status_changed())
+            broadcastStatus(device);
+    }
+
+    /**
+     * Queue refreshStatus() on every unit, as telemetry so it never gets
+     * ahead of user commands on the serial link.
      */
     void updateClients() {
-        if (millis() - lastUpdate > timerDelay) {
-            lastUpdate = millis();
-            z906remote::broadcastStatus();
+        for (Device &device : DEVICES) {
+            if (device.online())
+                device.push_update();
+        }
+    }
+
+    /**
+     * Register the periodic work of loop(), each task only runs when due.
+     */
+    void init_tasks() {
+        TASKS.add("wifi", [] { WIFI.step(); }, WIFI_TICK);
+        ntpTask = TASKS.add("ntp", [] {
+            if (WIFI.connected())
+                timeClient.forceUpdate();
+        }, 60000, 60000);
+        TASKS.add("ota", [] { ArduinoOTA.handle(); }, 50);
+        TASKS.add("mdns", [] { ADVERT.loop(); }, 250);
+        TASKS.add("rules", [] { AUTOMATION.loop(); }, AUTOMATION_TICK);
+        TASKS.add("poll", updateClients, DEVICE_POLL_INTERVAL,
+                  DEVICE_POLL_INTERVAL);
+        TASKS.add("longpoll", [] {
+            for (Device &device : DEVICES) {
+                device.waiters.expire([&device](AsyncWebServerRequest *request) {
+                    send_not_modified(request, device);
+                });
+            }
+        }, 100);
+        TASKS.add("ws", [] { WS.cleanupClients(); }, 1000);
+        TASKS.add("events", [] { EVENTS.heartbeat(); }, EVENT_HEARTBEAT,
+                  EVENT_HEARTBEAT);
+#ifdef MQTT_HOST
+        TASKS.add("mqtt", handle_mqtt, 50);
+#endif
+    }
+
+    /**
+     * Whether a unit has queued work, requests are queued by the async
+     * handlers while loop() sleeps.
+     */
+    bool jobs_pending() {
+        for (const Device &device : DEVICES) {
+            if (!device.scheduler.empty())
+                return true;
         }
+        return false;
     }
 
     /**
      * Setup the web server.
      */
     void init_web_server() {
+        // Time every handler, they stall loop() as much as its own stages
+        SERVER.addMiddleware(
+            [](AsyncWebServerRequest *request, ArMiddlewareNext next) {
+                char source[LOOP_SOURCE_SIZE];
+                snprintf(source, sizeof(source), "%s", request->url().c_str());
+                LoopMonitor::Scope scope(MONITOR, source);
+                next();
+            });
+
         SERVER.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
             request->send(LittleFS, "/index.html", "text/html");
         });
@@ -149,10 +302,12 @@ namespace z906remote {
             request->send(LittleFS, "/favicon.ico", "image/x-icon");
         });
 
-        SERVER.serveStatic("/assets", LittleFS, "/assets/")
-            .setCacheControl("max-age=31536000")
-            .setLastModified(currentTime)
-            .setTryGzipFirst(true);
+        AsyncStaticWebHandler &assets =
+            SERVER.serveStatic("/assets", LittleFS, "/assets/")
+                .setCacheControl("max-age=31536000")
+                .setTryGzipFirst(true);
+        if (currentTime) // unknown when booted offline
+            assets.setLastModified(currentTime);
 
         SERVER.onNotFound([](AsyncWebServerRequest *request) {
             if (request->method() == HTTP_OPTIONS) {
@@ -161,7 +316,8 @@ namespace z906remote {
                 response->addHeader("Access-Control-Allow-Methods",
                                     "GET, OPTIONS");
                 response->addHeader("Access-Control-Allow-Headers",
-                                    "access-control-allow-origin");
+                                    "access-control-allow-origin, "
+                                    "if-none-match");
                 request->send(response);
                 return;
             }
@@ -172,18 +328,30 @@ namespace z906remote {
             request->send(response);
         });
 
+        // Unqualified routes address the first unit
         for (const Endpoint &e : endpoints) {
-            SERVER.on(e.path, HTTP_GET, [e](AsyncWebServerRequest *request) {
-                AsyncResponseStream *response =
-                    request->beginResponseStream("application/json");
-                response->addHeader("Access-Control-Allow-Origin", "*");
-                respond_to_request(request, response, e);
-                request->send(response);
+            SERVER.on(e.path, HTTP_GET, [&e](AsyncWebServerRequest *request) {
+                queue_request(request, DEVICES[0], e);
             });
         }
 
+        // Device-qualified routes: /dev/{n}/<endpoint path>
+        SERVER.on("/dev/*", HTTP_GET, route_device_request);
+
+        SERVER.on("/scheduler", HTTP_GET, handle_scheduler_stats);
+
+        SERVER.on("/loop", HTTP_GET, handle_loop_stats);
+
+        SERVER.on("/heap", HTTP_GET, handle_heap_stats);
+
+        // Before /rules, which also matches the paths below it
+        SERVER.on("/rules/add", HTTP_GET, handle_rule_add);
+        SERVER.on("/rules/delete", HTTP_GET, handle_rule_delete);
+        SERVER.on("/rules", HTTP_GET, handle_rules);
+
         WS.onEvent([](AsyncWebSocket *server, AsyncWebSocketClient *client,
                       AwsEventType type, void *arg, uint8_t *data, size_t len) {
+            LoopMonitor::Scope scope(MONITOR, "/ws");
             switch (type) {
             case WS_EVT_CONNECT:
             case WS_EVT_DISCONNECT:
@@ -202,31 +370,432 @@ namespace z906remote {
         });
 
         SERVER.addHandler(&WS);
+        EVENTS.begin(SERVER, sendStatusSnapshot);
         SERVER.begin();
     }
 
     /**
-     * Respond to a HTTP request for the given endpoint.
+     * Queue a HTTP request on the given unit, it is answered from loop() once
+     * the unit's serial link is free.
      */
-    void respond_to_request(AsyncWebServerRequest *request,
-                            AsyncResponseStream *response, const Endpoint &endpoint) {
+    void queue_request(AsyncWebServerRequest *request, Device &device,
+                       const Endpoint &endpoint) {
+        long value = -1;
+
+        if (endpoint.type == RunFunction && endpoint.action == Status &&
+            answer_status_early(request, device))
+            return;
+
+        if (request->hasParam("value"))
+            value = request->getParam("value")->value().toInt();
+
+        if (!device.push(request, endpoint, value)) {
+            AsyncWebServerResponse *response = request->beginResponse(
+                503, "application/json",
+                "{\"success\":false,\"message\":\"Device busy.\"}");
+            response->addHeader("Access-Control-Allow-Origin", "*");
+            response->addHeader("Retry-After",
+                                String(device.scheduler.retry_after()));
+            request->send(response);
+        }
+    }
+
+    /**
+     * Answer a /status request without the serial link when possible: 304
+     * if If-None-Match carries the current ETag, or park it when ?since=N
+     * is the current generation, until it changes or ?wait=ms is over.
+     */
+    bool answer_status_early(AsyncWebServerRequest *request, Device &device) {
+        String etag;
+
+        status_etag(device, etag);
+        if (request->hasHeader("If-None-Match") &&
+            request->header("If-None-Match") == etag) {
+            send_not_modified(request, device);
+            return true;
+        }
+
+        if (!request->hasParam("since") ||
+            request->getParam("since")->value().toInt() !=
+                static_cast<long>(device.generation()))
+            return false;
+
+        const long wait = request->hasParam("wait")
+                              ? request->getParam("wait")->value().toInt()
+                              : LONGPOLL_MAX_WAIT;
+        return wait > 0 &&
+               device.waiters.park(request, static_cast<unsigned long>(wait));
+    }
+
+    /**
+     * Entity tag of a unit's cached status.
+     */
+    void status_etag(const Device &device, String &etag) {
+        etag = '"';
+        etag += String(bootId, HEX);
+        etag += '-';
+        etag += device.generation();
+        etag += '"';
+    }
+
+    /**
+     * Answer a parked /status request from the status cache.
+     */
+    void send_status(AsyncWebServerRequest *request, Device &device) {
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        JsonDocument doc;
+        String       etag;
+
+        status_etag(device, etag);
+        doc["status"]     = "connected";
+        doc["success"]    = true;
+        doc["generation"] = device.generation();
+        handle_get_status(device.amp, doc);
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        response->addHeader("Access-Control-Expose-Headers", "ETag");
+        response->addHeader("ETag", etag);
+        serializeJson(doc, *response);
+        request->send(response);
+    }
+
+    void send_not_modified(AsyncWebServerRequest *request, Device &device) {
+        AsyncWebServerResponse *response = request->beginResponse(304);
+        String                  etag;
+
+        status_etag(device, etag);
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        response->addHeader("Access-Control-Expose-Headers", "ETag");
+        response->addHeader("ETag", etag);
+        request->send(response);
+    }
+
+    /**
+     * Dispatch a /dev/{n}/... request to the endpoint of unit n.
+     */
+    void route_device_request(AsyncWebServerRequest *request) {
+        const String &url   = request->url();
+        const int     slash = url.indexOf('/', 5);
+
+        if (slash > 5) {
+            const String index = url.substring(5, slash);
+            const char  *path  = url.c_str() + slash;
+
+            for (Device &device : DEVICES) {
+                if (index != String(device.index))
+                    continue;
+                for (const Endpoint &e : endpoints) {
+                    if (strcmp(e.path, path) == 0) {
+                        queue_request(request, device, e);
+                        return;
+                    }
+                }
+            }
+        }
+
+        request->send(404, "application/json",
+                      "{\"success\":false,\"message\":\"Unknown device or "
+                      "endpoint.\"}");
+    }
+
+    /**
+     * Answer the oldest queued request of a unit, if any.
+     */
+    void service_device(Device &device) {
+        Job job;
+
+        if (!device.pop(job))
+            return;
+
+        const unsigned long started = millis();
+        if (!job.endpoint) {
+            refreshStatus(device);
+            device.scheduler.record_service(millis() - started);
+            return;
+        }
+
         JsonDocument doc;
-        uint8_t      parsedValue = 0;
-        int          cmdResponse;
-        int          code  = 200;
-        long         value = 0;
-
-        if (LOGI.request(VERSION) == 0) {
-            response->print("{\"status\":\"disconnected\"}");
-            response->setCode(code);
+        if (job.detached) {
+            respond_to_request(device, job, doc);
+            if (device.status_changed())
+                broadcastStatus(device);
+            device.scheduler.record_service(millis() - started);
+            return;
+        }
+
+        // The client may have gone away while the request was queued
+        std::shared_ptr<AsyncWebServerRequest> request = job.request.lock();
+        if (!request)
             return;
+
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        response->setCode(respond_to_request(device, job, doc));
+        // Reads like GetValue refresh the cache, a change they found must
+        // advance the generation before the ETag is taken
+        if (device.status_changed())
+            broadcastStatus(device);
+        if (job.endpoint->type == RunFunction &&
+            job.endpoint->action == Status) {
+            String etag;
+            status_etag(device, etag);
+            response->addHeader("Access-Control-Expose-Headers", "ETag");
+            response->addHeader("ETag", etag);
         }
+        serializeJson(doc, *response);
+        request->send(response);
+        device.scheduler.record_service(millis() - started);
+    }
+
+    /**
+     * Report the queue depth and wait times of every unit's scheduler.
+     */
+    void handle_scheduler_stats(AsyncWebServerRequest *request) {
+        static const char *const names[PRIORITY_COUNT] = {"interactive", "read",
+                                                          "telemetry"};
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        JsonDocument doc;
+        JsonArray    devices = doc["devices"].to<JsonArray>();
+
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        for (const Device &device : DEVICES) {
+            const Scheduler &scheduler = device.scheduler;
+            JsonObject       entry     = devices.add<JsonObject>();
+
+            entry["device"]      = device.index;
+            entry["service_avg"] = scheduler.service_avg();
+            entry["retry_after"] = scheduler.retry_after();
+            for (int p = 0; p < PRIORITY_COUNT; p++) {
+                const Priority        priority = static_cast<Priority>(p);
+                const SchedulerStats &stats    = scheduler.stats(priority);
+                JsonObject            queue    = entry[names[p]].to<JsonObject>();
+
+                queue["depth"]     = scheduler.depth(priority);
+                queue["depth_max"] = stats.depth_max;
+                queue["served"]    = stats.served;
+                queue["rejected"]  = stats.rejected;
+                queue["wait_avg"]  = stats.served ? stats.wait_sum / stats.served : 0;
+                queue["wait_max"]  = stats.wait_max;
+            }
+        }
+        serializeJson(doc, *response);
+        request->send(response);
+    }
+
+    /**
+     * Report the loop() iteration histogram, the time of its stages and the
+     * slowest stalls. ?budget=ms sets the stall budget, ?reset clears all.
+     */
+    void handle_loop_stats(AsyncWebServerRequest *request) {
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        JsonDocument doc;
+
+        if (request->hasParam("budget"))
+            MONITOR.set_budget(static_cast<uint32_t>(
+                request->getParam("budget")->value().toInt()));
+        if (request->hasParam("reset"))
+            MONITOR.reset();
+
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        doc["uptime"] = millis();
+        MONITOR.report(doc);
+        serializeJson(doc, *response);
+        request->send(response);
+    }
+
+    /**
+     * Report the free heap, its low-water mark and the largest free block,
+     * sizes in bytes. ?reset restarts the low-water mark.
+     */
+    void handle_heap_stats(AsyncWebServerRequest *request) {
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        JsonDocument   doc;
+        const uint32_t free = ESP.getFreeHeap();
+
+        if (request->hasParam("reset"))
+            MONITOR.reset_heap();
+
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        doc["uptime"]        = millis();
+        doc["free"]          = free;
+        doc["free_min"]      = min(MONITOR.heap_min(), free);
+        doc["max_block"]     = ESP.getMaxFreeBlockSize();
+        doc["fragmentation"] = ESP.getHeapFragmentation();
+        serializeJson(doc, *response);
+        request->send(response);
+    }
+
+    /**
+     * List the automation rules. next is the time in s until a rule fires,
+     * null while it waits for the NTP time or for its unit to turn idle.
+     */
+    void handle_rules(AsyncWebServerRequest *request) {
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        JsonDocument doc;
+        JsonArray    rules = doc["rules"].to<JsonArray>();
+
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        for (uint8_t id = 0; id < AUTOMATION.count(); id++) {
+            const Rule     &rule     = AUTOMATION.rule(id);
+            const Endpoint &endpoint = endpoints[rule.endpoint];
+            const long      due      = AUTOMATION.due_in(id);
+            JsonObject      entry    = rules.add<JsonObject>();
+
+            entry["id"]     = id;
+            entry["device"] = rule.device;
+            entry["path"]   = endpoint.path;
+            if (endpoint.type == SetValue)
+                entry["value"] = rule.value;
+
+            if (rule.kind == RuleAt) {
+                char at[6];
+                char days[8];
+                uint8_t count = 0;
+
+                snprintf(at, sizeof(at), "%02u:%02u", rule.minutes / 60,
+                         rule.minutes % 60);
+                for (uint8_t day = 0; day < 7; day++) {
+                    if (rule.days >> day & 1)
+                        days[count++] = static_cast<char>('0' + day);
+                }
+                days[count]   = '\0';
+                entry["at"]   = at;
+                entry["days"] = days;
+                entry["ramp"] = rule.ramp;
+            } else {
+                entry["idle"] = rule.minutes;
+            }
+
+            if (due >= 0)
+                entry["next"] = due / 1000;
+            else
+                entry["next"] = nullptr;
+        }
+        serializeJson(doc, *response);
+        request->send(response);
+    }
+
+    /**
+     * Add an automation rule, e.g.
+     *   /rules/add?at=23:00&path=/volume/main/set&value=76&ramp=10
+     *   /rules/add?at=07:00&days=12345&path=/input/1
+     *   /rules/add?idle=30&path=/power/off
+     * days are digits, 0 is Sunday, all by default. device defaults to 0.
+     */
+    void handle_rule_add(AsyncWebServerRequest *request) {
+        Rule     rule = {};
+        bool     ok   = request->hasParam("path");
+        unsigned hour = 0, minute = 0;
+
+        rule.kind     = request->hasParam("idle") ? RuleIdle : RuleAt;
+        rule.days     = AUTOMATION_EVERY_DAY;
+        rule.endpoint = UINT8_MAX;
+        for (uint8_t i = 0; ok && i < sizeof(endpoints) / sizeof(endpoints[0]); i++) {
+            if (request->getParam("path")->value() == endpoints[i].path)
+                rule.endpoint = i;
+        }
+        ok &= rule.endpoint != UINT8_MAX;
+
+        if (request->hasParam("device"))
+            rule.device = static_cast<uint8_t>(request->getParam("device")->value().toInt());
+
+        if (rule.kind == RuleIdle) {
+            const long minutes = request->getParam("idle")->value().toInt();
+            ok &= minutes > 0 && minutes <= UINT16_MAX;
+            rule.minutes = static_cast<uint16_t>(minutes);
+        } else {
+            ok &= request->hasParam("at") &&
+                  sscanf(request->getParam("at")->value().c_str(), "%u:%u", &hour,
+                         &minute) == 2 &&
+                  hour < 24 && minute < 60;
+            rule.minutes = static_cast<uint16_t>(hour * 60 + minute);
+        }
+
+        if (request->hasParam("days")) {
+            rule.days = 0;
+            for (const char *c = request->getParam("days")->value().c_str(); *c; c++) {
+                ok &= *c >= '0' && *c <= '6';
+                if (ok)
+                    rule.days |= 1 << (*c - '0');
+            }
+        }
+        if (ok && endpoints[rule.endpoint].type == SetValue)
+            ok &= request->hasParam("value") &&
+                  validate_input_value(request->getParam("value")->value().toInt(),
+                                       rule.value);
+        if (request->hasParam("ramp")) {
+            const long ramp = request->getParam("ramp")->value().toInt();
+            ok &= ramp >= 0 && ramp <= UINT8_MAX;
+            rule.ramp = static_cast<uint8_t>(ramp);
+        }
+
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        JsonDocument doc;
+
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        if (ok && AUTOMATION.add(rule)) {
+            doc["success"] = true;
+            doc["id"]      = AUTOMATION.count() - 1;
+        } else {
+            response->setCode(400);
+            doc["success"] = false;
+            doc["message"] = "Invalid rule, or no room left for it.";
+        }
+        serializeJson(doc, *response);
+        request->send(response);
+    }
+
+    /**
+     * Delete the automation rule ?id=n, the following ids move down by one.
+     */
+    void handle_rule_delete(AsyncWebServerRequest *request) {
+        const bool ok =
+            request->hasParam("id") &&
+            AUTOMATION.remove(static_cast<uint8_t>(request->getParam("id")->value().toInt()));
+
+        AsyncWebServerResponse *response = request->beginResponse(
+            ok ? 200 : 400, "application/json",
+            ok ? "{\"success\":true}"
+               : "{\"success\":false,\"message\":\"Unknown rule.\"}");
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        request->send(response);
+    }
+
+    /**
+     * Run a queued request on the given unit and fill in the response
+     * document. Returns the HTTP status code.
+     */
+    int respond_to_request(Device &device, const Job &job, JsonDocument &doc) {
+        const Endpoint &endpoint    = *job.endpoint;
+        Z906           &amp         = device.amp;
+        uint8_t         parsedValue = 0;
+        int             cmdResponse;
+        int             code = 200;
+
+        // A status read within STATUS_CACHE_TTL proves the unit is connected
+        if (!device.online() ||
+            (amp.status_age() > STATUS_CACHE_TTL && amp.request(VERSION) == Z906_ERROR)) {
+            device.set_online(false);
+            doc["status"] = "disconnected";
+            return code;
+        }
+        device.set_online(true);
+        // The probe may have read a change made on the console
+        if (device.status_changed())
+            broadcastStatus(device);
         doc["status"]  = "connected";
         doc["success"] = true;
 #ifdef DEBUG_BUILD
         JsonObject debug  = doc["debug"].to<JsonObject>();
         debug["version"]  = FIRMWARE_VERSION;
         debug["freeheap"] = ESP.getFreeHeap();
+        debug["device"]   = device.index;
         debug["path"]     = endpoint.path;
         debug["type"]     = endpoint.type;
         debug["action"]   = endpoint.action;
@@ -234,27 +803,31 @@ namespace z906remote {
 
         switch (endpoint.type) {
         case EndpointType::SelectInput:
-            LOGI.input(endpoint.action);
-            broadcastStatus();
+            amp.input(endpoint.action);
+            broadcastStatus(device);
+            device.push_update();
             break;
         case EndpointType::RunCommand:
-            cmdResponse = LOGI.cmd(endpoint.action);
-            broadcastStatus();
-            if (cmdResponse) {
+            cmdResponse = amp.cmd(endpoint.action);
+            broadcastStatus(device);
+            device.push_update();
+            if (cmdResponse != Z906_ERROR) {
                 doc["value"] = cmdResponse;
             } else {
                 doc["success"] = false;
             }
             break;
         case EndpointType::SetValue:
-            value = request->getParam("value")->value().toInt();
 #ifdef DEBUG_BUILD
-            debug["value"]    = request->getParam("value")->value();
-            debug["valueInt"] = value;
+            debug["value"] = job.value;
 #endif
-            if (validate_input_value(value, parsedValue)) {
-                LOGI.cmd(endpoint.action, parsedValue);
-                broadcastStatus();
+            if (validate_input_value(job.value, parsedValue)) {
+                if (amp.cmd(endpoint.action, parsedValue) != Z906_ERROR) {
+                    broadcastStatus(device);
+                    device.push_update();
+                } else {
+                    doc["success"] = false;
+                }
             } else {
                 code           = 400;
                 doc["success"] = false;
@@ -263,27 +836,33 @@ namespace z906remote {
             }
             break;
         case EndpointType::GetValue:
-            doc["value"] = LOGI.request(endpoint.action);
+            cmdResponse = amp.request(endpoint.action);
+            if (cmdResponse != Z906_ERROR) {
+                doc["value"] = cmdResponse;
+            } else {
+                doc["success"] = false;
+            }
             break;
         case EndpointType::RunFunction:
             switch (endpoint.action) {
             case FunctionAction::Status:
-                handle_get_status(doc);
+                doc["generation"] = device.generation();
+                handle_get_status(amp, doc);
                 break;
             case FunctionAction::Mute:
-                handle_muted_state(doc);
+                handle_muted_state(amp, doc);
                 break;
             case FunctionAction::Effect:
-                handle_current_effect(doc);
+                handle_current_effect(amp, doc);
                 break;
             case FunctionAction::Temperature:
-                handle_get_temperature(doc);
+                handle_get_temperature(amp, doc);
                 break;
             case FunctionAction::Decode:
-                handle_decode_mode_state(doc);
+                handle_decode_mode_state(amp, doc);
                 break;
             case FunctionAction::Volume:
-                handle_get_volume(doc);
+                handle_get_volume(amp, doc);
                 break;
             default: // do nothing
                 break;
@@ -297,12 +876,11 @@ namespace z906remote {
                 "Your action was recognised, but it is not supported.";
             break;
         }
-        serializeJson(doc, *response);
-        response->setCode(code);
+        return code;
     }
 
-    inline void handle_get_status(JsonDocument &doc) {
-        const Z906::t_packetdata packet = LOGI.get_data();
+    inline void handle_get_status(Z906 &amp, JsonDocument &doc) {
+        const Z906::t_packetdata packet = amp.get_data();
         JsonObject               data   = doc["data"].to<JsonObject>();
 
         data["main_level"]    = packet.main_level;
@@ -310,9 +888,9 @@ namespace z906remote {
         data["rear_level"]    = packet.rear_level;
         data["sub_level"]     = packet.sub_level;
         data["current_input"] = packet.current_input;
-        data["current_fx"]    = LOGI.current_effect();
-        data["muted"]         = LOGI.muted_state();
-        data["decode_mode"]   = LOGI.decode_mode();
+        data["current_fx"]    = amp.current_effect();
+        data["muted"]         = amp.muted_state();
+        data["decode_mode"]   = amp.decode_mode();
         data["fx_input_1"]    = packet.fx_input_1;
         data["fx_input_2"]    = packet.fx_input_2;
         data["fx_input_3"]    = packet.fx_input_3;
@@ -328,38 +906,108 @@ namespace z906remote {
     /**
      * Get the muted state.
      */
-    inline void handle_muted_state(JsonDocument &doc) {
-        doc["value"] = LOGI.muted_state();
+    inline void handle_muted_state(Z906 &amp, JsonDocument &doc) {
+        doc["value"] = amp.muted_state();
     }
 
     /**
      * Get the Effect on the current input
      */
-    inline void handle_current_effect(JsonDocument &doc) {
-        doc["value"] = LOGI.current_effect();
+    inline void handle_current_effect(Z906 &amp, JsonDocument &doc) {
+        doc["value"] = amp.current_effect();
     }
 
     /**
      * Handle the getTemperature function.
      */
-    inline void handle_get_temperature(JsonDocument &doc) {
-        const uint8_t value = LOGI.main_sensor();
-        doc["success"]      = !value ? false : true;
-        doc["value"]        = value;
+    inline void handle_get_temperature(Z906 &amp, JsonDocument &doc) {
+        const int value = amp.main_sensor();
+        if (value != Z906_ERROR) {
+            doc["value"] = value;
+        } else {
+            doc["success"] = false;
+        }
     }
 
     /**
      * Get the 5.1 Decode Mode state.
      */
-    inline void handle_decode_mode_state(JsonDocument &doc) {
-        doc["value"] = LOGI.decode_mode();
+    inline void handle_decode_mode_state(Z906 &amp, JsonDocument &doc) {
+        doc["value"] = amp.decode_mode();
     }
 
     /**
      * Get the volume on the current input
      */
-    inline void handle_get_volume(JsonDocument &doc) {
-        doc["value"] = LOGI.input_volume();
+    inline void handle_get_volume(Z906 &amp, JsonDocument &doc) {
+        const int32_t value = amp.input_volume();
+        if (value != Z906_ERROR) {
+            doc["value"] = value;
+        } else {
+            doc["success"] = false;
+        }
+    }
+
+#ifdef MQTT_HOST
+    /**
+     * Setup the MQTT client, the connection is made from handle_mqtt().
+     */
+    void init_mqtt() {
+        MQTT_CLIENT.setServer(MQTT_HOST, MQTT_PORT);
+        MQTT_CLIENT.setCallback(on_mqtt_message);
+    }
+
+    /**
+     * Keep the broker connection alive and publish the settled status
+     * changes. Connecting blocks, so it is only attempted with WiFi up and
+     * every MQTT_RECONNECT_INTERVAL ms.
+     */
+    void handle_mqtt() {
+        if (!MQTT_CLIENT.connected() && WIFI.connected() &&
+            static_cast<long>(millis() - mqttRetryAt) >= 0) {
+            mqttRetryAt = millis() + MQTT_RECONNECT_INTERVAL;
+#    ifdef MQTT_USER
+            const bool connected = MQTT_CLIENT.connect(
+                "logitech-z906", MQTT_USER, MQTT_PASSWORD,
+                MQTT.availability_topic(), 0, true, "offline");
+#    else
+            const bool connected =
+                MQTT_CLIENT.connect("logitech-z906", MQTT.availability_topic(),
+                                    0, true, "offline");
+#    endif
+            if (connected) {
+                MQTT_CLIENT.subscribe(MQTT.command_filter());
+                MQTT.connected();
+            }
+        }
+
+        MQTT_CLIENT.loop();
+        MQTT.loop();
+    }
+
+    /**
+     * Publish a retained status field.
+     */
+    bool publish_mqtt(const char *topic, const char *payload) {
+        return MQTT_CLIENT.connected() &&
+               MQTT_CLIENT.publish(topic, payload, true);
+    }
+
+    void on_mqtt_message(char *topic, uint8_t *payload, unsigned int len) {
+        MQTT.message(topic, reinterpret_cast<const char *>(payload), len);
+    }
+#endif
+
+    /**
+     * Queue a command nobody waits a response for on its unit, from MQTT or
+     * an automation rule. Its effect comes back through broadcastStatus()
+     * like for a HTTP request.
+     */
+    void queue_command(uint8_t index, const Endpoint &endpoint, long value) {
+        for (Device &device : DEVICES) {
+            if (device.index == index)
+                device.push_command(endpoint, value);
+        }
     }
 
     /**
@@ -384,26 +1032,59 @@ namespace z906remote {
  * Setup
  */
 void setup() {
+    Serial.begin(BAUD_RATE, SERIAL_CONFIG);
+#ifdef Z906_UART_SWAP
+    // Move UART0 to GPIO13 (RX) / GPIO15 (TX)
+    Serial.swap();
+#endif
+#ifdef Z906_SOFTSERIAL_RX
+    z906remote::SOFTSERIAL.begin(BAUD_RATE, SWSERIAL_8O1);
+#endif
     LittleFS.begin();
     z906remote::init_wifi();
     z906remote::timeClient.begin();
-    while (!z906remote::timeClient.update()) {
-        z906remote::timeClient.forceUpdate();
-    }
-    z906remote::currentTime = z906remote::timeClient.getEpochTime();
+    if (z906remote::WIFI.connected() && z906remote::timeClient.forceUpdate())
+        z906remote::currentTime = z906remote::timeClient.getEpochTime();
+    z906remote::bootId = ESP.random();
     z906remote::init_web_server();
+#ifdef MQTT_HOST
+    z906remote::init_mqtt();
+#endif
+    for (z906remote::Device &device : z906remote::DEVICES) {
+#ifdef Z906_LOUDNESS
+        device.amp.set_loudness(true);
+#endif
+        device.push_update();
+    }
+    z906remote::AUTOMATION.begin(
+        z906remote::DEVICES,
+        sizeof(z906remote::DEVICES) / sizeof(z906remote::DEVICES[0]),
+        []() -> uint32_t {
+            // Local time, 0 until NTP answered
+            return z906remote::timeClient.isTimeSet()
+                       ? z906remote::timeClient.getEpochTime() + AUTOMATION_UTC_OFFSET
+                       : 0;
+        },
+        z906remote::queue_command);
     ArduinoOTA.setPassword(OTApassword);
     ArduinoOTA.begin();
+    z906remote::init_tasks();
 }
 
 /**
  * Loop
  */
 void loop() {
-    if (WiFi.status() != WL_CONNECTED)
-        z906remote::connect_to_wifi();
-    z906remote::timeClient.update();
-    ArduinoOTA.handle();
-    z906remote::updateClients();
-    z906remote::WS.cleanupClients();
+    z906remote::LoopMonitor &monitor = z906remote::MONITOR;
+
+    monitor.start();
+    monitor.stage("serial");
+    for (z906remote::Device &device : z906remote::DEVICES)
+        z906remote::service_device(device);
+    const unsigned long idle = z906remote::TASKS.run(monitor);
+    monitor.finish();
+
+    // Sleep until the next deadline, or until a request is queued
+    esp_delay(
+        idle, [] { return !z906remote::jobs_pending(); }, TASK_WAKE_CHECK);
 }
@@ -0,0 +1,246 @@
+#include "mqtt_bridge.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+namespace z906remote {
+
+    namespace {
+        const char *const FIELD_NAMES[STATUS_FIELD_COUNT] = {
+            "main_level",    "center_level",  "rear_level", "sub_level",
+            "current_input", "current_fx",    "muted",      "decode_mode",
+            "fx_input_1",    "fx_input_2",    "fx_input_3", "fx_input_4",
+            "fx_input_5",    "fx_input_aux",  "spdif_status",
+            "signal_status", "stby",          "auto_stby"};
+
+        bool parse_bool(const char *payload, bool &value) {
+            if (!strcasecmp(payload, "true") || !strcasecmp(payload, "on") ||
+                !strcmp(payload, "1")) {
+                value = true;
+                return true;
+            }
+            if (!strcasecmp(payload, "false") || !strcasecmp(payload, "off") ||
+                !strcmp(payload, "0")) {
+                value = false;
+                return true;
+            }
+            return false;
+        }
+
+        bool parse_number(const char *payload, long &value) {
+            char *end;
+            value = strtol(payload, &end, 10);
+            return end != payload && *end == '\0';
+        }
+
+        /**
+         * Endpoint path of a write to a status field, e.g. muted=true is
+         * /mute/on. Returns false for read-only fields and invalid values.
+         */
+        bool command_path(int field, const char *payload, char *path,
+                          size_t size, long &value) {
+            static const char *const levels[] = {"main", "center", "rear",
+                                                 "sub"};
+            bool flag;
+
+            switch (field) {
+            case MainLevel:
+            case CenterLevel:
+            case RearLevel:
+            case SubLevel:
+                snprintf(path, size, "/volume/%s/set", levels[field]);
+                return parse_number(payload, value);
+            case CurrentInput:
+            case CurrentFx:
+                // Format the number parsed, the payload may be longer
+                if (!parse_number(payload, value) || value < 0 || value > UINT8_MAX)
+                    return false;
+                snprintf(path, size,
+                         field == CurrentInput ? "/input/%u" : "/input/effect/%u",
+                         static_cast<uint8_t>(value));
+                return true;
+            case Muted:
+                if (!parse_bool(payload, flag))
+                    return false;
+                snprintf(path, size, "/mute/%s", flag ? "on" : "off");
+                return true;
+            case DecodeMode:
+                if (!parse_bool(payload, flag))
+                    return false;
+                snprintf(path, size, "/input/decode/%s", flag ? "on" : "off");
+                return true;
+            case Stby:
+                if (!parse_bool(payload, flag))
+                    return false;
+                snprintf(path, size, "/power/%s", flag ? "off" : "on");
+                return true;
+            default:
+                return false;
+            }
+        }
+    } // namespace
+
+    /**
+     * Read the fields of handle_get_status() from the status cache.
+     */
+    void status_fields(Z906 &amp, uint8_t fields[STATUS_FIELD_COUNT]) {
+        const Z906::t_packetdata packet = amp.get_data();
+
+        fields[MainLevel]    = packet.main_level;
+        fields[CenterLevel]  = packet.center_level;
+        fields[RearLevel]    = packet.rear_level;
+        fields[SubLevel]     = packet.sub_level;
+        fields[CurrentInput] = packet.current_input;
+        fields[CurrentFx]    = amp.current_effect();
+        fields[Muted]        = amp.muted_state();
+        fields[DecodeMode]   = amp.decode_mode();
+        fields[FxInput1]     = packet.fx_input_1;
+        fields[FxInput2]     = packet.fx_input_2;
+        fields[FxInput3]     = packet.fx_input_3;
+        fields[FxInput4]     = packet.fx_input_4;
+        fields[FxInput5]     = packet.fx_input_5;
+        fields[FxInputAux]   = packet.fx_input_aux;
+        fields[SpdifStatus]  = packet.spdif_status;
+        fields[SignalStatus] = packet.signal_status;
+        fields[Stby]         = packet.stby;
+        fields[AutoStby]     = packet.auto_stby;
+    }
+
+    MqttBridge::MqttBridge(const char *prefix, PublishHandler publish,
+                           CommandHandler command)
+        : _prefix(prefix), _publish(publish), _command(command) {
+        snprintf(_filter, sizeof(_filter), "%s/+/+/set", prefix);
+        snprintf(_availability, sizeof(_availability), "%s/status", prefix);
+    }
+
+    /**
+     * Take the new status of a unit, fed from the same place as the
+     * WebSocket and /events broadcasts. Only the fields that differ from
+     * what was last published are sent, once the burst has settled.
+     */
+    void MqttBridge::status_changed(uint8_t device,
+                                    const uint8_t fields[STATUS_FIELD_COUNT]) {
+        if (device >= MQTT_MAX_DEVICES)
+            return;
+        DeviceState &state = _devices[device];
+
+        memcpy(state.pending, fields, sizeof(state.pending));
+        state.unpublished = 0;
+        for (int i = 0; i < STATUS_FIELD_COUNT; i++) {
+            if (!state.known || state.pending[i] != state.published[i])
+                state.unpublished |= UINT32_C(1) << i;
+        }
+
+        const unsigned long now = millis();
+        if (!state.dirty)
+            state.first_change = now;
+        state.last_change = now;
+        state.dirty       = state.unpublished != 0;
+    }
+
+    /**
+     * The transport (re)connected: announce availability and republish
+     * every field, the broker may have lost its retained messages.
+     */
+    void MqttBridge::connected() {
+        _publish(_availability, "online");
+        for (DeviceState &state : _devices) {
+            if (!state.known)
+                continue;
+            state.unpublished = (UINT32_C(1) << STATUS_FIELD_COUNT) - 1;
+            state.dirty       = true;
+        }
+    }
+
+    /**
+     * Publish the bursts that have settled.
+     */
+    void MqttBridge::loop() {
+        const unsigned long now = millis();
+
+        for (uint8_t device = 0; device < MQTT_MAX_DEVICES; device++) {
+            const DeviceState &state = _devices[device];
+            if (state.dirty &&
+                (now - state.last_change >= MQTT_COALESCE_DELAY ||
+                 now - state.first_change >= MQTT_COALESCE_MAX))
+                flush(device);
+        }
+    }
+
+    void MqttBridge::flush(uint8_t device) {
+        DeviceState &state = _devices[device];
+        char         topic[MQTT_TOPIC_SIZE];
+        char         payload[8];
+
+        for (int i = 0; i < STATUS_FIELD_COUNT; i++) {
+            const uint32_t bit = UINT32_C(1) << i;
+            if (!(state.unpublished & bit))
+                continue;
+
+            snprintf(topic, sizeof(topic), "%s/%u/%s", _prefix, device,
+                     FIELD_NAMES[i]);
+            if (i == Muted || i == DecodeMode)
+                snprintf(payload, sizeof(payload), "%s",
+                         state.pending[i] ? "true" : "false");
+            else
+                snprintf(payload, sizeof(payload), "%u", state.pending[i]);
+
+            if (!_publish(topic, payload))
+                break; // retried on the next loop, or after reconnecting
+            state.published[i] = state.pending[i];
+            state.unpublished &= ~bit;
+        }
+
+        if (!state.unpublished)
+            state.known = true;
+        state.dirty        = state.unpublished != 0;
+        state.first_change = millis();
+    }
+
+    /**
+     * Handle a message on <prefix>/<device>/<field>/set by queuing the
+     * matching endpoint, like a HTTP request would.
+     */
+    void MqttBridge::message(const char *topic, const char *data, size_t len) {
+        const size_t prefix_len = strlen(_prefix);
+        char         payload[16];
+        char         path[24];
+        long         value = -1;
+
+        if (strncmp(topic, _prefix, prefix_len) != 0 || topic[prefix_len] != '/')
+            return;
+
+        const char         *start = topic + prefix_len + 1;
+        char               *field;
+        const unsigned long device = strtoul(start, &field, 10);
+        if (field == start || *field != '/' || device >= MQTT_MAX_DEVICES)
+            return;
+        field++;
+
+        const char *suffix = strchr(field, '/');
+        if (!suffix || strcmp(suffix, "/set") != 0 ||
+            len >= sizeof(payload))
+            return;
+        memcpy(payload, data, len);
+        payload[len] = '\0';
+
+        const size_t name_len = static_cast<size_t>(suffix - field);
+        for (int i = 0; i < STATUS_FIELD_COUNT; i++) {
+            if (strncmp(field, FIELD_NAMES[i], name_len) != 0 ||
+                FIELD_NAMES[i][name_len] != '\0')
+                continue;
+            if (!command_path(i, payload, path, sizeof(path), value))
+                return;
+
+            for (const Endpoint &e : endpoints) {
+                if (strcmp(e.path, path) == 0) {
+                    _command(static_cast<uint8_t>(device), e, value);
+                    return;
+                }
+            }
+            return;
+        }
+    }
+
+} // namespace z906remote
@@ -0,0 +1,92 @@
+#include "scheduler.h"
+
+namespace z906remote {
+
+    /**
+     * Queue a job in the given class.
+     * Returns false if the class is full, the job is left untouched.
+     */
+    bool Scheduler::push(Job &&job, Priority priority) {
+        SchedulerStats &stats = _stats[priority];
+
+        if (_count[priority] == SCHEDULER_QUEUE_SIZE) {
+            stats.rejected++;
+            return false;
+        }
+
+        job.queued_at = millis();
+        _queue[priority][(_head[priority] + _count[priority]) %
+                         SCHEDULER_QUEUE_SIZE] = std::move(job);
+        _count[priority]++;
+        if (_count[priority] > stats.depth_max)
+            stats.depth_max = static_cast<uint8_t>(_count[priority]);
+        return true;
+    }
+
+    /**
+     * Take the next job to run, if any.
+     */
+    bool Scheduler::pop(Job &job) {
+        const unsigned long now    = millis();
+        int                 chosen = -1;
+
+        for (int p = 0; p < PRIORITY_COUNT; p++) {
+            if (_count[p] == 0)
+                continue;
+            if (chosen < 0)
+                chosen = p;
+            // Lower classes are not starved for more than SCHEDULER_MAX_WAIT
+            if (now - _queue[p][_head[p]].queued_at > SCHEDULER_MAX_WAIT) {
+                chosen = p;
+                break;
+            }
+        }
+        if (chosen < 0)
+            return false;
+
+        job = std::move(_queue[chosen][_head[chosen]]);
+        _head[chosen] = (_head[chosen] + 1) % SCHEDULER_QUEUE_SIZE;
+        _count[chosen]--;
+
+        SchedulerStats &stats = _stats[chosen];
+        const uint32_t  wait  = now - job.queued_at;
+        stats.served++;
+        stats.wait_sum += wait;
+        if (wait > stats.wait_max)
+            stats.wait_max = wait;
+        return true;
+    }
+
+    /**
+     * Account for the time a job held the serial link.
+     */
+    void Scheduler::record_service(unsigned long duration) {
+        _service_avg = (_service_avg * 7 + duration) / 8;
+    }
+
+    size_t Scheduler::depth(Priority priority) const { return _count[priority]; }
+
+    bool Scheduler::empty() const {
+        for (size_t count : _count) {
+            if (count)
+                return false;
+        }
+        return true;
+    }
+
+    const SchedulerStats &Scheduler::stats(Priority priority) const {
+        return _stats[priority];
+    }
+
+    /**
+     * Seconds a rejected client should wait, from the work already queued.
+     */
+    uint32_t Scheduler::retry_after() const {
+        size_t queued = 0;
+        for (size_t count : _count) queued += count;
+
+        const uint32_t seconds = (queued * _service_avg + 999) / 1000;
+        return seconds ? seconds : 1;
+    }
+
+} // namespace z906remote
@@ -0,0 +1,67 @@
+#include "service_advert.h"
+#include "version.h"
+
+namespace z906remote {
+
+    /**
+     * Add the service to the mDNS responder, which must have been started.
+     * Later calls, e.g. after a reconnection, keep the service added first.
+     */
+    void ServiceAdvert::begin(Device *devices, uint8_t count, uint16_t port) {
+        _devices = devices;
+        _count   = count;
+        if (_service)
+            return;
+
+        _service = MDNS.addService(nullptr, ADVERT_SERVICE, ADVERT_PROTOCOL, port);
+        if (!_service)
+            return;
+        MDNS.setDynamicServiceTxtCallback(
+            _service,
+            [this](const MDNSResponder::hMDNSService service) { fill_txt(service); });
+    }
+
+    /**
+     * Announce the pending status change, once ADVERT_ANNOUNCE_MIN ms passed
+     * since the previous announcement.
+     */
+    void ServiceAdvert::loop() {
+        if (!_changed || !_service ||
+            millis() - _announced_at < ADVERT_ANNOUNCE_MIN)
+            return;
+
+        _changed      = false;
+        _announced_at = millis();
+        MDNS.announce();
+    }
+
+    /**
+     * Fill the TXT record from the cached status of the units, called by the
+     * responder for every answer and announcement.
+     */
+    void ServiceAdvert::fill_txt(MDNSResponder::hMDNSService service) {
+        char key[5];
+        char value[ADVERT_VALUE_SIZE];
+
+        MDNS.addDynamicServiceTxt(service, "api", static_cast<uint32_t>(API_VERSION));
+        MDNS.addDynamicServiceTxt(service, "fw", FIRMWARE_VERSION);
+        MDNS.addDynamicServiceTxt(service, "n", static_cast<uint32_t>(_count));
+
+        for (uint8_t i = 0; i < _count; i++) {
+            const Device &device = _devices[i];
+
+            snprintf(key, sizeof(key), "d%u", device.index);
+            if (!device.online() || device.amp.status_age() == UINT32_MAX) {
+                MDNS.addDynamicServiceTxt(service, key, "-");
+                continue;
+            }
+
+            const Z906::t_packetdata status = device.amp.get_data();
+            snprintf(value, sizeof(value), "%u,%u,%u,%lu", !status.stby,
+                     status.current_input, status.main_level,
+                     static_cast<unsigned long>(device.generation()));
+            MDNS.addDynamicServiceTxt(service, key, value);
+        }
+    }
+
+} // namespace z906remote
@@ -0,0 +1,132 @@
+#include "tasks.h"
+
+namespace z906remote {
+
+    Tasks::Tasks() { memset(_wheel, -1, sizeof(_wheel)); }
+
+    /**
+     * Register a task run every interval ms, the first time after first ms.
+     * Returns its id, or -1 if TASK_MAX tasks are already registered.
+     */
+    int Tasks::add(const char *name, Callback callback, unsigned long interval,
+                   unsigned long first) {
+        if (_count == TASK_MAX)
+            return -1;
+
+        const int id   = _count++;
+        Task     &task = _tasks[id];
+        task.name      = name;
+        task.callback  = callback;
+        task.interval  = interval < TASK_TICK ? TASK_TICK : interval;
+        task.due       = millis() + first;
+        insert(id);
+        return id;
+    }
+
+    /**
+     * Move the next run of a task to delay ms from now.
+     */
+    void Tasks::schedule(int id, unsigned long delay) {
+        if (id < 0 || id >= _count)
+            return;
+
+        remove(id);
+        _tasks[id].due = millis() + delay;
+        insert(id);
+    }
+
+    /**
+     * Run the tasks that are due, each as a stage of the loop monitor.
+     * Returns the time in ms until the next deadline.
+     */
+    unsigned long Tasks::run(LoopMonitor &monitor) {
+        const unsigned long now     = millis();
+        const unsigned long current = now / TASK_TICK;
+
+        // Ticks older than a revolution alias onto the slots processed anyway
+        if (!_started || current - _tick >= TASK_WHEEL_SLOTS)
+            _tick = current - (TASK_WHEEL_SLOTS - 1);
+        _started = true;
+
+        for (unsigned long tick = _tick; tick != current + 1; tick++) {
+            int id = _wheel[tick % TASK_WHEEL_SLOTS];
+            while (id >= 0) {
+                Task     &task = _tasks[id];
+                const int next = task.next;
+
+                if (static_cast<long>(now - task.due) >= 0) {
+                    remove(id);
+                    monitor.stage(task.name);
+                    task.callback();
+
+                    // Keep the cadence unless the task fell behind
+                    task.due += task.interval;
+                    if (static_cast<long>(millis() - task.due) >= 0)
+                        task.due = millis() + task.interval;
+                    insert(id);
+                }
+                id = next;
+            }
+        }
+        _tick = current; // tasks due later in this tick are still pending
+
+        return next_deadline(millis());
+    }
+
+    void Tasks::insert(int id) {
+        Task         &task = _tasks[id];
+        const uint8_t slot = (task.due / TASK_TICK) % TASK_WHEEL_SLOTS;
+
+        task.next    = _wheel[slot];
+        task.queued  = true;
+        _wheel[slot] = static_cast<int8_t>(id);
+    }
+
+    void Tasks::remove(int id) {
+        Task &task = _tasks[id];
+        if (!task.queued)
+            return;
+
+        int8_t *link = &_wheel[(task.due / TASK_TICK) % TASK_WHEEL_SLOTS];
+        while (*link >= 0 && *link != id) link = &_tasks[*link].next;
+        if (*link == id)
+            *link = task.next;
+        task.next   = -1;
+        task.queued = false;
+    }
+
+    /**
+     * Walk the wheel from now, the first slot holding a task due in this
+     * revolution holds the next deadline.
+     */
+    unsigned long Tasks::next_deadline(unsigned long now) const {
+        const unsigned long current  = now / TASK_TICK;
+        unsigned long       earliest = ULONG_MAX;
+
+        for (unsigned long tick = current; tick != current + TASK_WHEEL_SLOTS;
+             tick++) {
+            for (int id = _wheel[tick % TASK_WHEEL_SLOTS]; id >= 0;
+                 id     = _tasks[id].next) {
+                const long wait = static_cast<long>(_tasks[id].due - now);
+                if (wait <= 0)
+                    return 0;
+                if (_tasks[id].due / TASK_TICK == tick &&
+                    static_cast<unsigned long>(wait) < earliest)
+                    earliest = static_cast<unsigned long>(wait);
+            }
+            if (earliest != ULONG_MAX)
+                return earliest;
+        }
+
+        // Nothing within a revolution, take the closest task
+        for (uint8_t id = 0; id < _count; id++) {
+            const long wait = static_cast<long>(_tasks[id].due - now);
+            if (wait <= 0)
+                return 0;
+            if (static_cast<unsigned long>(wait) < earliest)
+                earliest = static_cast<unsigned long>(wait);
+        }
+        return earliest == ULONG_MAX ? 0 : earliest;
+    }
+
+} // namespace z906remote
@@ -0,0 +1,145 @@
+#include "wifi_link.h"
+#include <ESP8266WiFi.h>
+
+namespace z906remote {
+
+    /**
+     * Add a network to try, returns false once WIFI_MAX_NETWORKS are known.
+     */
+    bool WifiLink::add_network(const char *ssid, const char *password) {
+        if (_count == WIFI_MAX_NETWORKS)
+            return false;
+
+        _networks[_count].ssid     = ssid;
+        _networks[_count].password = password;
+        _count++;
+        return true;
+    }
+
+    /**
+     * Configure the soft-AP opened after ms offline, 0 disables it.
+     */
+    void WifiLink::set_fallback(unsigned long ms, const char *ssid,
+                                const char *password) {
+        _ap_fallback = ms;
+        _ap_ssid     = ssid;
+        _ap_password = password;
+    }
+
+    /**
+     * Start connecting. The callback runs every time the station connects.
+     */
+    void WifiLink::begin(Callback on_connected) {
+        _on_connected = on_connected;
+
+        // The link is managed here, keep the SDK from reconnecting on its own
+        // and from writing the credentials to flash on every attempt
+        WiFi.persistent(false);
+        WiFi.setAutoReconnect(false);
+        WiFi.mode(WIFI_STA);
+
+        _offline_at = millis();
+        attempt(0);
+    }
+
+    void WifiLink::step() {
+        const unsigned long now    = millis();
+        const wl_status_t   status = WiFi.status();
+
+        switch (_state) {
+        case Idle:
+            return;
+        case Connected:
+            if (status != WL_CONNECTED) {
+                // Retry the network just lost first
+                _offline_at = now;
+                _backoff    = WIFI_BACKOFF_MIN;
+                attempt(_network);
+            } else if (_ap_active && WiFi.softAPgetStationNum() == 0) {
+                close_ap();
+            }
+            return;
+        case Connecting:
+            if (status == WL_CONNECTED) {
+                _state   = Connected;
+                _backoff = WIFI_BACKOFF_MIN;
+                if (_on_connected)
+                    _on_connected();
+                return;
+            }
+            if (status == WL_CONNECT_FAILED || status == WL_NO_SSID_AVAIL ||
+                now - _since > WIFI_CONNECT_TIMEOUT)
+                next_network();
+            break;
+        case Waiting: {
+            // Scans would drop the clients of the soft-AP, keep them rare
+            const unsigned long wait =
+                ap_in_use() ? max(_wait, static_cast<unsigned long>(WIFI_AP_BUSY_WAIT))
+                            : _wait;
+            if (now - _since >= wait)
+                attempt(0);
+            break;
+        }
+        }
+
+        if (!_ap_active && _ap_fallback && now - _offline_at >= _ap_fallback &&
+            (!_ap_failed || now - _ap_tried >= WIFI_AP_RETRY))
+            open_ap();
+    }
+
+    /**
+     * Start connecting to a network, this returns at once.
+     */
+    void WifiLink::attempt(uint8_t network) {
+        _network = network < _count ? network : 0;
+        _state   = Connecting;
+        _since   = millis();
+
+        if (_count)
+            WiFi.begin(_networks[_network].ssid, _networks[_network].password);
+    }
+
+    /**
+     * Move on to the next network, or wait with backoff after a full round.
+     */
+    void WifiLink::next_network() {
+        if (_network + 1 < _count && !ap_in_use()) {
+            attempt(_network + 1);
+            return;
+        }
+
+        // Equal jitter, so units losing the same AP do not retry in lockstep
+        WiFi.disconnect(false);
+        _state   = Waiting;
+        _since   = millis();
+        _wait    = _backoff / 2 + random(_backoff / 2 + 1);
+        _backoff = min(_backoff * 2, static_cast<unsigned long>(WIFI_BACKOFF_MAX));
+    }
+
+    /**
+     * Open the soft-AP next to the station, which keeps retrying. A failure
+     * goes back to station mode until the next try, WIFI_AP_RETRY ms later.
+     */
+    void WifiLink::open_ap() {
+        WiFi.mode(WIFI_AP_STA);
+        _ap_active = WiFi.softAP(_ap_ssid, _ap_password[0] ? _ap_password : nullptr);
+        _ap_failed = !_ap_active;
+        _ap_tried  = millis();
+        if (_ap_failed)
+            WiFi.mode(WIFI_STA);
+    }
+
+    void WifiLink::close_ap() {
+        WiFi.softAPdisconnect(true);
+        WiFi.mode(WIFI_STA);
+        _ap_active = false;
+    }
+
+    /**
+     * Whether local clients are on the soft-AP.
+     */
+    bool WifiLink::ap_in_use() const {
+        return _ap_active && WiFi.softAPgetStationNum() > 0;
+    }
+
+} // namespace z906remote